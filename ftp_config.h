@@ -19,8 +19,20 @@
 #define FTP_CRITICAL_ERROR_HANDLER() do {} while(1)
 #endif
 /* *********** FREERTOS TASK ************** */
+/**
+ * Zero-heap mode
+ *
+ * when set to 1 all tasks and the stats mutex are created with xxxStatic() API
+ * from memory reserved inside FTP_STRUCT_MEM_SECTION, nothing is taken from FreeRTOS heap,
+ * requires configSUPPORT_STATIC_ALLOCATION = 1 and lwIP with MEMP_MEM_MALLOC = 0
+ * (netconns, pbufs and tcp pcbs then come from lwIP static memp pools)
+ */
+#ifndef FTP_STATIC_ALLOCATION
+#define FTP_STATIC_ALLOCATION	0
+#endif
+
 #ifndef FTP_CLIENT_TASK_STATIC
-#define FTP_CLIENT_TASK_STATIC	0
+#define FTP_CLIENT_TASK_STATIC	FTP_STATIC_ALLOCATION
 #endif
 
 #ifndef FTP_CLIENT_TASK_STACK_SIZE
@@ -31,6 +43,14 @@
 #define FTP_CLIENT_TASK_PRIORITY 24
 #endif
 
+#ifndef FTP_SERVER_TASK_STATIC
+#define FTP_SERVER_TASK_STATIC	FTP_STATIC_ALLOCATION
+#endif
+
+#ifndef FTP_MUTEX_STATIC
+#define FTP_MUTEX_STATIC	FTP_STATIC_ALLOCATION
+#endif
+
 #ifndef FTP_SERVER_TASK_STACK_SIZE
 #define FTP_SERVER_TASK_STACK_SIZE	128
 #endif
@@ -78,8 +98,42 @@
 #define FTP_SERVER_WRITE_TIMEOUT_MS 3000
 #endif
 
+/**
+ * Adaptive write timeout of data connection
+ *
+ * timeout of every write is derived from throughput measured on this session:
+ * (chunk + TCP_SND_BUF) / throughput * FTP_WRITE_TIMEOUT_FACTOR, clamped to MIN..MAX,
+ * FTP_SERVER_WRITE_TIMEOUT_MS is used for control connection and until throughput is known
+ */
+#ifndef FTP_ADAPTIVE_WRITE_TIMEOUT
+#define FTP_ADAPTIVE_WRITE_TIMEOUT 1
+#endif
+
+#ifndef FTP_WRITE_TIMEOUT_FACTOR
+#define FTP_WRITE_TIMEOUT_FACTOR 4
+#endif
+
+#ifndef FTP_WRITE_TIMEOUT_MIN_MS
+#define FTP_WRITE_TIMEOUT_MIN_MS 1000
+#endif
+
+#ifndef FTP_WRITE_TIMEOUT_MAX_MS
+#define FTP_WRITE_TIMEOUT_MAX_MS 30000
+#endif
+
 #ifndef FTP_SERVER_INACTIVE_CNT
-#define FTP_SERVER_INACTIVE_CNT 60 // Inactivity time (ms): FTP_SERVER_INACTIVE_CNT * FTP_SERVER_READ_TIMEOUT_MS
+#define FTP_SERVER_INACTIVE_CNT 60 // kept for compatibility, used only to derive FTP_SERVER_INACTIVE_TIMEOUT_MS
+#endif
+
+/**
+ * Inactivity timeout of control connection
+ *
+ * client waits for next command with one blocking receive until deadline,
+ * with LWIP_NETCONN_FULLDUPLEX = 1 the wait is interrupted by ftp_stop(),
+ * otherwise it is split into FTP_SERVER_READ_TIMEOUT_MS slices to check stop request and ETH link
+ */
+#ifndef FTP_SERVER_INACTIVE_TIMEOUT_MS
+#define FTP_SERVER_INACTIVE_TIMEOUT_MS (FTP_SERVER_INACTIVE_CNT * FTP_SERVER_READ_TIMEOUT_MS)
 #endif
 
 #ifndef FTP_PSV_ACCEPT_TIMEOUT_MS
@@ -90,14 +144,71 @@
 #define FTP_PSV_LISTEN_TIMEOUT_MS 5000
 #endif
 
-#ifndef FTP_STOR_RECV_TIMEOUT_MS
-#define FTP_STOR_RECV_TIMEOUT_MS 5000
+/**
+ * Transfer stall detection
+ *
+ * transfer is aborted when less than FTP_XFER_MIN_BPS bytes per second were moved
+ * during last FTP_XFER_STALL_WINDOW_MS, slow but progressing transfers are not aborted
+ */
+#ifndef FTP_XFER_MIN_BPS
+#define FTP_XFER_MIN_BPS 512
+#endif
+
+#ifndef FTP_XFER_STALL_WINDOW_MS
+#define FTP_XFER_STALL_WINDOW_MS 10000
 #endif
 
 #ifndef FTP_USE_PASSIVE_MODE
 #define FTP_USE_PASSIVE_MODE 1
 #endif
 
+/**
+ * File locks between sessions
+ *
+ * RETR takes shared lock, STOR exclusive one, conflicting STOR/RETR and DELE, RMD, RNTO
+ * of file or directory in use by other session are refused with 450, paths are
+ * compared without case of ASCII letters like FAT does
+ */
+#ifndef FTP_FILE_LOCK
+#define FTP_FILE_LOCK 0
+#endif
+
+/**
+ * TCP option profile
+ *
+ * control connection: keepalive detects dead clients behind NAT without waiting
+ * for inactivity timeout, Nagle is disabled so short replies are not delayed
+ * data connection: Nagle stays enabled and writes are flagged NETCONN_MORE,
+ * so full segments are sent and PSH is set only at the end of transfer
+ * keepalive interval and count need LWIP_TCP_KEEPALIVE = 1 in lwipopts.h
+ */
+#ifndef FTP_TCP_PROFILE
+#define FTP_TCP_PROFILE 1
+#endif
+
+#ifndef FTP_CTRL_KEEPALIVE_IDLE_MS
+#define FTP_CTRL_KEEPALIVE_IDLE_MS 60000
+#endif
+
+#ifndef FTP_CTRL_KEEPALIVE_INTVL_MS
+#define FTP_CTRL_KEEPALIVE_INTVL_MS 10000
+#endif
+
+#ifndef FTP_CTRL_KEEPALIVE_CNT
+#define FTP_CTRL_KEEPALIVE_CNT 4
+#endif
+
+/**
+ * Size of one write to data connection during RETR
+ *
+ * hint how much data is queued to TCP send buffer at once, bigger writes need
+ * less calls into tcpip thread, should be between TCP_MSS and TCP_SND_BUF
+ * and no more than FTP_BUF_SIZE
+ */
+#ifndef FTP_DATA_WRITE_SIZE
+#define FTP_DATA_WRITE_SIZE TCP_MSS
+#endif
+
 /* *********** MEMORY ************** */
 /**
  * FTP main working buffer size
@@ -111,10 +222,201 @@
 #define FTP_BUF_SIZE_MULT 32
 #endif
 
+/**
+ * SITE SYNC, manifest comparison
+ *
+ * manifest of client is kept in transfer buffer, about 30 bytes + name length per file,
+ * when it does not fit the rest of manifest is checked one file by one
+ * FTP_SYNC_MAX_DEPTH - max directory depth of tree walk, sizeof(DIR) of transfer buffer per level
+ */
+#ifndef FTP_SITE_SYNC
+#define FTP_SITE_SYNC (FTP_BUF_SIZE_MULT >= 4)
+#endif
+
+#ifndef FTP_SYNC_MAX_DEPTH
+#define FTP_SYNC_MAX_DEPTH 8
+#endif
+
+/**
+ * Max directory depth of recursive delete (RMDA, SITE RMDIR), sizeof(DIR) of transfer buffer per level,
+ * deeper directories are kept and reported as not removed
+ */
+#ifndef FTP_TREE_MAX_DEPTH
+#define FTP_TREE_MAX_DEPTH (FTP_BUF_SIZE_MULT >= 2 ? 16 : 4)
+#endif
+
+/**
+ * Change journal, SITE CHANGES SINCE <seq>
+ *
+ * creates, modifications, deletes and renames done by FTP commands and reported by application
+ * with ftp_notify_change() get increasing sequence number and are appended to journal file,
+ * one line per change: "<seq> <C|M|D|R> <size> <path>", rename is R line with old path
+ * followed by N line with new path and the same seq
+ * records are collected in RAM and written as whole 512 byte sectors, not full sector is written
+ * FTP_JOURNAL_FLUSH_MS after its first record (checked by server task about every second and after
+ * each command), at the end of session, before SITE CHANGES and by ftp_journal_flush()
+ * when file reaches FTP_JOURNAL_MAX_SIZE / 2 it replaces FTP_JOURNAL_OLD_PATH and new one is started,
+ * names starting with dot are hidden from listings, commands of clients on journal files are refused
+ * journal files are written and read under own mutex
+ * RAM: 512 + sizeof(FIL), one more mutex
+ */
+#ifndef FTP_JOURNAL
+#define FTP_JOURNAL 0
+#endif
+
+#ifndef FTP_JOURNAL_PATH
+#define FTP_JOURNAL_PATH "/.ftp_journal"
+#endif
+
+#ifndef FTP_JOURNAL_OLD_PATH
+#define FTP_JOURNAL_OLD_PATH "/.ftp_journal.old"
+#endif
+
+#ifndef FTP_JOURNAL_MAX_SIZE
+#define FTP_JOURNAL_MAX_SIZE (64 * 1024)
+#endif
+
+#ifndef FTP_JOURNAL_FLUSH_MS
+#define FTP_JOURNAL_FLUSH_MS 5000
+#endif
+
+/**
+ * SITE WATCH, changes streamed over data connection
+ *
+ * the same changes as for change journal are queued for every watching session,
+ * queue is kept in transfer buffer of watching session, which is not used for transfer meanwhile,
+ * so it holds about FTP_BUF_SIZE / (_MAX_LFN + 24) changes, when it is full changes are dropped
+ * and client is told how many
+ * FTP_WATCH_POLL_MS - max delay of change and of noticing that client closed data connection
+ */
+#ifndef FTP_SITE_WATCH
+#define FTP_SITE_WATCH 0
+#endif
+
+#ifndef FTP_WATCH_POLL_MS
+#define FTP_WATCH_POLL_MS 100
+#endif
+
+/**
+ * SITE CPFR/CPTO, copy of file by server
+ *
+ * file is copied in chunks of transfer buffer aligned to clusters of destination,
+ * destination is preallocated when FATFS has f_expand (_USE_EXPAND = 1)
+ * paths have no drive prefix, so both files are on default volume, copy between volumes is not supported
+ * FTP_COPY_POLL_MS - how often control connection is checked for STAT and ABOR during copy
+ */
+#ifndef FTP_SITE_COPY
+#define FTP_SITE_COPY 0
+#endif
+
+#ifndef FTP_COPY_POLL_MS
+#define FTP_COPY_POLL_MS 200
+#endif
+
+/**
+ * Memory placement
+ *
+ * FTP_STRUCT_MEM_SECTION - session state (control buffers, paths, FIL) and static task objects
+ * FTP_BUFF_MEM_SECTION - transfer buffers (FTP_BUF_SIZE per client), these are passed to FATFS
+ *                        and may be accessed by SD/MMC DMA
+ * example: #define FTP_BUFF_MEM_SECTION(f) f __attribute__((section(".ram_d1")))
+ */
 #ifndef FTP_STRUCT_MEM_SECTION
 #define FTP_STRUCT_MEM_SECTION(f)  f
 #endif
 
+#ifndef FTP_BUFF_MEM_SECTION
+#define FTP_BUFF_MEM_SECTION(f)  FTP_STRUCT_MEM_SECTION(f)
+#endif
+
+/**
+ * D-cache maintenance
+ *
+ * when transfer buffers are placed in cacheable RAM and storage driver uses DMA
+ * without its own cache maintenance, define these hooks, f.e. for Cortex-M7:
+ * #define FTP_DCACHE_CLEAN(addr, size)		SCB_CleanDCache_by_Addr((uint32_t*)(addr), (int32_t)(size))
+ * #define FTP_DCACHE_INVALIDATE(addr, size)	SCB_InvalidateDCache_by_Addr((uint32_t*)(addr), (int32_t)(size))
+ *
+ * FTP_DCACHE_CLEAN is called before buffer is handed to FTP_F_WRITE,
+ * FTP_DCACHE_INVALIDATE is called before and after buffer is filled by FTP_F_READ,
+ * address and size are always aligned to FTP_DCACHE_LINE_SIZE
+ */
+#ifndef FTP_DCACHE_LINE_SIZE
+#define FTP_DCACHE_LINE_SIZE 32
+#endif
+
+#ifndef FTP_DCACHE_CLEAN
+#define FTP_DCACHE_CLEAN(addr, size) do {} while(0)
+#endif
+
+#ifndef FTP_DCACHE_INVALIDATE
+#define FTP_DCACHE_INVALIDATE(addr, size) do {} while(0)
+#endif
+
+/**
+ * Shared read of files
+ *
+ * sessions downloading the same unchanged file (same path, size and timestamp)
+ * share window of FTP_SHARED_READ_BLOCKS recently read blocks, block is read
+ * from storage once and copied to all sessions which are close enough behind,
+ * slower sessions read from storage by themselves
+ *
+ * RAM: FTP_SHARED_READ_FILES * FTP_SHARED_READ_BLOCKS * FTP_SHARED_READ_BLOCK_SIZE,
+ * placed in FTP_BUFF_MEM_SECTION
+ * FTP_SHARED_READ_WAIT_MS - how long session waits for block which is being read by other session
+ */
+#ifndef FTP_SHARED_READ
+#define FTP_SHARED_READ 0
+#endif
+
+#ifndef FTP_SHARED_READ_FILES
+#define FTP_SHARED_READ_FILES 2
+#endif
+
+#ifndef FTP_SHARED_READ_BLOCKS
+#define FTP_SHARED_READ_BLOCKS 8
+#endif
+
+#ifndef FTP_SHARED_READ_BLOCK_SIZE
+#define FTP_SHARED_READ_BLOCK_SIZE 4096
+#endif
+
+#ifndef FTP_SHARED_READ_WAIT_MS
+#define FTP_SHARED_READ_WAIT_MS 50
+#endif
+
+/**
+ * Open file cache
+ *
+ * keeps FILINFO and opened FIL of FTP_OPEN_CACHE_ENTRIES recently used files,
+ * so RETR, SIZE, MDTM and CWD of hot files skip FATFS path walk from root,
+ * entries are dropped when FTP command changes the path or its parent,
+ * application which changes files while server runs must call ftp_invalidate_path()
+ *
+ * RAM: FTP_OPEN_CACHE_ENTRIES * (FTP_CWD_SIZE + sizeof(FILINFO) + sizeof(FIL))
+ * requires _FS_LOCK = 0
+ */
+#ifndef FTP_OPEN_CACHE
+#define FTP_OPEN_CACHE 0
+#endif
+
+#ifndef FTP_OPEN_CACHE_ENTRIES
+#define FTP_OPEN_CACHE_ENTRIES 4
+#endif
+
+/**
+ * Lookups relative to current directory
+ *
+ * files are opened and checked by name from FATFS current directory, which is moved
+ * to directory of last lookup, so repeated lookups in one directory scan only it
+ * instead of walking whole path from root, current directory is shared by sessions,
+ * so lookups are serialized by own mutex (one more mutex, see FTP_MUTEX_STATIC)
+ * requires _FS_RPATH >= 1, application must use only absolute paths and must not call f_chdir
+ */
+#ifndef FTP_CWD_RELATIVE
+#define FTP_CWD_RELATIVE 0
+#endif
+
 /* *********** USER/PASS ************** */
 #ifndef FTP_USER_NAME_LEN
 #define FTP_USER_NAME_LEN 32
@@ -142,6 +444,7 @@
 #define FTP_F_UNLINK(path) 					f_unlink(path)
 #define FTP_F_OPEN(fp, path, mode) 			f_open(fp, path, mode)
 #define FTP_F_SIZE(fp) 						f_size(fp)
+#define FTP_F_LSEEK(fp, ofs) 				f_lseek(fp, ofs)
 #define FTP_F_CLOSE(fp) 					f_close(fp)
 #define FTP_F_WRITE(fp, buff, btw, bw) 		f_write(fp, buff, btw, bw)
 #define FTP_F_READ(fp, buff, btr, br) 		f_read(fp, buff, btr, br)
@@ -149,8 +452,54 @@
 #define FTP_F_RENAME(path_old, path_new) 	f_rename(path_old, path_new)
 #define FTP_F_UTIME(path, fno) 				f_utime(path, fno)
 #define FTP_F_GETFREE(path, nclst, fatfs) 	f_getfree(path, nclst, fatfs)
+#define FTP_F_CHDIR(path) 					f_chdir(path)
+#if (defined(_USE_EXPAND) && _USE_EXPAND == 1) || (defined(FF_USE_EXPAND) && FF_USE_EXPAND == 1)
+#define FTP_F_EXPAND(fp, fsz, opt) 			f_expand(fp, fsz, opt)
+#endif
 #endif /* FTP_CUSTOM_FATFS */
 
+/* *********** LWIP NETCONN ************** */
+/**
+ * netconn layer, define FTP_CUSTOM_NETCONN and all FTP_NETCONN_* macros
+ * to run server on top of other implementation, f.e. scripted fakes with
+ * fault injection for tests on host
+ */
+#ifndef FTP_CUSTOM_NETCONN
+#define FTP_NETCONN_NEW(type)							netconn_new(type)
+#define FTP_NETCONN_BIND(conn, addr, port)				netconn_bind(conn, addr, port)
+#define FTP_NETCONN_LISTEN(conn)						netconn_listen(conn)
+#define FTP_NETCONN_ACCEPT(conn, new_conn)				netconn_accept(conn, new_conn)
+#define FTP_NETCONN_CONNECT(conn, addr, port)			netconn_connect(conn, addr, port)
+#define FTP_NETCONN_CLOSE(conn)							netconn_close(conn)
+#define FTP_NETCONN_SHUTDOWN(conn, rx, tx)				netconn_shutdown(conn, rx, tx)
+#define FTP_NETCONN_DELETE(conn)						netconn_delete(conn)
+#define FTP_NETCONN_ADDR(conn, addr, port)				netconn_addr(conn, addr, port)
+#define FTP_NETCONN_PEER(conn, addr, port)				netconn_peer(conn, addr, port)
+#define FTP_NETCONN_RECV(conn, new_buf)					netconn_recv(conn, new_buf)
+#define FTP_NETCONN_RECV_TCP_PBUF(conn, new_buf)		netconn_recv_tcp_pbuf(conn, new_buf)
+#define FTP_NETCONN_WRITE_PARTLY(conn, data, size, flags, written)	netconn_write_partly(conn, data, size, flags, written)
+#define FTP_NETCONN_SET_RECVTIMEOUT(conn, timeout)		netconn_set_recvtimeout(conn, timeout)
+#define FTP_NETCONN_SET_SENDTIMEOUT(conn, timeout)		netconn_set_sendtimeout(conn, timeout)
+#define FTP_NETBUF_DATA(buf, data, len)					netbuf_data(buf, data, len)
+#define FTP_NETBUF_DELETE(buf)							netbuf_delete(buf)
+#define FTP_PBUF_FREE(p)								pbuf_free(p)
+#endif /* FTP_CUSTOM_NETCONN */
+
+/* *********** TIME ************** */
+/**
+ * time base, can be replaced with virtual time in tests
+ *
+ * delay is rounded up to whole ticks, pdMS_TO_TICKS rounds down, so short
+ * polling delays would not block with tick period above 1 ms
+ */
+#ifndef FTP_DELAY_MS
+#define FTP_DELAY_MS(ms) vTaskDelay(((TickType_t) (ms) * configTICK_RATE_HZ + 999) / 1000)
+#endif
+
+#ifndef FTP_TIME_MS
+#define FTP_TIME_MS() ((uint32_t) (xTaskGetTickCount() * portTICK_PERIOD_MS))
+#endif
+
 /* *********** CALLBACKS ************** */
 #ifndef FTP_CONNECTED_CALLBACK
 #define FTP_CONNECTED_CALLBACK() do {} while(0)
@@ -168,6 +517,22 @@
 #define FTP_CMD_END_CALLBACK(pchar_cmd) do {} while(0)
 #endif
 
+/**
+ * Session trace
+ *
+ * when enabled, control traffic and per command timing of all sessions is passed
+ * as compact binary records (see ftp_trace_hdr_t) to FTP_TRACE_WRITE,
+ * application stores them (RAM ring, file, UART) for replay on host,
+ * FTP_TRACE_WRITE is called with internal mutex taken and must not block for long
+ */
+#ifndef FTP_TRACE_ENABLE
+#define FTP_TRACE_ENABLE 0
+#endif
+
+#ifndef FTP_TRACE_WRITE
+#define FTP_TRACE_WRITE(hdr, hdr_len, data, data_len) do { (void) (hdr); (void) (hdr_len); (void) (data); (void) (data_len); } while(0)
+#endif
+
 #ifndef FTP_ETH_IS_LINK_UP
 #define FTP_ETH_IS_LINK_UP() ((uint8_t)1)
 #endif
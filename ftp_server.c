@@ -32,12 +32,18 @@
 #include "event_groups.h"
 // lwip include
 #include "api.h"
+#if FTP_TCP_PROFILE == 1 && !defined(FTP_CUSTOM_NETCONN)
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+#endif
 
 #define FTP_VERSION				"2020-08-20"
-#define FTP_PARAM_SIZE			_MAX_LFN + 8
-#define FTP_CWD_SIZE			_MAX_LFN + 8
+#define FTP_PARAM_SIZE			(_MAX_LFN + 8)
+#define FTP_CWD_SIZE			(_MAX_LFN + 8)
 #define FTP_CMD_SIZE			5
-#define FTP_DATE_STRING_SIZE	64
+#define FTP_DATE_STRING_SIZE	16 // YYYYMMDDHHMMSS
+#define FTP_U64_STRING_SIZE		21 // 18446744073709551615
 #define PORT_INCREMENT_OFFSET	25 // used for a bugfix which works around ports which are already in use (from a previous connection)
 #define DEBUG_PRINT(ftp, f, ...)	FTP_LOG_PRINT("[%d] "f, ftp->ftp_con_num, ##__VA_ARGS__)
 #define FTP_USER_NAME_OK(name)		(!strcmp(name, ftp_user_name))
@@ -45,6 +51,71 @@
 #define FTP_IS_LOGGED_IN(p_ftp)		(p_ftp->user == FTP_USER_USER_LOGGED_IN)
 #define FTP_BUF_SIZE_MIN 			1024
 #define FTP_BUF_SIZE 				(FTP_BUF_SIZE_MIN * FTP_BUF_SIZE_MULT)
+#define FTP_RATE_MIN_WINDOW_MS		1000 // data connection throughput is trusted after this time
+#define FTP_ALIGN8(size)			(((size) + 7) & ~7u)
+
+// data is pushed in full segments, PSH is left to the last segment before close
+#if FTP_TCP_PROFILE == 1
+#define FTP_DATA_WRITE_FLAGS		(NETCONN_COPY | NETCONN_MORE)
+#else
+#define FTP_DATA_WRITE_FLAGS		NETCONN_COPY
+#endif
+
+// wait for command in one piece when blocked receive can be interrupted from other task
+#if defined(LWIP_NETCONN_FULLDUPLEX) && LWIP_NETCONN_FULLDUPLEX == 1
+#define FTP_IDLE_WAIT_SLICE_MS		FTP_SERVER_INACTIVE_TIMEOUT_MS
+#define FTP_WAKE_ON_STOP			1
+#else
+#define FTP_IDLE_WAIT_SLICE_MS		FTP_SERVER_READ_TIMEOUT_MS
+#define FTP_WAKE_ON_STOP			0
+#endif
+
+#if (FTP_CLIENT_TASK_STATIC == 1 || FTP_SERVER_TASK_STATIC == 1 || FTP_MUTEX_STATIC == 1) && configSUPPORT_STATIC_ALLOCATION != 1
+#error "FTP static allocation requires configSUPPORT_STATIC_ALLOCATION = 1"
+#endif
+
+#if FTP_OPEN_CACHE == 1 && ((defined(_FS_LOCK) && _FS_LOCK != 0) || (defined(FF_FS_LOCK) && FF_FS_LOCK != 0))
+#error "FTP_OPEN_CACHE requires FATFS file lock to be disabled (_FS_LOCK = 0), copied FIL is not registered in lock table"
+#endif
+
+#if FTP_CWD_RELATIVE == 1 && !((defined(_FS_RPATH) && _FS_RPATH >= 1) || (defined(FF_FS_RPATH) && FF_FS_RPATH >= 1))
+#error "FTP_CWD_RELATIVE requires FATFS relative path support (_FS_RPATH >= 1)"
+#endif
+
+#if FTP_STATIC_ALLOCATION == 1 && defined(MEMP_MEM_MALLOC) && MEMP_MEM_MALLOC != 0
+#error "FTP_STATIC_ALLOCATION requires MEMP_MEM_MALLOC = 0, otherwise netconns are taken from heap"
+#endif
+
+// configuration validation
+#define FTP_STATIC_ASSERT(cond, msg)	_Static_assert(cond, msg)
+FTP_STATIC_ASSERT(FTP_BUF_SIZE_MULT >= 1, "FTP_BUF_SIZE_MULT must be at least 1");
+FTP_STATIC_ASSERT(FTP_BUF_SIZE >= TCP_MSS, "FTP_BUF_SIZE must be no less than TCP_MSS");
+FTP_STATIC_ASSERT(FTP_DATA_WRITE_SIZE >= 512 && FTP_DATA_WRITE_SIZE <= FTP_BUF_SIZE, "FTP_DATA_WRITE_SIZE must be in range 512..FTP_BUF_SIZE");
+FTP_STATIC_ASSERT(FTP_BUF_SIZE <= 0xFFFF * 16, "FTP_BUF_SIZE is too big");
+FTP_STATIC_ASSERT(FTP_DCACHE_LINE_SIZE >= 4 && (FTP_DCACHE_LINE_SIZE & (FTP_DCACHE_LINE_SIZE - 1)) == 0, "FTP_DCACHE_LINE_SIZE must be power of 2");
+FTP_STATIC_ASSERT(FTP_DCACHE_LINE_SIZE <= 32 && (FTP_BUF_SIZE % FTP_DCACHE_LINE_SIZE) == 0, "transfer buffer must be aligned to FTP_DCACHE_LINE_SIZE");
+FTP_STATIC_ASSERT(FTP_NBR_CLIENTS >= 1 && FTP_NBR_CLIENTS <= 100, "FTP_NBR_CLIENTS must be in range 1..100");
+FTP_STATIC_ASSERT((uint32_t) FTP_DATA_PORT + FTP_NBR_CLIENTS * PORT_INCREMENT_OFFSET <= 0xFFFF, "FTP_DATA_PORT range exceeds 65535");
+FTP_STATIC_ASSERT(FTP_CWD_SIZE <= 0xFFFF, "_MAX_LFN is too big for path handling");
+FTP_STATIC_ASSERT(_MAX_LFN >= 12, "_MAX_LFN must hold at least 8.3 name");
+FTP_STATIC_ASSERT(FTP_USER_NAME_LEN >= 1 && FTP_USER_PASS_LEN >= 1, "FTP_USER_NAME_LEN and FTP_USER_PASS_LEN must not be 0");
+FTP_STATIC_ASSERT(sizeof(FTP_USER_NAME_DEFAULT) <= FTP_USER_NAME_LEN + 1, "FTP_USER_NAME_DEFAULT is longer than FTP_USER_NAME_LEN");
+FTP_STATIC_ASSERT(sizeof(FTP_USER_PASS_DEFAULT) <= FTP_USER_PASS_LEN + 1, "FTP_USER_PASS_DEFAULT is longer than FTP_USER_PASS_LEN");
+FTP_STATIC_ASSERT(FTP_SERVER_READ_TIMEOUT_MS > 0 && FTP_SERVER_WRITE_TIMEOUT_MS > 0, "FTP timeouts must not be 0");
+FTP_STATIC_ASSERT(FTP_SERVER_INACTIVE_TIMEOUT_MS >= FTP_SERVER_READ_TIMEOUT_MS, "FTP_SERVER_INACTIVE_TIMEOUT_MS is too short");
+FTP_STATIC_ASSERT(FTP_WRITE_TIMEOUT_MIN_MS > 0 && FTP_WRITE_TIMEOUT_MIN_MS <= FTP_WRITE_TIMEOUT_MAX_MS, "FTP_WRITE_TIMEOUT_MIN_MS/MAX_MS are invalid");
+FTP_STATIC_ASSERT(FTP_WRITE_TIMEOUT_FACTOR >= 1, "FTP_WRITE_TIMEOUT_FACTOR must be at least 1");
+FTP_STATIC_ASSERT(FTP_XFER_STALL_WINDOW_MS >= FTP_SERVER_READ_TIMEOUT_MS, "FTP_XFER_STALL_WINDOW_MS is too short");
+FTP_STATIC_ASSERT(FTP_OPEN_CACHE_ENTRIES >= 1 && FTP_OPEN_CACHE_ENTRIES <= 255, "FTP_OPEN_CACHE_ENTRIES must be in range 1..255");
+#if FTP_SHARED_READ == 1
+FTP_STATIC_ASSERT(FTP_SHARED_READ_BLOCK_SIZE >= 512 && (FTP_SHARED_READ_BLOCK_SIZE % 512) == 0, "FTP_SHARED_READ_BLOCK_SIZE must be aligned to 512");
+FTP_STATIC_ASSERT(FTP_SHARED_READ_BLOCK_SIZE <= FTP_BUF_SIZE / 2, "FTP_SHARED_READ_BLOCK_SIZE must be no more than half of FTP_BUF_SIZE");
+FTP_STATIC_ASSERT(FTP_SHARED_READ_BLOCKS >= 2 && FTP_SHARED_READ_FILES >= 1 && FTP_SHARED_READ_FILES <= 127, "invalid shared read window size");
+#endif
+#ifdef configMINIMAL_STACK_SIZE
+FTP_STATIC_ASSERT(FTP_CLIENT_TASK_STACK_SIZE >= configMINIMAL_STACK_SIZE, "FTP_CLIENT_TASK_STACK_SIZE is less than configMINIMAL_STACK_SIZE");
+FTP_STATIC_ASSERT(FTP_SERVER_TASK_STACK_SIZE >= configMINIMAL_STACK_SIZE, "FTP_SERVER_TASK_STACK_SIZE is less than configMINIMAL_STACK_SIZE");
+#endif
 
 typedef enum {
 	FTP_RES_OK,
@@ -59,6 +130,12 @@ typedef enum {
 	DCM_ACTIVE
 } dcm_type;
 
+// representation type enumeration typedef
+typedef enum {
+	FTP_TYPE_BINARY,
+	FTP_TYPE_ASCII
+} ftp_type_t;
+
 // ftp log in enumeration typedef
 typedef enum {
 	FTP_USER_NONE,
@@ -70,12 +147,20 @@ typedef enum {
  * Structure that contains all variables used in FTP connection.
  * This is not nicely done since code is ported from C++ to C. The
  * C++ private object variables are listed inside this structure.
+ *
+ * Fields are ordered by access frequency: connection state used on every
+ * command first (fits one cache line), then command buffers, then rarely used
+ * scratch (rename path, date string, FILINFO, FIL). Transfer buffer is kept
+ * outside, in FTP_BUFF_MEM_SECTION.
  */
 typedef struct {
+	// stop request of this session
+	bool *stop;
+
 	// sockets
-	struct netconn *listdataconn;
-	struct netconn *dataconn;
 	struct netconn *ctrlconn;
+	struct netconn *dataconn;
+	struct netconn *listdataconn;
 	struct netbuf *inbuf;
 
 	// ip addresses
@@ -86,36 +171,61 @@ typedef struct {
 	uint16_t data_port;
 	uint8_t data_port_incremented;
 
-	// file variables, not created on stack but static on boot
-	// to avoid overflow and ensure alignment in memory
-	FIL file;
-	FILINFO finfo;
+	// connection number
+	uint8_t ftp_con_num;
+
+	// state which tells which user is logged in (ftp_user_t)
+	uint8_t user;
+
+	// data connection mode state, not set, active or passive (dcm_type)
+	uint8_t data_conn_mode;
+
+	// representation type set by TYPE command (ftp_type_t)
+	uint8_t transfer_type;
+
+	// ASCII conversion state kept between chunks, last sent byte / CR received at end of chunk
+	char ascii_last;
+	bool ascii_cr_pending;
+
+	// offset set by REST command, used by next RETR/STOR
+	uint64_t restart_offset;
+
+	// bytes transfered by last RETR/STOR
+	uint64_t bytes_transfered;
+
+	// last RETR/STOR failed after error was replied, control connection is kept
+	bool transfer_failed;
+
+	// code of last reply sent in current command
+	uint16_t reply_code;
+
+	// throughput of data connection for adaptive write timeout
+	uint64_t xfer_bytes;
+	uint32_t xfer_start_ms;
+	uint32_t xfer_rate_Bps;
+
 	// buffer for command sent by client
 	char command[FTP_CMD_SIZE];
 
 	// buffer for parameters sent by client
 	char parameters[FTP_PARAM_SIZE];
 
-	// buffer for origin path for Rename command
-	char path_rename[FTP_CWD_SIZE];
-
 	// buffer for path that is currently used
 	char path[FTP_CWD_SIZE];
 
-	// buffer for writing/reading to/from memory
-	ALIGN_32BYTES(char ftp_buff[FTP_BUF_SIZE]);
-
 	// date string buffer
 	char date_str[FTP_DATE_STRING_SIZE];
 
-	// connection mode (not set, active or passive)
-	uint8_t ftp_con_num;
+	// buffer for origin path for Rename command
+	char path_rename[FTP_CWD_SIZE];
 
-	// state which tells which user is logged in
-	ftp_user_t user;
+	// file variables, not created on stack but static on boot
+	// to avoid overflow and ensure alignment in memory
+	FILINFO finfo;
+	FIL file;
 
-	// data connection mode state
-	dcm_type data_conn_mode;
+	// buffer for writing/reading to/from memory, placed in FTP_BUFF_MEM_SECTION
+	char *ftp_buff;
 } ftp_data_t;
 
 // structure for ftp commands
@@ -129,8 +239,8 @@ typedef struct {
 	uint8_t number;
 	struct netconn *ftp_connection;
 	TaskHandle_t task_handle;
-#if FTP_TASK_STATIC == 1
-	StackType_t task_stack[FTP_TASK_STACK_SIZE];
+#if FTP_CLIENT_TASK_STATIC == 1
+	StackType_t task_stack[FTP_CLIENT_TASK_STACK_SIZE];
 	StaticTask_t task_static;
 #endif
 	ftp_data_t ftp_data;
@@ -141,6 +251,12 @@ typedef struct {
 typedef struct {
 	TaskHandle_t server_task_handle;
 	SemaphoreHandle_t stats_mutex;
+#if FTP_CWD_RELATIVE == 1
+	SemaphoreHandle_t fs_mutex; // FATFS current directory and lookups relative to it
+#endif
+#if FTP_JOURNAL == 1
+	SemaphoreHandle_t journal_mutex; // journal state and files
+#endif
 	ftp_status_t status;
 	ftp_stats_t stats;
 	uint16_t port;
@@ -148,43 +264,307 @@ typedef struct {
 	bool inited;
 } ftp_t;
 
+// memory for objects which are created with static FreeRTOS API
+typedef struct {
+#if FTP_SERVER_TASK_STATIC == 1
+	StackType_t server_task_stack[FTP_SERVER_TASK_STACK_SIZE];
+	StaticTask_t server_task_static;
+#endif
+#if FTP_MUTEX_STATIC == 1
+	StaticSemaphore_t stats_mutex_static;
+#if FTP_CWD_RELATIVE == 1
+	StaticSemaphore_t fs_mutex_static;
+#endif
+#if FTP_JOURNAL == 1
+	StaticSemaphore_t journal_mutex_static;
+#endif
+#endif
+	uint8_t dummy; // keep struct not empty when nothing is static
+} ftp_static_t;
+
+#if FTP_SHARED_READ == 1
+typedef enum {
+	FTP_SHARED_BLOCK_EMPTY,
+	FTP_SHARED_BLOCK_LOADING,
+	FTP_SHARED_BLOCK_VALID
+} ftp_shared_block_state_t;
+
+typedef struct {
+	uint32_t index; // file offset / FTP_SHARED_READ_BLOCK_SIZE
+	uint32_t len; // less than block size only at end of file
+	uint32_t stamp; // last use, for replacement
+	uint8_t state;
+} ftp_shared_block_t;
+
+// identity of file is path, size and modification time, so changed file is never shared with old one
+typedef struct {
+	char path[FTP_CWD_SIZE];
+	uint64_t size;
+	WORD fdate;
+	WORD ftime;
+	uint8_t readers;
+	uint32_t stamp;
+	ftp_shared_block_t blocks[FTP_SHARED_READ_BLOCKS];
+} ftp_shared_file_t;
+#endif
+
+// file lock held by session
+typedef enum {
+	FTP_LOCK_NONE,
+	FTP_LOCK_READ,
+	FTP_LOCK_WRITE,
+	FTP_LOCK_TREE // path and everything below it, for delete and rename
+} ftp_lock_mode_t;
+
+// locks held by one session at once, rename and copy need two
+#define FTP_LOCK_SLOTS			2
+
+#if FTP_FILE_LOCK == 1
+typedef struct {
+	uint32_t hash; // of path, compared first
+	uint8_t mode;
+	char path[FTP_CWD_SIZE];
+} ftp_lock_t;
+#endif
+
+#if FTP_OPEN_CACHE == 1
+// recently used file, FILINFO from f_stat and FIL as left by f_open for reading
+typedef struct {
+	char path[FTP_CWD_SIZE];
+	uint32_t stamp; // last use, for replacement
+	bool file_valid;
+	FILINFO finfo;
+	FIL file;
+} ftp_open_cache_t;
+#endif
+
+#if FTP_JOURNAL == 1
+#define FTP_JOURNAL_SECTOR			512
+
+// change journal, tail sector of current journal file is kept in RAM until it is full
+typedef struct {
+	FIL file;
+	uint32_t seq; // of last record
+	uint32_t first_seq; // oldest record in journal files, 0 when journal is empty
+	uint32_t cur_first_seq; // first record in FTP_JOURNAL_PATH
+	uint32_t sector_ofs; // file offset of tail sector
+	uint32_t sector_len; // bytes of records in tail sector
+	uint32_t dirty_ms; // time of first record which was not written yet
+	uint32_t generation; // incremented when journal files are rotated
+	bool dirty;
+	bool loaded;
+} ftp_journal_t;
+#endif
+
+#if FTP_SITE_WATCH == 1
+// change waiting in queue of watcher, queue is kept in transfer buffer of watching session
+typedef struct {
+	uint64_t size;
+	char change;
+	char path[FTP_CWD_SIZE];
+} ftp_watch_event_t;
+
+typedef struct {
+	bool active;
+	uint16_t head; // oldest event
+	uint16_t count;
+	uint32_t lost; // events dropped because queue was full
+} ftp_watch_t;
+#endif
+
 static char ftp_user_name[FTP_USER_NAME_LEN + 1] = FTP_USER_NAME_DEFAULT;
 static char ftp_user_pass[FTP_USER_PASS_LEN + 1] = FTP_USER_PASS_DEFAULT;
 static ftp_t FTP = { 0 };
 static const char *no_conn_allowed = "421 No more connections allowed\r\n";
 FTP_STRUCT_MEM_SECTION(static server_stru_t ftp_links[FTP_NBR_CLIENTS]) = {0};
+FTP_STRUCT_MEM_SECTION(static ftp_static_t ftp_static) = {0};
+FTP_BUFF_MEM_SECTION(static ALIGN_32BYTES(char ftp_buffers[FTP_NBR_CLIENTS][FTP_BUF_SIZE]));
+#if FTP_SHARED_READ == 1
+FTP_STRUCT_MEM_SECTION(static ftp_shared_file_t ftp_shared[FTP_SHARED_READ_FILES]);
+FTP_BUFF_MEM_SECTION(static ALIGN_32BYTES(char ftp_shared_data[FTP_SHARED_READ_FILES][FTP_SHARED_READ_BLOCKS][FTP_SHARED_READ_BLOCK_SIZE]));
+static uint32_t ftp_shared_clock;
+#endif
+#if FTP_FILE_LOCK == 1
+FTP_STRUCT_MEM_SECTION(static ftp_lock_t ftp_locks[FTP_NBR_CLIENTS][FTP_LOCK_SLOTS]);
+#endif
+#if FTP_CWD_RELATIVE == 1
+static char ftp_vol_cwd[FTP_CWD_SIZE] = "/"; // path of FATFS current directory, empty when unknown
+#endif
+#if FTP_OPEN_CACHE == 1
+FTP_STRUCT_MEM_SECTION(static ftp_open_cache_t ftp_open_cache[FTP_OPEN_CACHE_ENTRIES]);
+static uint32_t ftp_open_cache_clock;
+static uint32_t ftp_open_cache_generation; // incremented by every invalidation
+#endif
+#if FTP_SITE_WATCH == 1
+static ftp_watch_t ftp_watches[FTP_NBR_CLIENTS];
+#endif
+#if FTP_JOURNAL == 1
+FTP_STRUCT_MEM_SECTION(static ftp_journal_t ftp_journal);
+FTP_BUFF_MEM_SECTION(static ALIGN_32BYTES(char ftp_journal_sector[FTP_JOURNAL_SECTOR + FTP_DCACHE_LINE_SIZE]));
+#endif
+
+// memory budget, kept as constants so they can be read from map file/debugger without running the code
+#define FTP_MEM_TASK_BYTES(stack)	((uint32_t) (stack) * sizeof(StackType_t) + sizeof(StaticTask_t))
+#define FTP_MEM_NETCONNS_PER_SESSION	3 // control, passive listen, data
+#define FTP_MEM_MUTEXES				(1 + (FTP_CWD_RELATIVE == 1) + (FTP_JOURNAL == 1))
+#if FTP_SHARED_READ == 1
+#define FTP_MEM_SHARED_READ_BYTES		(sizeof(ftp_shared) + sizeof(ftp_shared_data))
+#else
+#define FTP_MEM_SHARED_READ_BYTES		0
+#endif
+#if FTP_OPEN_CACHE == 1
+#define FTP_MEM_OPEN_CACHE_BYTES		sizeof(ftp_open_cache)
+#else
+#define FTP_MEM_OPEN_CACHE_BYTES		0
+#endif
+#if FTP_FILE_LOCK == 1
+#define FTP_MEM_FILE_LOCK_BYTES			sizeof(ftp_locks)
+#else
+#define FTP_MEM_FILE_LOCK_BYTES			0
+#endif
+#if FTP_JOURNAL == 1
+#define FTP_MEM_JOURNAL_BYTES			(sizeof(ftp_journal) + sizeof(ftp_journal_sector))
+#else
+#define FTP_MEM_JOURNAL_BYTES			0
+#endif
+#if FTP_SITE_WATCH == 1
+#define FTP_MEM_WATCH_BYTES				sizeof(ftp_watches)
+#else
+#define FTP_MEM_WATCH_BYTES				0
+#endif
+static const ftp_mem_report_t ftp_mem_report = { //
+		.session_data = sizeof(ftp_data_t), //
+		.session_buffer = FTP_BUF_SIZE, //
+		.session_task = FTP_MEM_TASK_BYTES(FTP_CLIENT_TASK_STACK_SIZE), //
+		.session_total = sizeof(server_stru_t) + FTP_BUF_SIZE + (FTP_CLIENT_TASK_STATIC == 1 ? 0 : FTP_MEM_TASK_BYTES(FTP_CLIENT_TASK_STACK_SIZE)), //
+		.server_task = FTP_MEM_TASK_BYTES(FTP_SERVER_TASK_STACK_SIZE), //
+		.static_total = sizeof(ftp_links) + sizeof(ftp_buffers) + sizeof(ftp_static) + sizeof(ftp_t) + FTP_MEM_SHARED_READ_BYTES + FTP_MEM_OPEN_CACHE_BYTES
+				+ FTP_MEM_FILE_LOCK_BYTES + FTP_MEM_JOURNAL_BYTES
+				+ FTP_MEM_WATCH_BYTES, //
+		.heap_total = (FTP_CLIENT_TASK_STATIC == 1 ? 0 : FTP_NBR_CLIENTS * FTP_MEM_TASK_BYTES(FTP_CLIENT_TASK_STACK_SIZE))
+				+ (FTP_SERVER_TASK_STATIC == 1 ? 0 : FTP_MEM_TASK_BYTES(FTP_SERVER_TASK_STACK_SIZE))
+				+ (FTP_MUTEX_STATIC == 1 ? 0 : FTP_MEM_MUTEXES * sizeof(StaticSemaphore_t)), //
+		.lwip_netconns = FTP_NBR_CLIENTS * FTP_MEM_NETCONNS_PER_SESSION + 1, //
+		};
 // =========================================================
 //
 //              Send a response to the client
 //
 // =========================================================
 
-static void ftp_stats_lock(void) {
-	if (xSemaphoreTakeRecursive(FTP.stats_mutex, portMAX_DELAY) != pdTRUE) {
+static void ftp_mutex_take(SemaphoreHandle_t mutex) {
+	if (xSemaphoreTakeRecursive(mutex, portMAX_DELAY) != pdTRUE) {
 		FTP_CRITICAL_ERROR_HANDLER();
 	}
 }
 
-static void ftp_stats_unlock(void) {
-	if (xSemaphoreGiveRecursive(FTP.stats_mutex) != pdTRUE) {
+static void ftp_mutex_give(SemaphoreHandle_t mutex) {
+	if (xSemaphoreGiveRecursive(mutex) != pdTRUE) {
 		FTP_CRITICAL_ERROR_HANDLER();
 	}
 }
 
+static void ftp_stats_lock(void) {
+	ftp_mutex_take(FTP.stats_mutex);
+}
+
+static void ftp_stats_unlock(void) {
+	ftp_mutex_give(FTP.stats_mutex);
+}
+
 static void ftp_set_error(ftp_error_t error) {
 	FTP.status = FTP_ERROR_STOPPING;
 	FTP.errors |= ((uint32_t) 1) << error;
 }
 
-#undef netconn_write
+// cache maintenance for buffers shared with storage DMA, range is widened to whole cache lines
+static void ftp_dcache_clean(const void *addr, uint32_t size) {
+	uintptr_t start = ((uintptr_t) addr) & ~((uintptr_t) FTP_DCACHE_LINE_SIZE - 1);
+	uintptr_t end = ((uintptr_t) addr + size + FTP_DCACHE_LINE_SIZE - 1) & ~((uintptr_t) FTP_DCACHE_LINE_SIZE - 1);
+	UNUSED(start);
+	UNUSED(end);
+	FTP_DCACHE_CLEAN(start, end - start);
+}
+
+// invalidate part of transfer buffer filled by storage read, range is widened to whole cache lines but kept
+// inside the buffer, lines only partly covered are cleaned first, so CPU data sharing them is not dropped
+static void ftp_dcache_invalidate_buff(ftp_data_t *ftp, const char *addr, uint32_t size) {
+	uintptr_t buff = (uintptr_t) ftp->ftp_buff;
+	uintptr_t start = ((uintptr_t) addr) & ~((uintptr_t) FTP_DCACHE_LINE_SIZE - 1);
+	uintptr_t end = ((uintptr_t) addr + size + FTP_DCACHE_LINE_SIZE - 1) & ~((uintptr_t) FTP_DCACHE_LINE_SIZE - 1);
+	if (start < buff) {
+		start = buff;
+	}
+	if (end > buff + FTP_BUF_SIZE) {
+		end = buff + FTP_BUF_SIZE;
+	}
+	if (start >= end) {
+		return;
+	}
+	if (start != (uintptr_t) addr) {
+		FTP_DCACHE_CLEAN(start, FTP_DCACHE_LINE_SIZE);
+	}
+	if (end != (uintptr_t) addr + size) {
+		FTP_DCACHE_CLEAN(end - FTP_DCACHE_LINE_SIZE, FTP_DCACHE_LINE_SIZE);
+	}
+	FTP_DCACHE_INVALIDATE(start, end - start);
+}
+
+// =========================================================
+//
+//              Session trace
+//
+// =========================================================
+
+// return: three digit code at start of reply, 0 when there is none
+static uint16_t ftp_reply_code(const char *reply) {
+	uint16_t code = 0;
+	for (uint8_t i = 0; i < 3; i++) {
+		if (!isdigit((uint8_t ) reply[i])) {
+			return (0);
+		}
+		code = code * 10 + (reply[i] - '0');
+	}
+	return (code);
+}
+
+#if FTP_TRACE_ENABLE == 1
+// write one trace record, records from all sessions are serialized with stats mutex
+static void ftp_trace(ftp_data_t *ftp, ftp_trace_type_t type, const void *data, uint16_t len) {
+	ftp_trace_hdr_t hdr = { .time_ms = FTP_TIME_MS(), .len = len, .type = type, .session = ftp->ftp_con_num };
+	ftp_stats_lock();
+	FTP_TRACE_WRITE(&hdr, sizeof(hdr), data, len);
+	ftp_stats_unlock();
+}
+
+// record command line, password is never recorded
+static void ftp_trace_command(ftp_data_t *ftp) {
+	char line[FTP_CMD_SIZE + FTP_PARAM_SIZE];
+	int len = snprintf(line, sizeof(line), "%s %s", ftp->command, strcmp(ftp->command, "PASS") ? ftp->parameters : "");
+	ftp_trace(ftp, FTP_TRACE_COMMAND, line, len < (int) sizeof(line) ? len : (int) sizeof(line) - 1);
+}
+
+static void ftp_trace_reply(ftp_data_t *ftp, uint16_t code) {
+	ftp_trace(ftp, FTP_TRACE_REPLY, &code, sizeof(code));
+}
+
+static void ftp_trace_done(ftp_data_t *ftp, ftp_result_t res, uint32_t start_ms) {
+	ftp_trace_done_t done = { .bytes = ftp->bytes_transfered, .duration_ms = FTP_TIME_MS() - start_ms, .result = res };
+	ftp_trace(ftp, FTP_TRACE_DONE, &done, sizeof(done));
+}
+#else
+#define ftp_trace(ftp, type, data, len)				do {} while(0)
+#define ftp_trace_command(ftp)						do {} while(0)
+#define ftp_trace_reply(ftp, code)					do {} while(0)
+#define ftp_trace_done(ftp, res, start_ms)			do {} while(0)
+#endif
 
-static ftp_result_t wait_for_netconn_write_finish(struct netconn *conn, size_t *bytes_written, size_t size) {
-	uint32_t timeout_cnt = 0;
+static ftp_result_t wait_for_netconn_write_finish(struct netconn *conn, size_t *bytes_written, size_t size, uint32_t timeout_ms) {
+	uint32_t start_ms = FTP_TIME_MS();
 	ftp_result_t res = FTP_RES_OK;
 	while (*bytes_written != size || conn->state != NETCONN_NONE) {
-		vTaskDelay(1);
-		timeout_cnt++;
-		if (timeout_cnt >= FTP_SERVER_WRITE_TIMEOUT_MS) {
+		FTP_DELAY_MS(1);
+		if (FTP_TIME_MS() - start_ms >= timeout_ms) {
 			res = FTP_RES_TIMEOUT;
 			FTP_LOG_PRINT("NETCONN WRITE TIMEOUT!!!\r\n");
 			break;
@@ -193,17 +573,67 @@ static ftp_result_t wait_for_netconn_write_finish(struct netconn *conn, size_t *
 	return (res);
 }
 
-ftp_result_t netconn_write(struct netconn *conn, const void *dataptr, size_t size) {
+static ftp_result_t ftp_netconn_write(struct netconn *conn, const void *dataptr, size_t size, uint8_t flags, uint32_t timeout_ms) {
 	size_t bytes_written = 0;
 	ftp_result_t res = FTP_RES_OK;
-	err_t err = netconn_write_partly(conn, dataptr, size, NETCONN_COPY, &bytes_written);
+	FTP_NETCONN_SET_SENDTIMEOUT(conn, timeout_ms);
+	err_t err = FTP_NETCONN_WRITE_PARTLY(conn, dataptr, size, flags, &bytes_written);
 	if (err == ERR_INPROGRESS) {
-		res = wait_for_netconn_write_finish(conn, &bytes_written, size);
+		res = wait_for_netconn_write_finish(conn, &bytes_written, size, timeout_ms);
+	} else if (err == ERR_WOULDBLOCK || err == ERR_TIMEOUT || (err == ERR_OK && bytes_written != size)) {
+		// send timeout expired, peer does not take data
+		FTP_LOG_PRINT("NETCONN WRITE TIMEOUT!!!\r\n");
+		res = FTP_RES_TIMEOUT;
 	} else if (err != ERR_OK) {
+		// lost connection of one client is not error of server, like read errors
 		FTP_LOG_PRINT("client NETCONN write error\r\n");
-		ftp_set_error(FTP_ERROR_CLIENT_NETCONN_WRITE);
 		res = FTP_RES_ERROR;
 	}
+	if (res == FTP_RES_TIMEOUT) {
+		ftp_stats_lock();
+		FTP.stats.write_timeouts++;
+		ftp_stats_unlock();
+	}
+	return (res);
+}
+
+// Timeout for write to data connection
+//
+// expected time to push the chunk and drain the send buffer at measured throughput,
+// multiplied by safety factor and clamped, default timeout is used until throughput is known
+static uint32_t ftp_data_write_timeout(ftp_data_t *ftp, size_t size) {
+#if FTP_ADAPTIVE_WRITE_TIMEOUT == 1
+	if (ftp->xfer_rate_Bps == 0) {
+		return (FTP_SERVER_WRITE_TIMEOUT_MS);
+	}
+	uint64_t timeout_ms = ((uint64_t) (size + TCP_SND_BUF) * 1000 * FTP_WRITE_TIMEOUT_FACTOR) / ftp->xfer_rate_Bps;
+	if (timeout_ms < FTP_WRITE_TIMEOUT_MIN_MS) {
+		timeout_ms = FTP_WRITE_TIMEOUT_MIN_MS;
+	} else if (timeout_ms > FTP_WRITE_TIMEOUT_MAX_MS) {
+		timeout_ms = FTP_WRITE_TIMEOUT_MAX_MS;
+	}
+	return ((uint32_t) timeout_ms);
+#else
+	UNUSED(ftp);
+	UNUSED(size);
+	return (FTP_SERVER_WRITE_TIMEOUT_MS);
+#endif
+}
+
+// write to data connection and update throughput of this session
+//
+// throughput is average since data connection was opened, including time blocked
+// on full send buffer, it is updated after FTP_RATE_MIN_WINDOW_MS to skip slow start
+static ftp_result_t ftp_data_write(ftp_data_t *ftp, const void *dataptr, size_t size) {
+	ftp_result_t res = ftp_netconn_write(ftp->dataconn, dataptr, size, FTP_DATA_WRITE_FLAGS, ftp_data_write_timeout(ftp, size));
+	if (res == FTP_RES_OK) {
+		ftp->xfer_bytes += size;
+		uint32_t elapsed_ms = FTP_TIME_MS() - ftp->xfer_start_ms;
+		if (elapsed_ms >= FTP_RATE_MIN_WINDOW_MS) {
+			uint64_t rate = ftp->xfer_bytes * 1000 / elapsed_ms;
+			ftp->xfer_rate_Bps = rate > UINT32_MAX ? UINT32_MAX : (rate ? (uint32_t) rate : 1);
+		}
+	}
 	return (res);
 }
 
@@ -214,7 +644,12 @@ static ftp_result_t ftp_send(ftp_data_t *ftp, const char *fmt, ...) {
 	va_end(args);
 
 	DEBUG_PRINT(ftp, "%s", ftp->ftp_buff);
-	return (netconn_write(ftp->ctrlconn, ftp->ftp_buff, strlen(ftp->ftp_buff)));
+	uint16_t code = ftp_reply_code(ftp->ftp_buff);
+	if (code) {
+		ftp->reply_code = code;
+	}
+	ftp_trace_reply(ftp, code);
+	return (ftp_netconn_write(ftp->ctrlconn, ftp->ftp_buff, strlen(ftp->ftp_buff), NETCONN_COPY, FTP_SERVER_WRITE_TIMEOUT_MS));
 }
 
 // Create string YYYYMMDDHHMMSS from date and time
@@ -226,11 +661,80 @@ static ftp_result_t ftp_send(ftp_data_t *ftp, const char *fmt, ...) {
 //    pointer to string
 
 static char* data_time_to_str(char *str, uint16_t date, uint16_t time) {
-	snprintf(str, 25, "%04d%02d%02d%02d%02d%02d", ((date & 0xFE00) >> 9) + 1980, (date & 0x01E0) >> 5, date & 0x001F, (time & 0xF800) >> 11,
+	snprintf(str, FTP_DATE_STRING_SIZE, "%04d%02d%02d%02d%02d%02d", ((date & 0xFE00) >> 9) + 1980, (date & 0x01E0) >> 5, date & 0x001F, (time & 0xF800) >> 11,
 			(time & 0x07E0) >> 5, (time & 0x001F) << 1);
 	return (str);
 }
 
+// Convert 64-bit unsigned value to decimal string
+//
+// 64-bit division is a library call on 32-bit cores, so value is split
+// into 9-digit parts with at most two 64-bit divisions, rest is 32-bit
+//
+// parameters:
+//    str: buffer of at least FTP_U64_STRING_SIZE bytes
+//
+// return:
+//    pointer to string
+
+static char* u64_to_str(char *str, uint64_t value) {
+	uint32_t parts[3];
+	uint8_t cnt = 0;
+	while (value > UINT32_MAX) {
+		uint64_t q = value / 1000000000u;
+		parts[cnt++] = (uint32_t) (value - q * 1000000000u);
+		value = q;
+	}
+	parts[cnt++] = (uint32_t) value;
+
+	char *p = str;
+	for (int8_t i = cnt - 1; i >= 0; i--) {
+		char tmp[10];
+		uint8_t len = 0;
+		uint32_t v = parts[i];
+		do {
+			tmp[len++] = '0' + (v % 10);
+			v /= 10;
+		} while (v != 0);
+		// lower parts are always 9 digits long
+		if (i != cnt - 1) {
+			while (len < 9) {
+				tmp[len++] = '0';
+			}
+		}
+		while (len) {
+			*p++ = tmp[--len];
+		}
+	}
+	*p = 0;
+	return (str);
+}
+
+// Parse decimal string to 64-bit unsigned value
+//
+// return:
+//    true if whole string is a number which fits in 64 bits
+
+static bool str_to_u64(const char *str, uint64_t *value) {
+	uint64_t v = 0;
+	if (*str == 0) {
+		return (false);
+	}
+	while (*str) {
+		if (!isdigit((uint8_t ) *str)) {
+			return (false);
+		}
+		uint8_t digit = *str - '0';
+		if (v > (UINT64_MAX - digit) / 10) {
+			return (false);
+		}
+		v = v * 10 + digit;
+		str++;
+	}
+	*value = v;
+	return (true);
+}
+
 // Calculate date and time from first parameter sent by MDTM command (YYYYMMDDHHMMSS)
 //
 // parameters:
@@ -249,91 +753,150 @@ static uint8_t date_time_get(char *parameters, uint16_t *pdate, uint16_t *ptime)
 		if (!isdigit((uint8_t ) parameters[i]))
 			return (0);
 
-	parameters[14] = 0;
-	*ptime = atoi(parameters + 12) >> 1;   // seconds
-	parameters[12] = 0;
-	*ptime |= atoi(parameters + 10) << 5;  // minutes
-	parameters[10] = 0;
-	*ptime |= atoi(parameters + 8) << 11;  // hours
-	parameters[8] = 0;
-	*pdate = atoi(parameters + 6);         // days
-	parameters[6] = 0;
-	*pdate |= atoi(parameters + 4) << 5;   // months
-	parameters[4] = 0;
-	*pdate |= (atoi(parameters) - 1980) << 9;       // years
+	// digits are already checked, convert fields in place
+	uint16_t field[6];
+	const uint8_t field_len[6] = { 4, 2, 2, 2, 2, 2 };
+	const char *p = parameters;
+	for (uint8_t i = 0; i < 6; i++) {
+		field[i] = 0;
+		for (uint8_t j = 0; j < field_len[i]; j++) {
+			field[i] = field[i] * 10 + (*p++ - '0');
+		}
+	}
+	// FAT timestamp range: 1980..2107, seconds with 2 s resolution
+	if (field[0] < 1980 || field[0] > 2107 || field[1] < 1 || field[1] > 12 || field[2] < 1 || field[2] > 31 || field[3] > 23 || field[4] > 59
+			|| field[5] > 59) {
+		return (0);
+	}
+	*pdate = ((field[0] - 1980) << 9) | (field[1] << 5) | field[2];
+	*ptime = (field[3] << 11) | (field[4] << 5) | (field[5] >> 1);
 
+	parameters[14] = 0;
 	return (15);
 }
 
+// word-at-a-time byte search, word has a zero byte if FTP_SWAR_HAS_ZERO(word) != 0
+#define FTP_SWAR_ONES				((uintptr_t) -1 / 0xFF)
+#define FTP_SWAR_HIGHS				(FTP_SWAR_ONES * 0x80)
+#define FTP_SWAR_HAS_ZERO(w)		(((w) - FTP_SWAR_ONES) & ~(w) & FTP_SWAR_HIGHS)
+
+// Find first occurrence of c1 or c2 in [p, end)
+//
+// bytes are compared one word at a time (4 bytes on Cortex-M),
+// only the word containing a match is scanned byte by byte
+//
+// return:
+//    pointer to found character or end
+
+static const char* ftp_scan2(const char *p, const char *end, char c1, char c2) {
+	// head, until word aligned
+	while (p < end && ((uintptr_t) p & (sizeof(uintptr_t) - 1))) {
+		if (*p == c1 || *p == c2) {
+			return (p);
+		}
+		p++;
+	}
+	// body
+	const uintptr_t m1 = FTP_SWAR_ONES * (uint8_t) c1;
+	const uintptr_t m2 = FTP_SWAR_ONES * (uint8_t) c2;
+	while (p + sizeof(uintptr_t) <= end) {
+		uintptr_t w;
+		memcpy(&w, p, sizeof(w));
+		if (FTP_SWAR_HAS_ZERO(w ^ m1) | FTP_SWAR_HAS_ZERO(w ^ m2)) {
+			break;
+		}
+		p += sizeof(uintptr_t);
+	}
+	// tail and word with match
+	while (p < end) {
+		if (*p == c1 || *p == c2) {
+			return (p);
+		}
+		p++;
+	}
+	return (end);
+}
+
 // =========================================================
 //
 //             Get a command from the client
 //
 // =========================================================
 
-static ftp_result_t ftp_read_command(ftp_data_t *ftp, bool *stop) {
-	// loop and check for packet every second
-	ftp_result_t res = FTP_RES_OK;
-	err_t err = ERR_OK;
-	for (uint32_t i = 0; i < FTP_SERVER_INACTIVE_CNT; i++) {
-		if (*stop == true || FTP.status == FTP_ERROR || FTP.status == FTP_ERROR_STOPPING) {
-			res = FTP_RES_ERROR;
+static bool ftp_should_stop(ftp_data_t *ftp) {
+	return (*ftp->stop == true || FTP.status == FTP_ERROR || FTP.status == FTP_ERROR_STOPPING);
+}
+
+static ftp_result_t ftp_read_command(ftp_data_t *ftp) {
+	// wait for command until inactivity deadline
+	uint32_t start_ms = FTP_TIME_MS();
+	while (1) {
+		if (ftp_should_stop(ftp)) {
 			DEBUG_PRINT(ftp, "NETCONN CLIENT STOP!\r\n");
-			break;
+			return (FTP_RES_ERROR);
 		}
-		err = netconn_recv(ftp->ctrlconn, &ftp->inbuf);
-		if (err == ERR_TIMEOUT) {
-			if (!FTP_ETH_IS_LINK_UP()) {
-				res = FTP_RES_ERROR;
-				DEBUG_PRINT(ftp, "ETH link down!\r\n");
-				break;
-			}
-			continue;
-		} else if (err == ERR_OK) {
-			break;
-		} else {
-			res = FTP_RES_ERROR;
+		uint32_t elapsed_ms = FTP_TIME_MS() - start_ms;
+		if (elapsed_ms >= FTP_SERVER_INACTIVE_TIMEOUT_MS) {
+			DEBUG_PRINT(ftp, "NETCONN RECV TIMEOUT\r\n");
+			return (FTP_RES_TIMEOUT);
+		}
+		uint32_t wait_ms = FTP_SERVER_INACTIVE_TIMEOUT_MS - elapsed_ms;
+		FTP_NETCONN_SET_RECVTIMEOUT(ftp->ctrlconn, wait_ms < FTP_IDLE_WAIT_SLICE_MS ? wait_ms : FTP_IDLE_WAIT_SLICE_MS);
+		err_t err = FTP_NETCONN_RECV(ftp->ctrlconn, &ftp->inbuf);
+		if (err == ERR_OK) {
+			return (FTP_RES_OK);
+		} else if (err != ERR_TIMEOUT) {
 			DEBUG_PRINT(ftp, "NETCONN RECV ERROR: %d\r\n", err);
-			break;
+			return (FTP_RES_ERROR);
+		}
+		if (!FTP_ETH_IS_LINK_UP()) {
+			DEBUG_PRINT(ftp, "ETH link down!\r\n");
+			return (FTP_RES_ERROR);
 		}
 	}
-	if (res == FTP_RES_OK && err == ERR_TIMEOUT) {
-		res = FTP_RES_TIMEOUT;
-		DEBUG_PRINT(ftp, "NETCONN RECV TIMEOUT\r\n");
-	}
-	return (res);
 }
 
+// ASCII letter test, locale independent
+#define FTP_IS_ALPHA(c)		((uint8_t) (((uint8_t) (c) | 0x20) - 'a') < 26)
+
 static int ftp_parse_command_check(ftp_data_t *ftp) {
-	int ret = 0;
 	char *pbuf;
 	uint16_t buflen;
 
+	ftp->command[0] = 0;
+	ftp->parameters[0] = 0;
+
 	// get data from recieved packet
-	netbuf_data(ftp->inbuf, (void**) &pbuf, &buflen);
-	if (buflen != 0) {
-		int8_t i = 0;
-		do {
-			if (!isalpha((uint8_t ) pbuf[i])) {
-				break;
-			}
-			ftp->command[i] = pbuf[i];
-			i++;
-		} while (i < buflen && i < (FTP_CMD_SIZE - 1));
-		if (pbuf[i] == ' ') {
-			while (pbuf[i] == ' ') {
-				i++;
-			}
-			while (pbuf[i + ret] != '\n' && pbuf[i + ret] != '\r' && (i + ret) < buflen) {
-				ret++;
-			}
-			if (ret + 1 >= FTP_PARAM_SIZE) {
-				ret = -1;
-			} else {
-				strncpy(ftp->parameters, pbuf + i, ret);
-			}
-		}
+	FTP_NETBUF_DATA(ftp->inbuf, (void**) &pbuf, &buflen);
+	const char *end = pbuf + buflen;
+	const char *eol = ftp_scan2(pbuf, end, '\r', '\n');
+	const char *p = pbuf;
+
+	// command, folded to upper case
+	uint8_t i = 0;
+	while (p < eol && i < (FTP_CMD_SIZE - 1) && FTP_IS_ALPHA(*p)) {
+		ftp->command[i++] = *p++ & ~0x20;
+	}
+	ftp->command[i] = 0;
+	if (p < eol && FTP_IS_ALPHA(*p)) {
+		// command is too long, it will be reported as unknown
+		ftp->command[0] = 0;
+		return (0);
+	}
+
+	// parameters
+	if (p >= eol || *p != ' ') {
+		return (0);
 	}
+	while (p < eol && *p == ' ') {
+		p++;
+	}
+	int ret = eol - p;
+	if (ret + 1 >= FTP_PARAM_SIZE) {
+		return (-1);
+	}
+	memcpy(ftp->parameters, p, ret);
+	ftp->parameters[ret] = 0;
 	return (ret);
 }
 
@@ -347,13 +910,10 @@ static int ftp_parse_command_check(ftp_data_t *ftp) {
 //          >0 length of parameters
 
 static ftp_result_t ftp_parse_command(ftp_data_t *ftp) {
-	memset(ftp->command, 0, FTP_CMD_SIZE);
-	memset(ftp->parameters, 0, FTP_PARAM_SIZE);
-
 	int ret = ftp_parse_command_check(ftp);
 
 	DEBUG_PRINT(ftp, "Incomming: %s %s\r\n", ftp->command, ftp->parameters);
-	netbuf_delete(ftp->inbuf);
+	FTP_NETBUF_DELETE(ftp->inbuf);
 	if (ret < 0) {
 		return (FTP_RES_ERROR);
 	} else {
@@ -371,21 +931,21 @@ static ftp_result_t pasv_con_open(ftp_data_t *ftp) {
 	if (ftp->listdataconn != NULL) {
 		return (FTP_RES_OK);
 	}
-	ftp->listdataconn = netconn_new(NETCONN_TCP);
+	ftp->listdataconn = FTP_NETCONN_NEW(NETCONN_TCP);
 	if (ftp->listdataconn == NULL) {
 		DEBUG_PRINT(ftp, "Error in opening listening con, creation failed\r\n");
 		ftp_set_error(FTP_ERROR_LISTEN_DATA_NETCONN_NEW);
 		return (FTP_RES_ERROR);
 	}
 	// Bind listdataconn to port (FTP_DATA_PORT + num) with default IP address
-	int8_t err = netconn_bind(ftp->listdataconn, IP_ADDR_ANY, ftp->data_port);
+	int8_t err = FTP_NETCONN_BIND(ftp->listdataconn, IP_ADDR_ANY, ftp->data_port);
 	if (err != ERR_OK) {
 		DEBUG_PRINT(ftp, "Error in opening listening con, bind failed %d\r\n", err);
 		ftp_set_error(FTP_ERROR_LISTEN_DATA_NETCONN_BIND);
 		return (FTP_RES_ERROR);
 	}
-	netconn_set_recvtimeout(ftp->listdataconn, FTP_PSV_LISTEN_TIMEOUT_MS);
-	err = netconn_listen(ftp->listdataconn);
+	FTP_NETCONN_SET_RECVTIMEOUT(ftp->listdataconn, FTP_PSV_LISTEN_TIMEOUT_MS);
+	err = FTP_NETCONN_LISTEN(ftp->listdataconn);
 	if (err != ERR_OK) {
 		DEBUG_PRINT(ftp, "Error in opening listening con, listen failed %d\r\n", err);
 		ftp_set_error(FTP_ERROR_LISTEN_DATA_NETCONN_LISTEN);
@@ -400,12 +960,12 @@ static ftp_result_t pasv_con_close(ftp_data_t *ftp) {
 	if (ftp->listdataconn == NULL) {
 		return (res);
 	}
-	if (netconn_close(ftp->listdataconn) != ERR_OK) {
+	if (FTP_NETCONN_CLOSE(ftp->listdataconn) != ERR_OK) {
 		FTP_LOG_PRINT("listen data NETCONN close error\r\n");
 		ftp_set_error(FTP_ERROR_LISTEN_DATA_NETCONN_CLOSE);
 		res = FTP_RES_ERROR;
 	}
-	if (netconn_delete(ftp->listdataconn) != ERR_OK) {
+	if (FTP_NETCONN_DELETE(ftp->listdataconn) != ERR_OK) {
 		FTP_LOG_PRINT("listen data NETCONN delete error\r\n");
 		ftp_set_error(FTP_ERROR_LISTEN_DATA_NETCONN_DELETE);
 		res = FTP_RES_ERROR;
@@ -414,6 +974,47 @@ static ftp_result_t pasv_con_close(ftp_data_t *ftp) {
 	return (res);
 }
 
+#if FTP_TCP_PROFILE == 1 && !defined(FTP_CUSTOM_NETCONN)
+typedef struct {
+	struct tcpip_api_call_data call;
+	struct netconn *conn;
+	bool ctrl;
+} ftp_conn_profile_t;
+
+// set TCP options in tcpip thread, or under core lock with LWIP_TCPIP_CORE_LOCKING
+static err_t ftp_conn_profile_apply(struct tcpip_api_call_data *call) {
+	ftp_conn_profile_t *profile = (ftp_conn_profile_t*) call;
+	struct tcp_pcb *pcb = profile->conn->pcb.tcp;
+	if (pcb != NULL) {
+		if (profile->ctrl) {
+			ip_set_option(pcb, SOF_KEEPALIVE);
+			pcb->keep_idle = FTP_CTRL_KEEPALIVE_IDLE_MS;
+#if LWIP_TCP_KEEPALIVE
+			pcb->keep_intvl = FTP_CTRL_KEEPALIVE_INTVL_MS;
+			pcb->keep_cnt = FTP_CTRL_KEEPALIVE_CNT;
+#endif
+			tcp_nagle_disable(pcb);
+		} else {
+			tcp_nagle_enable(pcb);
+		}
+	}
+	return (ERR_OK);
+}
+#endif
+
+// Apply TCP options of control or data connection
+//
+// pcb is owned by tcpip thread, so options are never set from session task directly
+static void ftp_conn_profile(struct netconn *conn, bool ctrl) {
+#if FTP_TCP_PROFILE == 1 && !defined(FTP_CUSTOM_NETCONN)
+	ftp_conn_profile_t profile = { .conn = conn, .ctrl = ctrl };
+	tcpip_api_call(ftp_conn_profile_apply, &profile.call);
+#else
+	UNUSED(conn);
+	UNUSED(ctrl);
+#endif
+}
+
 static ftp_result_t data_con_open(ftp_data_t *ftp) {
 	if (ftp->data_conn_mode == DCM_NOT_SET) {
 		DEBUG_PRINT(ftp, "No connecting mode defined\r\n");
@@ -424,40 +1025,41 @@ static ftp_result_t data_con_open(ftp_data_t *ftp) {
 		if (ftp->listdataconn == NULL) {
 			return (FTP_RES_ERROR);
 		}
-		netconn_set_recvtimeout(ftp->listdataconn, FTP_PSV_ACCEPT_TIMEOUT_MS);
-		if (netconn_accept(ftp->listdataconn, &ftp->dataconn) != ERR_OK) {
+		FTP_NETCONN_SET_RECVTIMEOUT(ftp->listdataconn, FTP_PSV_ACCEPT_TIMEOUT_MS);
+		if (FTP_NETCONN_ACCEPT(ftp->listdataconn, &ftp->dataconn) != ERR_OK) {
 			DEBUG_PRINT(ftp, "Error in data conn: netconn_accept\r\n");
 			return (FTP_RES_ERROR);
 		}
-		netconn_set_recvtimeout(ftp->dataconn, FTP_SERVER_READ_TIMEOUT_MS);
-		netconn_set_sendtimeout(ftp->dataconn, FTP_SERVER_WRITE_TIMEOUT_MS);
+		FTP_NETCONN_SET_RECVTIMEOUT(ftp->dataconn, FTP_SERVER_READ_TIMEOUT_MS);
 	} else {
-		ftp->dataconn = netconn_new(NETCONN_TCP);
+		ftp->dataconn = FTP_NETCONN_NEW(NETCONN_TCP);
 		if (ftp->dataconn == NULL) {
 			DEBUG_PRINT(ftp, "Error in data conn: netconn_new\r\n");
 			ftp_set_error(FTP_ERROR_DATA_NETCONN_NEW);
 			return (FTP_RES_ERROR);
 		}
-		if (netconn_bind(ftp->dataconn, IP_ADDR_ANY, 0) != ERR_OK) {
+		if (FTP_NETCONN_BIND(ftp->dataconn, IP_ADDR_ANY, 0) != ERR_OK) {
 			DEBUG_PRINT(ftp, "Error in data conn: netconn_bind\r\n");
 			ftp_set_error(FTP_ERROR_DATA_NETCONN_BIND);
-			if (netconn_delete(ftp->dataconn) != ERR_OK) {
+			if (FTP_NETCONN_DELETE(ftp->dataconn) != ERR_OK) {
 				ftp_set_error(FTP_ERROR_DATA_NETCONN_DELETE);
 			}
 			ftp->dataconn = NULL;
 			return (FTP_RES_ERROR);
 		}
-		netconn_set_recvtimeout(ftp->dataconn, FTP_SERVER_READ_TIMEOUT_MS);
-		netconn_set_sendtimeout(ftp->dataconn, FTP_SERVER_WRITE_TIMEOUT_MS);
-		if (netconn_connect(ftp->dataconn, &ftp->ipclient, ftp->data_port) != ERR_OK) {
+		FTP_NETCONN_SET_RECVTIMEOUT(ftp->dataconn, FTP_SERVER_READ_TIMEOUT_MS);
+		if (FTP_NETCONN_CONNECT(ftp->dataconn, &ftp->ipclient, ftp->data_port) != ERR_OK) {
 			DEBUG_PRINT(ftp, "Error in data conn: netconn_connect\r\n");
-			if (netconn_delete(ftp->dataconn) != ERR_OK) {
+			if (FTP_NETCONN_DELETE(ftp->dataconn) != ERR_OK) {
 				ftp_set_error(FTP_ERROR_DATA_NETCONN_DELETE);
 			}
 			ftp->dataconn = NULL;
 			return (FTP_RES_ERROR);
 		}
 	}
+	ftp_conn_profile(ftp->dataconn, false);
+	ftp->xfer_start_ms = FTP_TIME_MS();
+	ftp->xfer_bytes = 0;
 	return (FTP_RES_OK);
 }
 
@@ -468,12 +1070,12 @@ static ftp_result_t data_con_close(ftp_data_t *ftp) {
 	if (ftp->dataconn == NULL) {
 		return (res);
 	}
-	if (netconn_close(ftp->dataconn) != ERR_OK) {
+	if (FTP_NETCONN_CLOSE(ftp->dataconn) != ERR_OK) {
 		FTP_LOG_PRINT("data NETCONN close error\r\n");
 		ftp_set_error(FTP_ERROR_DATA_NETCONN_CLOSE);
 		res = FTP_RES_ERROR;
 	}
-	if (netconn_delete(ftp->dataconn) != ERR_OK) {
+	if (FTP_NETCONN_DELETE(ftp->dataconn) != ERR_OK) {
 		FTP_LOG_PRINT("data NETCONN delete error\r\n");
 		ftp_set_error(FTP_ERROR_DATA_NETCONN_DELETE);
 		res = FTP_RES_ERROR;
@@ -484,741 +1086,3001 @@ static ftp_result_t data_con_close(ftp_data_t *ftp) {
 
 // =========================================================
 //
-//                  Functions on files
+//                  Shared read of files
 //
 // =========================================================
 
-static void path_up_a_level(char *path) {
-	// is there a dash in the string?
-	if (strchr(path, '/')) {
-		// get position
-		uint32_t pos = strlen(path) - 1;
+// RETR reader state, position is tracked here because FIL is not moved when block is taken from shared window
+typedef struct {
+	int8_t slot; // shared file slot, -1 when file is read privately
+	uint64_t pos; // offset of next byte for client
+	uint64_t file_pos; // position of FIL
+	uint64_t storage_bytes; // bytes read from storage
+	uint64_t shared_bytes; // bytes taken from shared window
+	uint32_t loaded; // index + 1 of block last read from storage by this reader, its rest is not counted as shared
+} ftp_reader_t;
 
-		// go up a folder
-		while (path[pos] != '/') {
-			// clear character
-			path[pos] = 0;
+#if FTP_SHARED_READ == 1
 
-			// update position
-			pos = strlen(path) - 1;
+// Attach reader to shared window of file in ftp->path, described by ftp->finfo
+//
+// slot with the same file is joined, otherwise least recently used slot without readers is taken,
+// file is read privately when all slots are in use or file fits into one block
+static void ftp_shared_attach(ftp_data_t *ftp, ftp_reader_t *rd) {
+	rd->slot = -1;
+	if (ftp->finfo.fsize <= FTP_SHARED_READ_BLOCK_SIZE) {
+		return;
+	}
+	ftp_stats_lock();
+	int8_t free_slot = -1;
+	for (int8_t i = 0; i < FTP_SHARED_READ_FILES; i++) {
+		ftp_shared_file_t *f = &ftp_shared[i];
+		if (f->path[0] && f->size == ftp->finfo.fsize && f->fdate == ftp->finfo.fdate && f->ftime == ftp->finfo.ftime
+				&& !strcmp(f->path, ftp->path)) {
+			rd->slot = i;
+			break;
+		}
+		if (f->readers == 0 && (free_slot < 0 || f->stamp < ftp_shared[free_slot].stamp)) {
+			free_slot = i;
 		}
+	}
+	if (rd->slot < 0 && free_slot >= 0) {
+		ftp_shared_file_t *f = &ftp_shared[free_slot];
+		strncpy(f->path, ftp->path, FTP_CWD_SIZE);
+		f->size = ftp->finfo.fsize;
+		f->fdate = ftp->finfo.fdate;
+		f->ftime = ftp->finfo.ftime;
+		memset(f->blocks, 0, sizeof(f->blocks));
+		rd->slot = free_slot;
+	}
+	if (rd->slot >= 0) {
+		ftp_shared[rd->slot].readers++;
+		ftp_shared[rd->slot].stamp = ++ftp_shared_clock;
+	}
+	ftp_stats_unlock();
+}
 
-		// remove the dash on which the wile loop exits, but only
-		// when we are not root
-		if (strlen(path) > 1)
-			path[pos] = 0;
+static void ftp_shared_detach(ftp_reader_t *rd) {
+	if (rd->slot < 0) {
+		return;
 	}
+	ftp_stats_lock();
+	ftp_shared[rd->slot].readers--;
+	ftp_stats_unlock();
+	rd->slot = -1;
 }
 
-// Make complete path/name from cwdName and parameters
-//
-// 3 possible cases:
-//   parameters can be absolute path, relative path or only the name
-//
-// parameters:
-//   fullName : where to store the path/name
-//
-// return:
-//   true, if done
+// Forget file or directory tree which is going to be changed, sessions already reading it keep their slot
+static void ftp_shared_invalidate(const char *path) {
+	size_t len = strlen(path);
+	ftp_stats_lock();
+	for (uint8_t i = 0; i < FTP_SHARED_READ_FILES; i++) {
+		char *p = ftp_shared[i].path;
+		if (!strncmp(p, path, len) && (p[len] == 0 || p[len] == '/')) {
+			p[0] = 0;
+		}
+	}
+	ftp_stats_unlock();
+}
 
-static uint8_t path_build(char *current_path, char *ftp_param) {
-	// Should we go to the root directory or is the parameter buffer empty?
-	if (!strcmp(ftp_param, "/") || strlen(ftp_param) == 0) {
-		// go to root directory
-		strncpy(current_path, "/", FTP_CWD_SIZE);
+// find block with index or choose block to be replaced, must be called with lock held
+static ftp_shared_block_t* ftp_shared_find(ftp_shared_file_t *f, uint32_t index, bool *found) {
+	ftp_shared_block_t *victim = NULL;
+	for (uint8_t i = 0; i < FTP_SHARED_READ_BLOCKS; i++) {
+		ftp_shared_block_t *b = &f->blocks[i];
+		if (b->state != FTP_SHARED_BLOCK_EMPTY && b->index == index) {
+			*found = true;
+			return (b);
+		}
+		// empty block is preferred, then least recently used valid one
+		if (b->state == FTP_SHARED_BLOCK_EMPTY) {
+			if (victim == NULL || victim->state != FTP_SHARED_BLOCK_EMPTY) {
+				victim = b;
+			}
+		} else if (b->state == FTP_SHARED_BLOCK_VALID && (victim == NULL || (victim->state == FTP_SHARED_BLOCK_VALID && b->stamp < victim->stamp))) {
+			victim = b;
+		}
 	}
-	// should we go up a directory?
-	else if (strcmp(ftp_param, "..") == 0) {
-		// remove characters until '/' is found
-		path_up_a_level(current_path);
+	*found = false;
+	return (victim);
+}
+#else
+#define ftp_shared_attach(ftp, rd)		((rd)->slot = -1)
+#define ftp_shared_detach(rd)			do {} while(0)
+#define ftp_shared_invalidate(path)		do {} while(0)
+#endif
+
+// read from storage at reader position
+static FRESULT ftp_reader_storage(ftp_data_t *ftp, ftp_reader_t *rd, uint64_t ofs, char *buff, uint32_t len, uint32_t *bytes_read) {
+	if (rd->file_pos != ofs) {
+		FRESULT file_err = FTP_F_LSEEK(&ftp->file, ofs);
+		if (file_err != FR_OK) {
+			return (file_err);
+		}
+		rd->file_pos = ofs;
 	}
-	// The incoming parameter doesn't contain a slash? this means that
-	// the parameter is only the folder name and it should be appended
-	else if (ftp_param[0] != '/') {
-		// should we concatinate '/'?
-		if (current_path[strlen(current_path) - 1] != '/')
-			strncat(current_path, "/", FTP_CWD_SIZE);
+	// only data read by storage is invalidated, copies done by CPU must stay in cache
+	ftp_dcache_invalidate_buff(ftp, buff, len);
+	FRESULT file_err = FTP_F_READ(&ftp->file, buff, len, (UINT* ) bytes_read);
+	ftp_dcache_invalidate_buff(ftp, buff, len);
+	if (file_err == FR_OK) {
+		rd->file_pos += *bytes_read;
+		rd->storage_bytes += *bytes_read;
+	}
+	return (file_err);
+}
 
-		// concatinate parameter to string
-		strncat(current_path, ftp_param, FTP_CWD_SIZE);
+// Read next part of file for RETR
+//
+// with shared read, at most up to end of current block is returned, block missing in window
+// is read whole by this session and published, buff must hold FTP_SHARED_READ_BLOCK_SIZE
+static FRESULT ftp_reader_read(ftp_data_t *ftp, ftp_reader_t *rd, char *buff, uint32_t len, uint32_t *bytes_read) {
+	FRESULT file_err;
+#if FTP_SHARED_READ == 1
+	if (rd->slot >= 0) {
+		ftp_shared_file_t *f = &ftp_shared[rd->slot];
+		uint32_t index = (uint32_t) (rd->pos / FTP_SHARED_READ_BLOCK_SIZE);
+		uint32_t offset = (uint32_t) (rd->pos % FTP_SHARED_READ_BLOCK_SIZE);
+		uint32_t wait_start_ms = FTP_TIME_MS();
+		bool found;
+		ftp_stats_lock();
+		ftp_shared_block_t *b = ftp_shared_find(f, index, &found);
+		// block is being read by other session which is just ahead, wait for it
+		while (found && b->state == FTP_SHARED_BLOCK_LOADING && FTP_TIME_MS() - wait_start_ms < FTP_SHARED_READ_WAIT_MS) {
+			ftp_stats_unlock();
+			FTP_DELAY_MS(1);
+			ftp_stats_lock();
+			b = ftp_shared_find(f, index, &found);
+		}
+		if (found && b->state == FTP_SHARED_BLOCK_VALID) {
+			uint32_t n = b->len > offset ? b->len - offset : 0;
+			n = n < len ? n : len;
+			memcpy(buff, ftp_shared_data[rd->slot][b - f->blocks] + offset, n);
+			b->stamp = ++ftp_shared_clock;
+			ftp_stats_unlock();
+			rd->pos += n;
+			if (index + 1 != rd->loaded) {
+				rd->shared_bytes += n;
+			}
+			*bytes_read = n;
+			return (FR_OK);
+		}
+		if (found || b == NULL) {
+			// still loading or all blocks are loading, read privately
+			ftp_stats_unlock();
+		} else {
+			b->state = FTP_SHARED_BLOCK_LOADING;
+			b->index = index;
+			ftp_stats_unlock();
+
+			uint32_t got = 0;
+			file_err = ftp_reader_storage(ftp, rd, (uint64_t) index * FTP_SHARED_READ_BLOCK_SIZE, buff, FTP_SHARED_READ_BLOCK_SIZE, &got);
+			ftp_stats_lock();
+			if (file_err == FR_OK) {
+				memcpy(ftp_shared_data[rd->slot][b - f->blocks], buff, got);
+				b->len = got;
+				b->stamp = ++ftp_shared_clock;
+				b->state = FTP_SHARED_BLOCK_VALID;
+			} else {
+				b->state = FTP_SHARED_BLOCK_EMPTY;
+			}
+			ftp_stats_unlock();
+			if (file_err != FR_OK) {
+				return (file_err);
+			}
+			rd->loaded = index + 1;
+			uint32_t n = got > offset ? got - offset : 0;
+			n = n < len ? n : len;
+			if (offset && n) {
+				memmove(buff, buff + offset, n);
+			}
+			rd->pos += n;
+			*bytes_read = n;
+			return (FR_OK);
+		}
 	}
-	// The incoming parameter starts with a slash. This means that
-	// the parameter is the whole path.
-	else {
-		strncpy(current_path, ftp_param, FTP_CWD_SIZE);
+#endif
+	file_err = ftp_reader_storage(ftp, rd, rd->pos, buff, len, bytes_read);
+	if (file_err == FR_OK) {
+		rd->pos += *bytes_read;
 	}
+	return (file_err);
+}
 
-	// If the string is longer than 1 character and ends with '/', remove it
-	uint16_t strl = strlen(current_path) - 1;
-	if (current_path[strl] == '/' && strl > 1)
-		current_path[strl] = 0;
+// =========================================================
+//
+//          Lookups relative to current directory
+//
+// =========================================================
 
-	// does the string fit? success
-	if (strlen(current_path) < FTP_CWD_SIZE)
-		return (1);
+#if FTP_CWD_RELATIVE == 1
+// FATFS current directory is shared by all sessions, so it is held from f_chdir till lookup is done,
+// FS lock is taken before stats lock, never while stats lock is held
+static void ftp_fs_lock(void) {
+	ftp_mutex_take(FTP.fs_mutex);
+}
 
-	// failed
-	return (0);
+static void ftp_fs_unlock(void) {
+	ftp_mutex_give(FTP.fs_mutex);
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Name to pass to FATFS for absolute path, must be called with FS lock held
 //
-//			FTP commands
-//
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// print working directory
-static ftp_result_t ftp_cmd_pwd(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	} else {
-		return (ftp_send(ftp, "257 \"%s\" is your current directory\r\n", ftp->path));
-	}
+// volume current directory is moved to parent of path when it differs, f_chdir walks
+// the parent and name is found with one more directory scan, so it costs the same as
+// absolute lookup, next lookups in the same directory scan only this directory
+static const char* ftp_fs_name(const char *path) {
+	const char *name = strrchr(path, '/');
+	if (name == NULL || name == path) {
+		return (path);
+	}
+	size_t len = name - path;
+	if (len >= FTP_CWD_SIZE) {
+		return (path);
+	}
+	if (strncmp(ftp_vol_cwd, path, len) != 0 || ftp_vol_cwd[len] != 0) {
+		char dir[FTP_CWD_SIZE];
+		memcpy(dir, path, len);
+		dir[len] = 0;
+		if (FTP_F_CHDIR(dir) != FR_OK) {
+			return (path);
+		}
+		strcpy(ftp_vol_cwd, dir);
+		return (name + 1);
+	}
+	uint32_t levels = 0;
+	for (const char *p = path; p < name; p++) {
+		levels += (*p == '/');
+	}
+	ftp_stats_lock();
+	FTP.stats.relative_lookups++;
+	FTP.stats.dir_scans_avoided += levels;
+	ftp_stats_unlock();
+	return (name + 1);
 }
 
-// change working directory
-static ftp_result_t ftp_cmd_cwd(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No directory name\r\n"));
-	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
-	}
-	if (strcmp(ftp->path, "/") != 0 && FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
-		return (ftp_send(ftp, "550 Failed to change directory to %s\r\n", ftp->path));
-	}
+static FRESULT ftp_fs_stat(const char *path, FILINFO *finfo) {
+	ftp_fs_lock();
+	FRESULT res = FTP_F_STAT(ftp_fs_name(path), finfo);
+	ftp_fs_unlock();
+	return (res);
+}
 
-	return (ftp_send(ftp, "250 Directory successfully changed.\r\n"));
+static FRESULT ftp_fs_open(const char *path, FIL *fp, BYTE mode) {
+	ftp_fs_lock();
+	FRESULT res = FTP_F_OPEN(fp, ftp_fs_name(path), mode);
+	ftp_fs_unlock();
+	return (res);
 }
 
-// Change the remote machine working directory to the parent of the current remote machine working directory.
-static ftp_result_t ftp_cmd_cdup(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// Move volume current directory to root when it is in path which is going to be changed,
+// FATFS does not remove current directory and its path would be no longer valid after rename
+static void ftp_cwd_invalidate(const char *path) {
+	size_t len = strlen(path);
+	ftp_fs_lock();
+	if (!strncmp(ftp_vol_cwd, path, len) && (ftp_vol_cwd[len] == 0 || ftp_vol_cwd[len] == '/') && strcmp(ftp_vol_cwd, "/")) {
+		if (FTP_F_CHDIR("/") == FR_OK) {
+			strcpy(ftp_vol_cwd, "/");
+		} else {
+			ftp_vol_cwd[0] = 0;
+		}
 	}
-	strncpy(ftp->path, "/", FTP_CWD_SIZE);
-	return (ftp_send(ftp, "250 Directory successfully changed to root.\r\n"));
+	ftp_fs_unlock();
 }
+#else
+#define ftp_fs_stat(path, finfo)		FTP_F_STAT(path, finfo)
+#define ftp_fs_open(path, fp, mode)		FTP_F_OPEN(fp, path, mode)
+#define ftp_cwd_invalidate(path)		do {} while(0)
+#endif
 
-static ftp_result_t ftp_cmd_mode(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
-	if (!strcmp(ftp->parameters, "S")) {
-		return (ftp_send(ftp, "200 S Ok\r\n"));
-	} else {
-		return (ftp_send(ftp, "504 Only S(tream) is suported\r\n"));
+// =========================================================
+//
+//                  Open file cache
+//
+// =========================================================
+
+#if FTP_OPEN_CACHE == 1
+// entry for path, must be called with lock held
+static ftp_open_cache_t* ftp_cache_find(const char *path) {
+	for (uint8_t i = 0; i < FTP_OPEN_CACHE_ENTRIES; i++) {
+		if (ftp_open_cache[i].path[0] && !strcmp(ftp_open_cache[i].path, path)) {
+			return (&ftp_open_cache[i]);
+		}
 	}
+	return (NULL);
 }
 
-static ftp_result_t ftp_cmd_stru(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// FTP_F_STAT through cache, only existing objects are cached
+static FRESULT ftp_stat(const char *path, FILINFO *finfo) {
+	ftp_stats_lock();
+	ftp_open_cache_t *e = ftp_cache_find(path);
+	if (e != NULL) {
+		*finfo = e->finfo;
+		e->stamp = ++ftp_open_cache_clock;
+		FTP.stats.path_walks_avoided++;
+		ftp_stats_unlock();
+		return (FR_OK);
+	}
+	FTP.stats.path_walks++;
+	uint32_t generation = ftp_open_cache_generation;
+	ftp_stats_unlock();
+
+	FRESULT res = ftp_fs_stat(path, finfo);
+	if (res != FR_OK || strlen(path) >= FTP_CWD_SIZE) {
+		return (res);
 	}
-	if (!strcmp(ftp->parameters, "F")) {
-		return (ftp_send(ftp, "200 F Ok\r\n"));
-	} else {
-		return (ftp_send(ftp, "504 Only F(ile) is suported\r\n"));
+	ftp_stats_lock();
+	// path may have been changed while it was looked up without lock, then result is not cached
+	if (generation == ftp_open_cache_generation && ftp_cache_find(path) == NULL) {
+		// least recently used entry is replaced
+		e = &ftp_open_cache[0];
+		for (uint8_t i = 1; i < FTP_OPEN_CACHE_ENTRIES && e->path[0]; i++) {
+			if (!ftp_open_cache[i].path[0] || ftp_open_cache[i].stamp < e->stamp) {
+				e = &ftp_open_cache[i];
+			}
+		}
+		strcpy(e->path, path);
+		e->finfo = *finfo;
+		e->file_valid = false;
+		e->stamp = ++ftp_open_cache_clock;
 	}
+	ftp_stats_unlock();
+	return (res);
 }
 
-static ftp_result_t ftp_cmd_type(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
-	if (!strcmp(ftp->parameters, "A")) {
-		return (ftp_send(ftp, "200 TYPE is now ASCII\r\n"));
-	} else if (!strcmp(ftp->parameters, "I")) {
-		return (ftp_send(ftp, "200 TYPE is now 8-bit binary\r\n"));
-	} else {
-		return (ftp_send(ftp, "504 Unknow TYPE\r\n"));
+// Open file for reading through cache
+//
+// FIL of read-only file right after f_open holds only directory entry location,
+// start cluster and size, so copy of it opens the file again without path walk,
+// copy which does not pass validation (f.e. volume was remounted) is dropped
+static FRESULT ftp_open_read(const char *path, FIL *fp) {
+	ftp_stats_lock();
+	ftp_open_cache_t *e = ftp_cache_find(path);
+	if (e != NULL && e->file_valid) {
+		memcpy(fp, &e->file, sizeof(FIL));
+		e->stamp = ++ftp_open_cache_clock;
+		if (FTP_F_LSEEK(fp, 0) == FR_OK) {
+			FTP.stats.path_walks_avoided++;
+			ftp_stats_unlock();
+			return (FR_OK);
+		}
+		e->path[0] = 0;
 	}
-}
+	FTP.stats.path_walks++;
+	uint32_t generation = ftp_open_cache_generation;
+	ftp_stats_unlock();
 
-static ftp_result_t ftp_cmd_pasv(ftp_data_t *ftp) {
-	// are we not yet logged in?
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+	FRESULT res = ftp_fs_open(path, fp, FA_READ);
+	if (res != FR_OK) {
+		return (res);
 	}
-#if FTP_USE_PASSIVE_MODE == 1
-	// set data port
-	ftp->data_port = FTP_DATA_PORT + ftp->data_port_incremented + (ftp->ftp_con_num * PORT_INCREMENT_OFFSET);
+	// only entry created by ftp_stat is completed, so FILINFO of entry is always valid
+	ftp_stats_lock();
+	e = (generation == ftp_open_cache_generation) ? ftp_cache_find(path) : NULL;
+	if (e != NULL) {
+		memcpy(&e->file, fp, sizeof(FIL));
+		e->file_valid = true;
+	}
+	ftp_stats_unlock();
+	return (res);
+}
 
-	// open connection ok?
-	if (pasv_con_open(ftp) == FTP_RES_OK) {
-		// close data connection, just to be sure
-		if (data_con_close(ftp) != FTP_RES_OK) {
-			return (pasv_con_close(ftp));
+// Forget cached files in path and below it
+//
+// called before change and again when it is done, so lookup running during change is not cached
+static void ftp_cache_invalidate(const char *path) {
+	size_t len = strlen(path);
+	ftp_stats_lock();
+	ftp_open_cache_generation++;
+	for (uint8_t i = 0; i < FTP_OPEN_CACHE_ENTRIES; i++) {
+		char *p = ftp_open_cache[i].path;
+		if (!strncmp(p, path, len) && (p[len] == 0 || p[len] == '/')) {
+			p[0] = 0;
 		}
-		// feedback
-		DEBUG_PRINT(ftp, "Data port set to %u\r\n", ftp->data_port);
-		// set state
-		ftp->data_conn_mode = DCM_PASSIVE;
-		// reply that we are entering passive mode
-		return (ftp_send(ftp, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).\r\n", ftp->ipserver.addr & 0xFF, (ftp->ipserver.addr >> 8) & 0xFF,
-				(ftp->ipserver.addr >> 16) & 0xFF, (ftp->ipserver.addr >> 24) & 0xFF, ftp->data_port >> 8, ftp->data_port & 255));
-	} else {
-		// reset data conn mode
-		ftp->data_conn_mode = DCM_NOT_SET;
-		// send error
-		ftp_send(ftp, "425 Can't set connection management to passive\r\n");
-		return (FTP_RES_ERROR);
 	}
+	ftp_stats_unlock();
+}
 #else
-	// reset data conn mode
-	ftp->dataConnMode = DCM_NOT_SET;
-	// send error
-	return (ftp_send(ftp, "421 Passive mode not available\r\n"));
+#define ftp_stat(path, finfo)		ftp_fs_stat(path, finfo)
+#define ftp_open_read(path, fp)		ftp_fs_open(path, fp, FA_READ)
+#define ftp_cache_invalidate(path)	do {} while(0)
 #endif
-}
 
-static ftp_result_t ftp_cmd_port(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// Called before file or directory tree in path is changed, "" means whole volume
+static void ftp_path_changed(const char *path) {
+	if (!strcmp(path, "/")) {
+		path = "";
 	}
-	uint8_t ip[4];
-	uint8_t i;
+	ftp_shared_invalidate(path);
+	ftp_cache_invalidate(path);
+	ftp_cwd_invalidate(path);
+}
 
-	if (data_con_close(ftp) != FTP_RES_OK) {
-		return (FTP_RES_ERROR);
-	}
+// =========================================================
+//
+//                  File locks between sessions
+//
+// =========================================================
 
-	if (strlen(ftp->parameters) == 0) {
-		ftp->data_conn_mode = DCM_NOT_SET;
-		return (ftp_send(ftp, "501 no parameters given\r\n"));
-	}
+// ASCII letter in lower case, FatFs finds names regardless of case
+#define FTP_FOLD(c)			((uint8_t) (FTP_IS_ALPHA(c) ? ((c) | 0x20) : (c)))
 
-	// Start building IP
-	char *p = ftp->parameters - 1;
-	for (i = 0; i < 4 && p != NULL; i++) {
-		if (p == NULL) {
-			break;
-		}
-		ip[i] = atoi(++p);
-		p = strchr(p, ',');
+#if FTP_FILE_LOCK == 1 || FTP_SITE_SYNC == 1
+// FNV-1a hash of path folded to lower case, so names differing only in case have same hash
+static uint32_t ftp_path_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash = (hash ^ FTP_FOLD(*path)) * 16777619u;
+		path++;
 	}
+	return (hash);
+}
+#endif
 
-	if (p != NULL) {
-		if (i == 4) {
-			ftp->data_port = 256 * atoi(++p);
+#if FTP_FILE_LOCK == 1 || FTP_JOURNAL == 1 || FTP_SITE_COPY == 1
+// return: true, if first len characters of paths are same regardless of case
+static bool ftp_path_equal(const char *a, const char *b, size_t len) {
+	for (; len; len--, a++, b++) {
+		if (FTP_FOLD(*a) != FTP_FOLD(*b)) {
+			return (false);
 		}
-		p = strchr(p, ',');
-		if (p != NULL) {
-			ftp->data_port += atoi(++p);
+		if (*a == 0) {
+			break;
 		}
 	}
+	return (true);
+}
 
-	if (p == NULL) {
-		ftp->data_conn_mode = DCM_NOT_SET;
-		return (ftp_send(ftp, "501 Can't interpret parameters\r\n"));
+// return: true, if path is root or it is below root
+static bool ftp_path_within(const char *path, const char *root) {
+	size_t len = strlen(root);
+	if (len == 1 && root[0] == '/') {
+		return (true);
 	}
+	return (ftp_path_equal(path, root, len) && (path[len] == 0 || path[len] == '/'));
+}
+#endif
 
-	DEBUG_PRINT(ftp, "Data IP set to %u:%u:%u:%u\r\n", ip[0], ip[1], ip[2], ip[3]);
-	DEBUG_PRINT(ftp, "Data port set to %u\r\n", ftp->data_port);
-
-	IP4_ADDR(&ftp->ipclient, ip[0], ip[1], ip[2], ip[3]);
-	ftp->data_conn_mode = DCM_ACTIVE;
+#if FTP_FILE_LOCK == 1
 
-	return (ftp_send(ftp, "200 PORT command successful\r\n"));
+// return: true, if lock held by other session conflicts with new lock of path in mode
+static bool ftp_lock_conflict(const ftp_lock_t *l, const char *path, uint32_t hash, ftp_lock_mode_t mode) {
+	if (l->mode == FTP_LOCK_NONE) {
+		return (false);
+	}
+	if ((l->mode == FTP_LOCK_TREE && ftp_path_within(path, l->path)) || (mode == FTP_LOCK_TREE && ftp_path_within(l->path, path))) {
+		return (true);
+	}
+	return (l->hash == hash && ftp_path_equal(l->path, path, FTP_CWD_SIZE) && (mode != FTP_LOCK_READ || l->mode != FTP_LOCK_READ));
 }
 
-static ftp_result_t ftp_cmd_list(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// Lock file in path for this session to slot, every session holds at most FTP_LOCK_SLOTS locks
+//
+// readers share the file, writer needs it for itself, tree lock needs whole directory tree
+// in path, conflict check and taking the lock are one step under mutex
+// return: false, if other session holds conflicting lock
+static bool ftp_lock_slot(ftp_data_t *ftp, uint8_t slot, const char *path, ftp_lock_mode_t mode) {
+	if (strlen(path) >= FTP_CWD_SIZE) {
+		return (false);
+	}
+	uint32_t hash = ftp_path_hash(path);
+	bool ok = true;
+	ftp_stats_lock();
+	for (uint8_t i = 0; i < FTP_NBR_CLIENTS && ok; i++) {
+		for (uint8_t j = 0; j < FTP_LOCK_SLOTS && i != ftp->ftp_con_num; j++) {
+			if (ftp_lock_conflict(&ftp_locks[i][j], path, hash, mode)) {
+				ok = false;
+				break;
+			}
+		}
 	}
+	if (ok) {
+		ftp_lock_t *own = &ftp_locks[ftp->ftp_con_num][slot];
+		own->hash = hash;
+		own->mode = mode;
+		strcpy(own->path, path);
+	} else {
+		FTP.stats.lock_conflicts++;
+	}
+	ftp_stats_unlock();
+	return (ok);
+}
 
-	DIR dir;
-	if (FTP_F_OPENDIR(&dir, ftp->path) != FR_OK) {
-		return (ftp_send(ftp, "550 Can't open directory %s\r\n", ftp->parameters));
+// release all locks of this session
+static void ftp_unlock(ftp_data_t *ftp) {
+	ftp_stats_lock();
+	for (uint8_t j = 0; j < FTP_LOCK_SLOTS; j++) {
+		ftp_locks[ftp->ftp_con_num][j].mode = FTP_LOCK_NONE;
 	}
-	if (data_con_open(ftp) != FTP_RES_OK) {
-		ftp_send(ftp, "425 Can't create connection\r\n");
-		return (FTP_RES_ERROR);
+	ftp_stats_unlock();
+}
+#else
+#define ftp_lock_slot(ftp, slot, path, mode)	(true)
+#define ftp_unlock(ftp)							do {} while(0)
+#endif
+
+#if FTP_JOURNAL == 1
+// return: true, if path is journal file or tree lock of path would hold it, only server writes journal
+static bool ftp_path_reserved(const char *path, ftp_lock_mode_t mode) {
+	static const char *const journal[] = { FTP_JOURNAL_PATH, FTP_JOURNAL_OLD_PATH };
+	for (uint8_t i = 0; i < 2; i++) {
+		if (mode == FTP_LOCK_TREE ? ftp_path_within(journal[i], path) : ftp_path_equal(journal[i], path, FTP_CWD_SIZE)) {
+			return (true);
+		}
+	}
+	return (false);
+}
+#else
+#define ftp_path_reserved(path, mode)			(false)
+#endif
+
+#define ftp_lock(ftp, path, mode)		(!ftp_path_reserved(path, mode) && ftp_lock_slot(ftp, 0, path, mode))
+#define ftp_lock_tree(ftp, slot, path)	(!ftp_path_reserved(path, FTP_LOCK_TREE) && ftp_lock_slot(ftp, slot, path, FTP_LOCK_TREE))
+
+// =========================================================
+//
+//                      Change journal
+//
+// =========================================================
+
+#if FTP_JOURNAL == 1
+// record without path: seq, change letter, size and separators
+#define FTP_JOURNAL_LINE_FIXED		(10 + 1 + 1 + 1 + FTP_U64_STRING_SIZE + 1 + 1)
+#define FTP_JOURNAL_LINE_MAX		(FTP_JOURNAL_LINE_FIXED + FTP_CWD_SIZE)
+FTP_STATIC_ASSERT(FTP_JOURNAL_LINE_MAX <= FTP_JOURNAL_SECTOR, "_MAX_LFN is too big for change journal");
+FTP_STATIC_ASSERT(FTP_JOURNAL_MAX_SIZE >= 4 * FTP_JOURNAL_SECTOR, "FTP_JOURNAL_MAX_SIZE is too small");
+
+// journal state and files are held while they are read or written, so statistics are not blocked by file I/O,
+// journal lock is taken before stats lock, never while stats lock is held
+static void ftp_journal_lock(void) {
+	ftp_mutex_take(FTP.journal_mutex);
+}
+
+static void ftp_journal_unlock(void) {
+	ftp_mutex_give(FTP.journal_mutex);
+}
+
+// Read journal sector at offset to ftp_journal_sector
+//
+// return: bytes read, sector is terminated by 0
+static uint32_t ftp_journal_read(const char *path, uint32_t ofs) {
+	UINT br = 0;
+	if (FTP_F_OPEN(&ftp_journal.file, path, FA_READ) == FR_OK) {
+		if (FTP_F_LSEEK(&ftp_journal.file, ofs) == FR_OK) {
+			FTP_DCACHE_INVALIDATE(ftp_journal_sector, sizeof(ftp_journal_sector));
+			if (FTP_F_READ(&ftp_journal.file, ftp_journal_sector, FTP_JOURNAL_SECTOR, &br) != FR_OK) {
+				br = 0;
+			}
+			FTP_DCACHE_INVALIDATE(ftp_journal_sector, sizeof(ftp_journal_sector));
+		}
+		FTP_F_CLOSE(&ftp_journal.file);
+	}
+	ftp_journal_sector[br] = 0;
+	return (br);
+}
+
+// return: seq of last record in ftp_journal_sector, 0 if there is none
+static uint32_t ftp_journal_last_seq(uint32_t len) {
+	uint32_t seq = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		if ((i == 0 || ftp_journal_sector[i - 1] == '\n') && isdigit((uint8_t ) ftp_journal_sector[i])) {
+			seq = strtoul(&ftp_journal_sector[i], NULL, 10);
+		}
+	}
+	return (seq);
+}
+
+// Find last record of journal, tail sector of current file is loaded to continue in it
+//
+// records never cross sector boundary, so every sector starts with a record
+static void ftp_journal_load(void) {
+	if (ftp_journal.loaded) {
+		return;
+	}
+	ftp_journal.loaded = true;
+	uint32_t old_first = (ftp_journal_read(FTP_JOURNAL_OLD_PATH, 0) != 0) ? strtoul(ftp_journal_sector, NULL, 10) : 0;
+	ftp_journal.cur_first_seq = (ftp_journal_read(FTP_JOURNAL_PATH, 0) != 0) ? strtoul(ftp_journal_sector, NULL, 10) : 0;
+	ftp_journal.first_seq = old_first ? old_first : ftp_journal.cur_first_seq;
+
+	FILINFO fi;
+	uint32_t size = (FTP_F_STAT(FTP_JOURNAL_PATH, &fi) == FR_OK) ? (uint32_t) fi.fsize : 0;
+	if (size == 0) {
+		ftp_journal.sector_ofs = 0;
+		ftp_journal.sector_len = 0;
+		if (FTP_F_STAT(FTP_JOURNAL_OLD_PATH, &fi) == FR_OK && fi.fsize != 0) {
+			uint32_t len = ftp_journal_read(FTP_JOURNAL_OLD_PATH, ((uint32_t) fi.fsize - 1) & ~(FTP_JOURNAL_SECTOR - 1));
+			ftp_journal.seq = ftp_journal_last_seq(len);
+		}
+		return;
+	}
+	ftp_journal.sector_ofs = (size - 1) & ~(FTP_JOURNAL_SECTOR - 1);
+	uint32_t len = ftp_journal_read(FTP_JOURNAL_PATH, ftp_journal.sector_ofs);
+	ftp_journal.seq = ftp_journal_last_seq(len);
+	// padding of sector written before it was full is reused
+	while (len > 1 && ftp_journal_sector[len - 1] == '\n' && ftp_journal_sector[len - 2] == '\n') {
+		len--;
+	}
+	ftp_journal.sector_len = len;
+}
+
+// Write tail sector, not used part is padded by empty lines
+static void ftp_journal_write(void) {
+	if (!ftp_journal.dirty) {
+		return;
+	}
+	ftp_journal.dirty = false;
+	memset(ftp_journal_sector + ftp_journal.sector_len, '\n', FTP_JOURNAL_SECTOR - ftp_journal.sector_len);
+	ftp_dcache_clean(ftp_journal_sector, FTP_JOURNAL_SECTOR);
+	UINT bw = 0;
+	FRESULT res = FTP_F_OPEN(&ftp_journal.file, FTP_JOURNAL_PATH, FA_OPEN_ALWAYS | FA_WRITE);
+	if (res == FR_OK) {
+		res = FTP_F_LSEEK(&ftp_journal.file, ftp_journal.sector_ofs);
+		if (res == FR_OK) {
+			res = FTP_F_WRITE(&ftp_journal.file, ftp_journal_sector, FTP_JOURNAL_SECTOR, &bw);
+		}
+		if (FTP_F_CLOSE(&ftp_journal.file) != FR_OK) {
+			res = FR_INT_ERR;
+		}
+	}
+	ftp_stats_lock();
+	if (res == FR_OK && bw == FTP_JOURNAL_SECTOR) {
+		FTP.stats.journal_writes++;
+	} else {
+		FTP.stats.journal_errors++;
+	}
+	ftp_stats_unlock();
+}
+
+// Continue in next sector, current file becomes the old one when it is full
+static void ftp_journal_next_sector(void) {
+	ftp_journal_write();
+	ftp_journal.sector_ofs += FTP_JOURNAL_SECTOR;
+	ftp_journal.sector_len = 0;
+	if (ftp_journal.sector_ofs < FTP_JOURNAL_MAX_SIZE / 2) {
+		return;
+	}
+	ftp_journal.generation++;
+	ftp_journal.sector_ofs = 0;
+	FRESULT res = FTP_F_UNLINK(FTP_JOURNAL_OLD_PATH);
+	if ((res == FR_OK || res == FR_NO_FILE) && FTP_F_RENAME(FTP_JOURNAL_PATH, FTP_JOURNAL_OLD_PATH) == FR_OK) {
+		ftp_journal.first_seq = ftp_journal.cur_first_seq;
+	} else {
+		// history is lost, but journal stays bounded
+		FTP.stats.journal_errors++;
+		FTP_F_UNLINK(FTP_JOURNAL_PATH);
+		ftp_journal.first_seq = 0;
+	}
+	ftp_journal.cur_first_seq = 0;
+}
+
+// Append record to tail sector, must be called with ftp_journal_lock()
+static void ftp_journal_add(char change, uint32_t seq, const char *path, uint64_t size) {
+	size_t path_len = strlen(path);
+	if (path_len >= FTP_CWD_SIZE) {
+		return;
+	}
+	if (FTP_JOURNAL_SECTOR - ftp_journal.sector_len < FTP_JOURNAL_LINE_FIXED + path_len) {
+		ftp_journal_next_sector();
+	}
+	if (ftp_journal.cur_first_seq == 0) {
+		ftp_journal.cur_first_seq = seq;
+	}
+	if (ftp_journal.first_seq == 0) {
+		ftp_journal.first_seq = seq;
+	}
+	char size_str[FTP_U64_STRING_SIZE];
+	uint32_t free_bytes = FTP_JOURNAL_SECTOR - ftp_journal.sector_len;
+	int len = snprintf(ftp_journal_sector + ftp_journal.sector_len, free_bytes, "%lu %c %s %s\n", (unsigned long) seq, change, u64_to_str(size_str, size), path);
+	if (len > 0 && (uint32_t) len < free_bytes) {
+		ftp_journal.sector_len += len;
+	}
+	if (!ftp_journal.dirty) {
+		ftp_journal.dirty = true;
+		ftp_journal.dirty_ms = FTP_TIME_MS();
+	}
+	ftp_stats_lock();
+	FTP.stats.journal_records++;
+	ftp_stats_unlock();
+}
+
+// Write records which are waiting for FTP_JOURNAL_FLUSH_MS or longer
+static void ftp_journal_tick(void) {
+	ftp_journal_lock();
+	if (ftp_journal.dirty && FTP_TIME_MS() - ftp_journal.dirty_ms >= FTP_JOURNAL_FLUSH_MS) {
+		ftp_journal_write();
+	}
+	ftp_journal_unlock();
+}
+#else
+#define ftp_journal_tick()		do {} while(0)
+#endif
+
+#if FTP_SITE_WATCH == 1
+// Watched path and queue of events in transfer buffer of watching session
+//
+// transfer buffer layout: event queue | reply line | watched path
+#define FTP_WATCH_PATH_OFS			(FTP_BUF_SIZE - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_WATCH_LINE_MAX			(FTP_CWD_SIZE + 32) // change letter, size and path
+#define FTP_WATCH_LINE_OFS			(FTP_WATCH_PATH_OFS - FTP_ALIGN8(FTP_WATCH_LINE_MAX))
+#define FTP_WATCH_QUEUE_LEN			(FTP_WATCH_LINE_OFS / sizeof(ftp_watch_event_t))
+#define FTP_WATCH_QUEUE(n)			((ftp_watch_event_t*) ftp_links[n].ftp_data.ftp_buff)
+FTP_STATIC_ASSERT(FTP_WATCH_QUEUE_LEN >= 1 && FTP_WATCH_QUEUE_LEN <= 0xFFFF, "FTP_BUF_SIZE is too small for SITE WATCH");
+
+// Queue change to every session watching path or its parent, must be called with ftp_stats_lock()
+static void ftp_watch_post(char change, const char *path, uint64_t size) {
+	if (strlen(path) >= FTP_CWD_SIZE) {
+		return;
+	}
+	for (uint8_t i = 0; i < FTP_NBR_CLIENTS; i++) {
+		ftp_watch_t *w = &ftp_watches[i];
+		if (!w->active) {
+			continue;
+		}
+		const char *watched = ftp_links[i].ftp_data.ftp_buff + FTP_WATCH_PATH_OFS;
+		size_t len = strlen(watched);
+		if (strncmp(path, watched, len) || (path[len] != 0 && path[len] != '/')) {
+			continue;
+		}
+		if (w->count == FTP_WATCH_QUEUE_LEN) {
+			w->lost++;
+			FTP.stats.watch_events_lost++;
+			continue;
+		}
+		ftp_watch_event_t *e = &FTP_WATCH_QUEUE(i)[(w->head + w->count) % FTP_WATCH_QUEUE_LEN];
+		e->size = size;
+		e->change = change;
+		strcpy(e->path, path);
+		w->count++;
+	}
+}
+#endif
+
+// Commands look up extra details of change only when somebody records it
+static bool ftp_changes_recorded(void) {
+#if FTP_JOURNAL == 1
+	return (true);
+#elif FTP_SITE_WATCH == 1
+	bool watched = false;
+	ftp_stats_lock();
+	for (uint8_t i = 0; i < FTP_NBR_CLIENTS; i++) {
+		watched |= ftp_watches[i].active;
+	}
+	ftp_stats_unlock();
+	return (watched);
+#else
+	return (false);
+#endif
+}
+
+// Record change done by FTP command or reported by application
+//
+// new_path is used only by FTP_CHANGE_RENAMED
+static void ftp_change(ftp_change_t change, const char *path, const char *new_path, uint64_t size) {
+#if FTP_JOURNAL == 0 && FTP_SITE_WATCH == 0
+	// nobody records changes, only caches are invalidated
+	(void) change;
+	(void) path;
+	(void) size;
+#endif
+	ftp_cache_invalidate(path);
+	if (new_path != NULL) {
+		ftp_cache_invalidate(new_path);
+	}
+#if FTP_JOURNAL == 1
+	ftp_journal_lock();
+	ftp_journal_load();
+	uint32_t seq = ++ftp_journal.seq;
+	ftp_journal_add(change, seq, path, size);
+	if (change == FTP_CHANGE_RENAMED && new_path != NULL) {
+		ftp_journal_add('N', seq, new_path, size);
+	}
+	ftp_journal_unlock();
+#endif
+#if FTP_SITE_WATCH == 1
+	ftp_stats_lock();
+	ftp_watch_post(change, path, size);
+	if (change == FTP_CHANGE_RENAMED && new_path != NULL) {
+		ftp_watch_post('N', new_path, size);
+	}
+	ftp_stats_unlock();
+#endif
+}
+
+// =========================================================
+//
+//                  Functions on files
+//
+// =========================================================
+
+static void path_up_a_level(char *path) {
+	// is there a dash in the string?
+	if (strchr(path, '/')) {
+		// get position
+		uint32_t pos = strlen(path) - 1;
+
+		// go up a folder
+		while (path[pos] != '/') {
+			// clear character
+			path[pos] = 0;
+
+			// update position
+			pos = strlen(path) - 1;
+		}
+
+		// remove the dash on which the wile loop exits, but only
+		// when we are not root
+		if (strlen(path) > 1)
+			path[pos] = 0;
+	}
+}
+
+// Go back to working directory after command on file in path built by path_build
+//
+// relative name was appended to working directory of cwd_len characters, so it is cut off,
+// absolute name replaced working directory, then parent of the file is taken like path_up_a_level
+static void path_leave(char *path, size_t cwd_len, const char *name) {
+	if (name[0] != '/' && strlen(path) > cwd_len) {
+		path[cwd_len] = 0;
+	} else {
+		path_up_a_level(path);
+	}
+}
+
+// Make complete path/name from cwdName and parameters
+//
+// 3 possible cases:
+//   parameters can be absolute path, relative path or only the name
+//
+// parameters:
+//   fullName : where to store the path/name
+//
+// return:
+//   true, if done
+
+static uint8_t path_build(char *current_path, char *ftp_param) {
+	size_t param_len = strlen(ftp_param);
+
+	// Should we go to the root directory or is the parameter buffer empty?
+	if (!strcmp(ftp_param, "/") || param_len == 0) {
+		// go to root directory
+		strncpy(current_path, "/", FTP_CWD_SIZE);
+	}
+	// should we go up a directory?
+	else if (strcmp(ftp_param, "..") == 0) {
+		// remove characters until '/' is found
+		path_up_a_level(current_path);
+	}
+	// The incoming parameter doesn't contain a slash? this means that
+	// the parameter is only the folder name and it should be appended
+	else if (ftp_param[0] != '/') {
+		size_t path_len = strlen(current_path);
+		bool add_slash = (path_len == 0 || current_path[path_len - 1] != '/');
+
+		// does the string fit? otherwise leave path untouched
+		if (path_len + add_slash + param_len >= FTP_CWD_SIZE)
+			return (0);
+
+		// should we concatinate '/'?
+		if (add_slash)
+			current_path[path_len++] = '/';
+
+		// concatinate parameter to string
+		memcpy(current_path + path_len, ftp_param, param_len + 1);
+	}
+	// The incoming parameter starts with a slash. This means that
+	// the parameter is the whole path.
+	else {
+		if (param_len >= FTP_CWD_SIZE)
+			return (0);
+		memcpy(current_path, ftp_param, param_len + 1);
+	}
+
+	// If the string is longer than 1 character and ends with '/', remove it
+	uint16_t strl = strlen(current_path) - 1;
+	if (current_path[strl] == '/' && strl > 1)
+		current_path[strl] = 0;
+
+	return (1);
+}
+
+// =========================================================
+//
+//                Functions for ASCII transfer
+//
+// =========================================================
+
+// Convert LF to CRLF for sending in ASCII mode, LF which is already preceded by CR is left untouched
+//
+// dst may overlap src if dst + 2 * len <= src + len, output is at most 2 * len
+//
+// return:
+//    length of converted data
+
+static uint32_t ascii_lf_to_crlf(ftp_data_t *ftp, char *dst, const char *src, uint32_t len) {
+	const char *end = src + len;
+	char *out = dst;
+	char last = ftp->ascii_last;
+	while (src < end) {
+		const char *lf = ftp_scan2(src, end, '\n', '\n');
+		uint32_t run = lf - src;
+		if (run) {
+			memmove(out, src, run);
+			out += run;
+			last = lf[-1];
+		}
+		if (lf == end) {
+			break;
+		}
+		if (last != '\r') {
+			*out++ = '\r';
+		}
+		*out++ = '\n';
+		last = '\n';
+		src = lf + 1;
+	}
+	ftp->ascii_last = last;
+	return (out - dst);
+}
+
+// Convert CRLF to LF in place for receiving in ASCII mode
+//
+// CR at the end of buffer is held back in ascii_cr_pending,
+// caller has to emit it if next chunk does not start with LF
+//
+// return:
+//    length of converted data
+
+static uint32_t ascii_crlf_to_lf(ftp_data_t *ftp, char *buf, uint32_t len) {
+	const char *src = buf;
+	const char *end = buf + len;
+	char *out = buf;
+	while (src < end) {
+		const char *cr = ftp_scan2(src, end, '\r', '\r');
+		uint32_t run = cr - src;
+		if (run) {
+			if (out != src) {
+				memmove(out, src, run);
+			}
+			out += run;
+		}
+		if (cr == end) {
+			break;
+		}
+		if (cr + 1 == end) {
+			ftp->ascii_cr_pending = true;
+		} else if (cr[1] != '\n') {
+			*out++ = '\r';
+		}
+		src = cr + 1;
+	}
+	return (out - buf);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//			FTP commands
+//
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// print working directory
+static ftp_result_t ftp_cmd_pwd(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	} else {
+		return (ftp_send(ftp, "257 \"%s\" is your current directory\r\n", ftp->path));
+	}
+}
+
+// change working directory
+static ftp_result_t ftp_cmd_cwd(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No directory name\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (strcmp(ftp->path, "/") != 0 && ftp_stat(ftp->path, &ftp->finfo) != FR_OK) {
+		return (ftp_send(ftp, "550 Failed to change directory to %s\r\n", ftp->path));
+	}
+
+	return (ftp_send(ftp, "250 Directory successfully changed.\r\n"));
+}
+
+// Change the remote machine working directory to the parent of the current remote machine working directory.
+static ftp_result_t ftp_cmd_cdup(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	strncpy(ftp->path, "/", FTP_CWD_SIZE);
+	return (ftp_send(ftp, "250 Directory successfully changed to root.\r\n"));
+}
+
+static ftp_result_t ftp_cmd_mode(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (!strcmp(ftp->parameters, "S")) {
+		return (ftp_send(ftp, "200 S Ok\r\n"));
+	} else {
+		return (ftp_send(ftp, "504 Only S(tream) is suported\r\n"));
+	}
+}
+
+static ftp_result_t ftp_cmd_stru(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (!strcmp(ftp->parameters, "F")) {
+		return (ftp_send(ftp, "200 F Ok\r\n"));
+	} else {
+		return (ftp_send(ftp, "504 Only F(ile) is suported\r\n"));
+	}
+}
+
+static ftp_result_t ftp_cmd_type(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (!strcmp(ftp->parameters, "A") || !strcmp(ftp->parameters, "A N")) {
+		ftp->transfer_type = FTP_TYPE_ASCII;
+		return (ftp_send(ftp, "200 TYPE is now ASCII\r\n"));
+	} else if (!strcmp(ftp->parameters, "I") || !strcmp(ftp->parameters, "L 8")) {
+		ftp->transfer_type = FTP_TYPE_BINARY;
+		return (ftp_send(ftp, "200 TYPE is now 8-bit binary\r\n"));
+	} else {
+		return (ftp_send(ftp, "504 Unknow TYPE\r\n"));
+	}
+}
+
+static ftp_result_t ftp_cmd_pasv(ftp_data_t *ftp) {
+	// are we not yet logged in?
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+#if FTP_USE_PASSIVE_MODE == 1
+	// set data port
+	ftp->data_port = FTP_DATA_PORT + ftp->data_port_incremented + (ftp->ftp_con_num * PORT_INCREMENT_OFFSET);
+
+	// open connection ok?
+	if (pasv_con_open(ftp) == FTP_RES_OK) {
+		// close data connection, just to be sure
+		if (data_con_close(ftp) != FTP_RES_OK) {
+			return (pasv_con_close(ftp));
+		}
+		// feedback
+		DEBUG_PRINT(ftp, "Data port set to %u\r\n", ftp->data_port);
+		// set state
+		ftp->data_conn_mode = DCM_PASSIVE;
+		// reply that we are entering passive mode
+		return (ftp_send(ftp, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).\r\n", ftp->ipserver.addr & 0xFF, (ftp->ipserver.addr >> 8) & 0xFF,
+				(ftp->ipserver.addr >> 16) & 0xFF, (ftp->ipserver.addr >> 24) & 0xFF, ftp->data_port >> 8, ftp->data_port & 255));
+	} else {
+		// reset data conn mode
+		ftp->data_conn_mode = DCM_NOT_SET;
+		// send error
+		ftp_send(ftp, "425 Can't set connection management to passive\r\n");
+		return (FTP_RES_ERROR);
+	}
+#else
+	// reset data conn mode
+	ftp->dataConnMode = DCM_NOT_SET;
+	// send error
+	return (ftp_send(ftp, "421 Passive mode not available\r\n"));
+#endif
+}
+
+// Parse PORT parameters h1,h2,h3,h4,p1,p2, every field must be a number 0..255
+//
+// return:
+//    true, if parameters are valid
+static bool port_parse(const char *str, uint8_t *ip, uint16_t *port) {
+	uint8_t field[6];
+	for (uint8_t i = 0; i < 6; i++) {
+		uint16_t value = 0;
+		uint8_t digits = 0;
+		while (*str == ' ') {
+			str++;
+		}
+		while (isdigit((uint8_t ) *str) && digits < 4) {
+			value = value * 10 + (*str++ - '0');
+			digits++;
+		}
+		if (digits == 0 || value > 255) {
+			return (false);
+		}
+		field[i] = value;
+		if (i < 5 && *str++ != ',') {
+			return (false);
+		}
+	}
+	if (*str != 0) {
+		return (false);
+	}
+	memcpy(ip, field, 4);
+	*port = (field[4] << 8) | field[5];
+	return (true);
+}
+
+static ftp_result_t ftp_cmd_port(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	uint8_t ip[4];
+
+	if (data_con_close(ftp) != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		ftp->data_conn_mode = DCM_NOT_SET;
+		return (ftp_send(ftp, "501 no parameters given\r\n"));
+	}
+
+	if (!port_parse(ftp->parameters, ip, &ftp->data_port)) {
+		ftp->data_conn_mode = DCM_NOT_SET;
+		return (ftp_send(ftp, "501 Can't interpret parameters\r\n"));
+	}
+
+	DEBUG_PRINT(ftp, "Data IP set to %u:%u:%u:%u\r\n", ip[0], ip[1], ip[2], ip[3]);
+	DEBUG_PRINT(ftp, "Data port set to %u\r\n", ftp->data_port);
+
+	IP4_ADDR(&ftp->ipclient, ip[0], ip[1], ip[2], ip[3]);
+	ftp->data_conn_mode = DCM_ACTIVE;
+
+	return (ftp_send(ftp, "200 PORT command successful\r\n"));
+}
+
+static ftp_result_t ftp_cmd_list(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	DIR dir;
+	if (FTP_F_OPENDIR(&dir, ftp->path) != FR_OK) {
+		return (ftp_send(ftp, "550 Can't open directory %s\r\n", ftp->parameters));
+	}
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+	}
+	if (ftp_send(ftp, "150 Accepted data connection\r\n") != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+
+	ftp_result_t reply = FTP_RES_OK;
+	while (1) {
+		if (FTP_F_READDIR(&dir, &ftp->finfo) != FR_OK) {
+			reply = ftp_send(ftp, "451 Can't read directory\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		if (ftp->finfo.fname[0] == 0) {
+			break;
+		}
+		if (ftp->finfo.fname[0] == '.') {
+			continue;
+		}
+		if (strcmp(ftp->command, "LIST")) {
+			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "%s\r\n", ftp->finfo.fname);
+		} else if (ftp->finfo.fattrib & AM_DIR) {
+			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "+/,\t%s\r\n", ftp->finfo.fname);
+		} else {
+			char size_str[FTP_U64_STRING_SIZE];
+			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "+r,s%s,\t%s\r\n", u64_to_str(size_str, ftp->finfo.fsize), ftp->finfo.fname);
+		}
+		if (ftp_data_write(ftp, ftp->ftp_buff, strlen(ftp->ftp_buff)) != FTP_RES_OK) {
+			reply = ftp_send(ftp, "426 Error during directory listing\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+	}
+
+	FTP_F_CLOSEDIR(&dir);
+	if (data_con_close(ftp) != FTP_RES_OK || reply != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+	if (ftp->transfer_failed) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "226 Directory send OK.\r\n"));
+}
+
+static ftp_result_t ftp_cmd_mlsd(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	DIR dir;
+	uint16_t nm = 0;
+
+	if (FTP_F_OPENDIR(&dir, ftp->path) != FR_OK) {
+		return (ftp_send(ftp, "550 Can't open directory %s\r\n", ftp->parameters));
+	}
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+	}
+	if (ftp_send(ftp, "150 Accepted data connection\r\n") != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+
+	ftp_result_t reply = FTP_RES_OK;
+	while (1) {
+		if (FTP_F_READDIR(&dir, &ftp->finfo) != FR_OK) {
+			reply = ftp_send(ftp, "451 Can't read directory\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		if (ftp->finfo.fname[0] == 0) {
+			break;
+		}
+		if (ftp->finfo.fname[0] == '.') {
+			continue;
+		}
+		char size_str[FTP_U64_STRING_SIZE];
+		u64_to_str(size_str, ftp->finfo.fsize);
+		if (ftp->finfo.fdate != 0) {
+			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "Type=%s;Size=%s;Modify=%s; %s\r\n", ftp->finfo.fattrib & AM_DIR ? "dir" : "file", size_str,
+					data_time_to_str(ftp->date_str, ftp->finfo.fdate, ftp->finfo.ftime), ftp->finfo.fname);
+		} else {
+			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "Type=%s;Size=%s; %s\r\n", ftp->finfo.fattrib & AM_DIR ? "dir" : "file", size_str, ftp->finfo.fname);
+		}
+		if (ftp_data_write(ftp, ftp->ftp_buff, strlen(ftp->ftp_buff)) != FTP_RES_OK) {
+			reply = ftp_send(ftp, "426 Error during directory listing\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		nm++;
+	}
+
+	FTP_F_CLOSEDIR(&dir);
+	if (data_con_close(ftp) != FTP_RES_OK || reply != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+	if (ftp->transfer_failed) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "226 Options: -a -l, %d matches total\r\n", nm));
+}
+
+static ftp_result_t ftp_cmd_dele(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 file %s not found\r\n", ftp->parameters));
+	}
+
+	if (!ftp_lock_tree(ftp, 0, ftp->path)) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 %s is in use\r\n", ftp->parameters));
+	}
+	ftp_path_changed(ftp->path);
+	FRESULT file_err = FTP_F_UNLINK(ftp->path);
+	ftp_unlock(ftp);
+	if (file_err != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 Can't delete %s\r\n", ftp->parameters));
+	}
+	ftp_change(FTP_CHANGE_DELETED, ftp->path, NULL, ftp->finfo.fsize);
+
+	path_up_a_level(ftp->path);
+	return (ftp_send(ftp, "250 Deleted %s\r\n", ftp->parameters));
+}
+
+static ftp_result_t ftp_cmd_noop(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "200 Zzz...\r\n"));
+}
+
+// transfer progress window for stall detection
+typedef struct {
+	uint32_t start_ms;
+	uint64_t start_bytes;
+} ftp_stall_t;
+
+static void ftp_stall_start(ftp_data_t *ftp, ftp_stall_t *stall) {
+	stall->start_ms = FTP_TIME_MS();
+	stall->start_bytes = ftp->bytes_transfered;
+}
+
+// return: true, if less than FTP_XFER_MIN_BPS was moved in last window
+static bool ftp_stall_check(ftp_data_t *ftp, ftp_stall_t *stall) {
+	uint32_t elapsed_ms = FTP_TIME_MS() - stall->start_ms;
+	if (elapsed_ms < FTP_XFER_STALL_WINDOW_MS) {
+		return (false);
+	}
+	uint64_t moved = ftp->bytes_transfered - stall->start_bytes;
+	if (moved * 1000 < (uint64_t) FTP_XFER_MIN_BPS * elapsed_ms) {
+		DEBUG_PRINT(ftp, "Transfer stalled\r\n");
+		return (true);
+	}
+	ftp_stall_start(ftp, stall);
+	return (false);
+}
+
+static ftp_result_t ftp_cmd_retr(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (ftp_stat(ftp->path, &ftp->finfo) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 File %s not found\r\n", ftp->parameters));
+	}
+	if (!ftp_lock(ftp, ftp->path, FTP_LOCK_READ)) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 %s is being written\r\n", ftp->parameters));
+	}
+	if (ftp_open_read(ftp->path, &ftp->file) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 Can't open %s\r\n", ftp->parameters));
+	}
+	uint64_t file_size = FTP_F_SIZE(&ftp->file);
+	if (ftp->restart_offset > file_size || FTP_F_LSEEK(&ftp->file, ftp->restart_offset) != FR_OK) {
+		FTP_F_CLOSE(&ftp->file);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "554 Invalid restart position\r\n"));
+	}
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		FTP_F_CLOSE(&ftp->file);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+	}
+	DEBUG_PRINT(ftp, "Sending %s\r\n", ftp->parameters);
+	char size_str[FTP_U64_STRING_SIZE];
+	if (ftp_send(ftp, "150 Connected to port %u, %s bytes to download\r\n", ftp->data_port, u64_to_str(size_str, file_size - ftp->restart_offset))
+			!= FTP_RES_OK) {
+		FTP_F_CLOSE(&ftp->file);
+		path_up_a_level(ftp->path);
+		data_con_close(ftp);
+		return (FTP_RES_ERROR);
+	}
+
+	// in ASCII mode data is read to upper half of buffer and expanded to its beginning
+	bool ascii = (ftp->transfer_type == FTP_TYPE_ASCII);
+	uint32_t read_size = (ascii && FTP_DATA_WRITE_SIZE > FTP_BUF_SIZE / 2) ? FTP_BUF_SIZE / 2 : FTP_DATA_WRITE_SIZE;
+	char *read_buff = ascii ? ftp->ftp_buff + FTP_BUF_SIZE / 2 : ftp->ftp_buff;
+	uint32_t bytes_read = 1;
+	ftp->ascii_last = 0;
+	ftp_reader_t reader = { .pos = ftp->restart_offset, .file_pos = ftp->restart_offset };
+	ftp_shared_attach(ftp, &reader);
+	ftp_result_t reply = FTP_RES_OK;
+	ftp_stall_t stall;
+	ftp_stall_start(ftp, &stall);
+	while (1) {
+		if (ftp_should_stop(ftp) || ftp_stall_check(ftp, &stall)) {
+			reply = ftp_send(ftp, "426 Transfer aborted\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		FRESULT file_err = ftp_reader_read(ftp, &reader, read_buff, read_size, &bytes_read);
+		if (file_err != FR_OK) {
+			reply = ftp_send(ftp, "451 Communication error during transfer\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		if (bytes_read == 0) {
+			break;
+		}
+		uint32_t bytes_send = bytes_read;
+		if (ascii) {
+			bytes_send = ascii_lf_to_crlf(ftp, ftp->ftp_buff, read_buff, bytes_read);
+		}
+		if (ftp_data_write(ftp, ftp->ftp_buff, bytes_send) != FTP_RES_OK) {
+			reply = ftp_send(ftp, "426 Error during file transfer\r\n");
+			ftp->transfer_failed = true;
+			break;
+		}
+		ftp->bytes_transfered += bytes_read;
+	}
+	ftp_shared_detach(&reader);
+	ftp_stats_lock();
+	FTP.stats.retr_storage_bytes += reader.storage_bytes;
+	FTP.stats.retr_shared_bytes += reader.shared_bytes;
+	ftp_stats_unlock();
+
+	DEBUG_PRINT(ftp, "Sent %s bytes\r\n", u64_to_str(size_str, ftp->bytes_transfered));
+	FTP_F_CLOSE(&ftp->file);
+	path_up_a_level(ftp->path);
+	if (data_con_close(ftp) != FTP_RES_OK || reply != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+	if (ftp->transfer_failed) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "226 File successfully transferred\r\n"));
+}
+
+// Write received data to file through transfer buffer, so FATFS gets full buffer sized writes
+static FRESULT ftp_stor_write(ftp_data_t *ftp, const char *data, uint32_t len, uint32_t *buff_free_bytes) {
+	uint32_t bytes_written = 0;
+	FRESULT file_err = FR_OK;
+	if (len > FTP_BUF_SIZE) {
+		// flush buffered data first to keep order, then write directly
+		uint32_t used_bytes = FTP_BUF_SIZE - *buff_free_bytes;
+		if (used_bytes) {
+			ftp_dcache_clean(ftp->ftp_buff, used_bytes);
+			file_err = FTP_F_WRITE(&ftp->file, ftp->ftp_buff, used_bytes, (UINT* ) &bytes_written);
+			if (file_err != FR_OK) {
+				return (file_err);
+			}
+			if (used_bytes != bytes_written) {
+				return (FR_INT_ERR);
+			}
+			*buff_free_bytes = FTP_BUF_SIZE;
+		}
+		ftp_dcache_clean(data, len);
+		file_err = FTP_F_WRITE(&ftp->file, data, len, (UINT* ) &bytes_written);
+		if (file_err == FR_OK && len != bytes_written) {
+			file_err = FR_INT_ERR;
+		}
+	} else if (*buff_free_bytes > len) {
+		uint32_t used_bytes = FTP_BUF_SIZE - *buff_free_bytes;
+		memcpy(ftp->ftp_buff + used_bytes, data, len);
+		*buff_free_bytes -= len;
+	} else {
+		uint32_t used_bytes = FTP_BUF_SIZE - *buff_free_bytes;
+		memcpy(ftp->ftp_buff + used_bytes, data, *buff_free_bytes);
+		ftp_dcache_clean(ftp->ftp_buff, FTP_BUF_SIZE);
+		file_err = FTP_F_WRITE(&ftp->file, ftp->ftp_buff, FTP_BUF_SIZE, (UINT* ) &bytes_written);
+		if (file_err != FR_OK) {
+			return (file_err);
+		}
+		if (FTP_BUF_SIZE != bytes_written) {
+			return (FR_INT_ERR);
+		}
+		uint32_t rest_bytes_to_save = len - *buff_free_bytes;
+		if (rest_bytes_to_save) {
+			memcpy(ftp->ftp_buff, data + *buff_free_bytes, rest_bytes_to_save);
+		}
+		*buff_free_bytes = FTP_BUF_SIZE - rest_bytes_to_save;
+	}
+	return (file_err);
+}
+
+// Store one received chunk, in ASCII mode CRLF is converted to LF in place
+static FRESULT ftp_stor_data(ftp_data_t *ftp, char *data, uint32_t len, uint32_t *buff_free_bytes) {
+	if (ftp->transfer_type == FTP_TYPE_ASCII && len) {
+		if (ftp->ascii_cr_pending) {
+			ftp->ascii_cr_pending = false;
+			if (data[0] != '\n') {
+				FRESULT file_err = ftp_stor_write(ftp, "\r", 1, buff_free_bytes);
+				if (file_err != FR_OK) {
+					return (file_err);
+				}
+			}
+		}
+		len = ascii_crlf_to_lf(ftp, data, len);
+	}
+	return (ftp_stor_write(ftp, data, len, buff_free_bytes));
+}
+
+// Close file written by STOR and record the change
+static void ftp_stor_close(ftp_data_t *ftp, bool existed) {
+	uint64_t size = FTP_F_SIZE(&ftp->file);
+	FTP_F_CLOSE(&ftp->file);
+	// other session could cache the file while it was written
+	ftp_path_changed(ftp->path);
+	ftp_change(existed ? FTP_CHANGE_MODIFIED : FTP_CHANGE_CREATED, ftp->path, NULL, size);
+}
+
+static ftp_result_t ftp_cmd_stor(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	size_t cwd_len = strlen(ftp->path);
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (!ftp_lock(ftp, ftp->path, FTP_LOCK_WRITE)) {
+		path_leave(ftp->path, cwd_len, ftp->parameters);
+		return (ftp_send(ftp, "450 %s is in use\r\n", ftp->parameters));
+	}
+	bool existed = (ftp_changes_recorded() && ftp_stat(ftp->path, &ftp->finfo) == FR_OK);
+	ftp_path_changed(ftp->path);
+	if (ftp_fs_open(ftp->path, &ftp->file, ftp->restart_offset ? (FA_OPEN_ALWAYS | FA_WRITE) : (FA_CREATE_ALWAYS | FA_WRITE)) != FR_OK) {
+		path_leave(ftp->path, cwd_len, ftp->parameters);
+		return (ftp_send(ftp, "450 Can't open/create %s\r\n", ftp->parameters));
+	}
+	if (ftp->restart_offset > FTP_F_SIZE(&ftp->file) || FTP_F_LSEEK(&ftp->file, ftp->restart_offset) != FR_OK) {
+		ftp_stor_close(ftp, existed);
+		path_leave(ftp->path, cwd_len, ftp->parameters);
+		return (ftp_send(ftp, "554 Invalid restart position\r\n"));
+	}
+	if (data_con_open(ftp) != 0) {
+		ftp_stor_close(ftp, existed);
+		path_leave(ftp->path, cwd_len, ftp->parameters);
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+	}
+	DEBUG_PRINT(ftp, "Receiving %s\r\n", ftp->parameters);
+	if (ftp_send(ftp, "150 Connected to port %u\r\n", ftp->data_port) != FTP_RES_OK) {
+		ftp_stor_close(ftp, existed);
+		path_leave(ftp->path, cwd_len, ftp->parameters);
+		data_con_close(ftp);
+		return (FTP_RES_ERROR);
+	}
+
+	uint32_t buff_free_bytes = FTP_BUF_SIZE;
+	ftp->ascii_cr_pending = false;
+	ftp_stall_t stall;
+	ftp_stall_start(ftp, &stall);
+	while (1) {
+		struct pbuf *rcvbuf = NULL;
+		int8_t con_err = FTP_NETCONN_RECV_TCP_PBUF(ftp->dataconn, &rcvbuf);
+		if (con_err == ERR_TIMEOUT && !ftp_should_stop(ftp) && !ftp_stall_check(ftp, &stall)) {
+			// slow but alive, keep waiting
+			continue;
+		}
+		if (con_err == ERR_OK) {
+			if (ftp_stall_check(ftp, &stall)) {
+				FTP_PBUF_FREE(rcvbuf);
+				con_err = ERR_TIMEOUT;
+			}
+		}
+		if (con_err == ERR_OK) {
+			FRESULT file_err = FR_OK;
+			for (struct pbuf *q = rcvbuf; q != NULL && file_err == FR_OK; q = q->next) {
+				ftp->bytes_transfered += q->len;
+				file_err = ftp_stor_data(ftp, (char*) q->payload, q->len, &buff_free_bytes);
+			}
+			FTP_PBUF_FREE(rcvbuf);
+			if (file_err != 0) {
+				if (ftp_send(ftp, "451 Communication error during transfer\r\n") != FTP_RES_OK) {
+					ftp_stor_close(ftp, existed);
+					path_leave(ftp->path, cwd_len, ftp->parameters);
+					data_con_close(ftp);
+					return (FTP_RES_ERROR);
+				}
+				ftp->transfer_failed = true;
+				break;
+			}
+		} else {
+			FRESULT file_err = FR_OK;
+			if (ftp->ascii_cr_pending) {
+				file_err = ftp_stor_write(ftp, "\r", 1, &buff_free_bytes);
+			}
+			if (file_err == FR_OK && buff_free_bytes != FTP_BUF_SIZE) {
+				uint32_t rest_bytes = FTP_BUF_SIZE - buff_free_bytes;
+				uint32_t bytes_written = 0;
+				ftp_dcache_clean(ftp->ftp_buff, rest_bytes);
+				file_err = FTP_F_WRITE(&ftp->file, ftp->ftp_buff, rest_bytes, (UINT* ) &bytes_written);
+				if (rest_bytes != bytes_written) {
+					file_err = FR_INT_ERR;
+				}
+			}
+			if (file_err != 0) {
+				if (ftp_send(ftp, "451 Communication error during transfer\r\n") != FTP_RES_OK) {
+					ftp_stor_close(ftp, existed);
+					path_leave(ftp->path, cwd_len, ftp->parameters);
+					data_con_close(ftp);
+					return (FTP_RES_ERROR);
+				}
+				ftp->transfer_failed = true;
+			}
+			if (con_err != ERR_CLSD) {
+				if (ftp_send(ftp, "426 Error during file transfer: %d\r\n", con_err) != FTP_RES_OK) {
+					ftp_stor_close(ftp, existed);
+					path_leave(ftp->path, cwd_len, ftp->parameters);
+					data_con_close(ftp);
+					return (FTP_RES_ERROR);
+				}
+				ftp->transfer_failed = true;
+			}
+			break;
+		}
+	}
+
+	DEBUG_PRINT(ftp, "Received %s bytes\r\n", u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, ftp->bytes_transfered));
+	ftp_stor_close(ftp, existed);
+	path_leave(ftp->path, cwd_len, ftp->parameters);
+
+	if (data_con_close(ftp) != FTP_RES_OK) {
+		return (FTP_RES_ERROR);
+	}
+	if (ftp->transfer_failed) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "226 File successfully transferred\r\n"));
+}
+
+// Recursive delete and create
+//
+// transfer buffer layout: DIR stack | path of walk | working directory
+#define FTP_TREE_CWD_OFS			(FTP_BUF_SIZE - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_TREE_PATH_OFS			(FTP_TREE_CWD_OFS - FTP_ALIGN8(FTP_CWD_SIZE))
+FTP_STATIC_ASSERT(FTP_TREE_MAX_DEPTH >= 1 && FTP_TREE_MAX_DEPTH <= 127, "FTP_TREE_MAX_DEPTH must be in range 1..127");
+FTP_STATIC_ASSERT(FTP_TREE_PATH_OFS >= FTP_TREE_MAX_DEPTH * sizeof(DIR), "FTP_BUF_SIZE is too small for FTP_TREE_MAX_DEPTH");
+
+typedef struct {
+	uint32_t files;
+	uint32_t dirs;
+	uint32_t failed;
+} ftp_tree_count_t;
+
+// return: true for "." and "..", which FATFS returns with _FS_RPATH and without LFN
+static bool ftp_is_dot_entry(const char *name) {
+	return (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)));
+}
+
+// Delete directory tree in root, explicit stack of FTP_TREE_MAX_DEPTH directories is used
+//
+// entries which can not be deleted (read only, too deep) are counted and kept together with their parents
+// return: false, if root can not be opened or server is stopping
+static bool ftp_rmd_tree(ftp_data_t *ftp, const char *root, ftp_tree_count_t *cnt) {
+	DIR *dirs = (DIR*) ftp->ftp_buff;
+	char *path = ftp->ftp_buff + FTP_TREE_PATH_OFS;
+	uint16_t dir_len[FTP_TREE_MAX_DEPTH];
+	bool kept[FTP_TREE_MAX_DEPTH]; // something below directory was not deleted
+	int8_t depth = 0;
+	size_t root_len = strlen(root);
+
+	strcpy(path, root);
+	dir_len[0] = root_len;
+	kept[0] = false;
+	if (FTP_F_OPENDIR(&dirs[0], path) != FR_OK) {
+		return (false);
+	}
+	while (depth >= 0) {
+		if (ftp_should_stop(ftp)) {
+			while (depth >= 0) {
+				FTP_F_CLOSEDIR(&dirs[depth--]);
+			}
+			return (false);
+		}
+		path[dir_len[depth]] = 0;
+		if (FTP_F_READDIR(&dirs[depth], &ftp->finfo) != FR_OK || ftp->finfo.fname[0] == 0) {
+			FTP_F_CLOSEDIR(&dirs[depth]);
+			if (!kept[depth] && FTP_F_UNLINK(path) == FR_OK) {
+				cnt->dirs++;
+			} else {
+				cnt->failed += !kept[depth];
+				if (depth > 0) {
+					kept[depth - 1] = true;
+				}
+			}
+			depth--;
+			continue;
+		}
+		if (ftp_is_dot_entry(ftp->finfo.fname)) {
+			continue;
+		}
+		uint16_t len = dir_len[depth];
+		if (len + 1 + strlen(ftp->finfo.fname) >= FTP_CWD_SIZE) {
+			cnt->failed++;
+			kept[depth] = true;
+			continue;
+		}
+		path[len++] = '/';
+		strcpy(path + len, ftp->finfo.fname);
+
+		if (ftp->finfo.fattrib & AM_DIR) {
+			// never leave the tree, whatever names FATFS returns
+			bool below_root = !strncmp(path, root, root_len) && path[root_len] == '/' && !strstr(path + root_len, "/../");
+			if (below_root && depth + 1 < FTP_TREE_MAX_DEPTH && FTP_F_OPENDIR(&dirs[depth + 1], path) == FR_OK) {
+				depth++;
+				dir_len[depth] = strlen(path);
+				kept[depth] = false;
+			} else {
+				cnt->failed++;
+				kept[depth] = true;
+			}
+		} else if (FTP_F_UNLINK(path) == FR_OK) {
+			cnt->files++;
+		} else {
+			cnt->failed++;
+			kept[depth] = true;
+		}
+	}
+	return (true);
+}
+
+// Delete directory with everything in it
+//
+// RMDA <dir>, SITE RMDIR [-r] <dir> - one reply with count of deleted files and directories
+static ftp_result_t ftp_cmd_rmda(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
 	}
-	if (ftp_send(ftp, "150 Accepted data connection\r\n") != FTP_RES_OK) {
-		return (FTP_RES_ERROR);
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No directory name\r\n"));
 	}
+	char *cwd = ftp->ftp_buff + FTP_TREE_CWD_OFS;
+	strcpy(cwd, ftp->path);
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (!strcmp(ftp->path, "/") || FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK || !(ftp->finfo.fattrib & AM_DIR)) {
+		strcpy(ftp->path, cwd);
+		return (ftp_send(ftp, "550 Directory \"%s\" not found\r\n", ftp->parameters));
+	}
+	if (!ftp_lock_tree(ftp, 0, ftp->path)) {
+		strcpy(ftp->path, cwd);
+		return (ftp_send(ftp, "450 \"%s\" is in use\r\n", ftp->parameters));
+	}
+	DEBUG_PRINT(ftp, "Deleting tree %s\r\n", ftp->path);
+	ftp_path_changed(ftp->path);
+	ftp_tree_count_t cnt = { 0 };
+	bool walked = ftp_rmd_tree(ftp, ftp->path, &cnt);
+	ftp_unlock(ftp);
+	if (cnt.files || cnt.dirs) {
+		// one change for whole tree
+		ftp_change(FTP_CHANGE_DELETED, ftp->path, NULL, 0);
+	}
+	strcpy(ftp->path, cwd);
 
-	while (FTP_F_READDIR(&dir, &ftp->finfo) == FR_OK) {
-		if (ftp->finfo.fname[0] == 0) {
-			break;
-		}
-		if (ftp->finfo.fname[0] == '.') {
-			continue;
+	if (!walked) {
+		return (ftp_send(ftp, "451 Removing of \"%s\" aborted, %lu files and %lu directories removed\r\n", ftp->parameters, cnt.files, cnt.dirs));
+	}
+	if (cnt.failed) {
+		return (ftp_send(ftp, "550 %lu files and %lu directories removed, %lu entries can't be removed\r\n", cnt.files, cnt.dirs, cnt.failed));
+	}
+	return (ftp_send(ftp, "250 \"%s\" removed, %lu files and %lu directories\r\n", ftp->parameters, cnt.files, cnt.dirs));
+}
+
+// MKD -p <dir> - missing directories of path are created, existing ones are kept
+static ftp_result_t ftp_mkd_parents(ftp_data_t *ftp, char *name) {
+	char *cwd = ftp->ftp_buff + FTP_TREE_CWD_OFS;
+	strcpy(cwd, ftp->path);
+	if (!path_build(ftp->path, name)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	uint32_t created = 0;
+	FRESULT file_err = FR_OK;
+	char *level = ftp->path + 1;
+	while (file_err == FR_OK && *level) {
+		char *slash = strchr(level, '/');
+		if (slash != NULL) {
+			*slash = 0;
 		}
-		if (strcmp(ftp->command, "LIST")) {
-			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "%s\r\n", ftp->finfo.fname);
-		} else if (ftp->finfo.fattrib & AM_DIR) {
-			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "+/,\t%s\r\n", ftp->finfo.fname);
+		if (FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) {
+			file_err = (ftp->finfo.fattrib & AM_DIR) ? FR_OK : FR_EXIST;
 		} else {
-			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "+r,s%ld,\t%s\r\n", ftp->finfo.fsize, ftp->finfo.fname);
+			file_err = ftp_path_reserved(ftp->path, FTP_LOCK_WRITE) ? FR_DENIED : FTP_F_MKDIR(ftp->path);
+			if (file_err == FR_OK) {
+				created++;
+				ftp_change(FTP_CHANGE_CREATED, ftp->path, NULL, 0);
+			}
 		}
-		if (netconn_write(ftp->dataconn, ftp->ftp_buff, strlen(ftp->ftp_buff)) != FTP_RES_OK) {
-			FTP_F_CLOSEDIR(&dir);
-			data_con_close(ftp);
-			return (FTP_RES_ERROR);
+		if (slash == NULL) {
+			break;
 		}
+		*slash = '/';
+		level = slash + 1;
 	}
+	strcpy(ftp->path, cwd);
 
-	FTP_F_CLOSEDIR(&dir);
-	if (data_con_close(ftp) != FTP_RES_OK) {
-		return (FTP_RES_ERROR);
+	if (file_err != FR_OK) {
+		return (ftp_send(ftp, "550 Can't create \"%s\"\r\n", name));
 	}
-	return (ftp_send(ftp, "226 Directory send OK.\r\n"));
+	return (ftp_send(ftp, "257 \"%s\" created, %lu new directories\r\n", name, created));
 }
 
-static ftp_result_t ftp_cmd_mlsd(ftp_data_t *ftp) {
+static ftp_result_t ftp_cmd_mkd(ftp_data_t *ftp) {
 	if (!FTP_IS_LOGGED_IN(ftp)) {
 		return (FTP_RES_OK);
 	}
-	DIR dir;
-	uint16_t nm = 0;
+	if (!strncmp(ftp->parameters, "-p ", 3)) {
+		return (ftp_mkd_parents(ftp, ftp->parameters + 3));
+	}
 
-	if (FTP_F_OPENDIR(&dir, ftp->path) != FR_OK) {
-		return (ftp_send(ftp, "550 Can't open directory %s\r\n", ftp->parameters));
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No directory name\r\n"));
 	}
-	if (data_con_open(ftp) != FTP_RES_OK) {
-		ftp_send(ftp, "425 Can't create connection\r\n");
-		return (FTP_RES_ERROR);
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
 	}
-	if (ftp_send(ftp, "150 Accepted data connection\r\n") != FTP_RES_OK) {
+	if (FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "521 \"%s\" directory already exists\r\n", ftp->parameters));
+	}
+
+	if (ftp_path_reserved(ftp->path, FTP_LOCK_WRITE) || FTP_F_MKDIR(ftp->path) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 Can't create \"%s\"\r\n", ftp->parameters));
+	}
+
+	ftp_change(FTP_CHANGE_CREATED, ftp->path, NULL, 0);
+	DEBUG_PRINT(ftp, "Creating directory %s\r\n", ftp->parameters);
+	path_up_a_level(ftp->path);
+	return (ftp_send(ftp, "257 \"%s\" created\r\n", ftp->parameters));
+}
+
+static ftp_result_t ftp_cmd_rmd(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No directory name\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	DEBUG_PRINT(ftp, "Deleting %s\r\n", ftp->path);
+
+	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 Directory \"%s\" not found\r\n", ftp->parameters));
+	}
+
+	if (!ftp_lock_tree(ftp, 0, ftp->path)) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 \"%s\" is in use\r\n", ftp->parameters));
+	}
+	ftp_path_changed(ftp->path);
+	FRESULT file_err = FTP_F_UNLINK(ftp->path);
+	ftp_unlock(ftp);
+	if (file_err != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "501 Can't delete \"%s\"\r\n", ftp->parameters));
+	}
+	ftp_change(FTP_CHANGE_DELETED, ftp->path, NULL, 0);
+	path_up_a_level(ftp->path);
+	return (ftp_send(ftp, "250 \"%s\" removed\r\n", ftp->parameters));
+}
+
+static ftp_result_t ftp_cmd_rnfr(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	memcpy(ftp->path_rename, ftp->path, FTP_CWD_SIZE);
+	if (!path_build(ftp->path_rename, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (FTP_F_STAT(ftp->path_rename, &ftp->finfo) != FR_OK) {
+		return (ftp_send(ftp, "550 file \"%s\" not found\r\n", ftp->parameters));
+	}
+	DEBUG_PRINT(ftp, "Renaming %s\r\n", ftp->path_rename);
+	return (ftp_send(ftp, "350 RNFR accepted - file exists, ready for destination\r\n"));
+}
+
+static ftp_result_t ftp_cmd_rnto(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (!strlen(ftp->parameters)) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	if (!strlen(ftp->path_rename)) {
+		return (ftp_send(ftp, "503 Need RNFR before RNTO\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+
+	if (FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "553 \"%s\" already exists\r\n", ftp->parameters));
+	}
+
+	if (!ftp_lock_tree(ftp, 0, ftp->path_rename) || !ftp_lock_tree(ftp, 1, ftp->path)) {
+		ftp_unlock(ftp);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 \"%s\" is in use\r\n", ftp->parameters));
+	}
+	DEBUG_PRINT(ftp, "Renaming %s to %s\r\n", ftp->path_rename, ftp->path);
+	ftp_path_changed(ftp->path_rename);
+	ftp_path_changed(ftp->path);
+	FRESULT file_err = FTP_F_RENAME(ftp->path_rename, ftp->path);
+	ftp_unlock(ftp);
+	if (file_err != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "451 Rename/move failure\r\n"));
+	} else {
+		uint64_t size = (ftp_changes_recorded() && FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) ? ftp->finfo.fsize : 0;
+		ftp_change(FTP_CHANGE_RENAMED, ftp->path_rename, ftp->path, size);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "250 File successfully renamed or moved\r\n"));
+	}
+}
+
+static ftp_result_t ftp_cmd_feat(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "211 Extensions supported:\r\n MDTM\r\n MLSD\r\n REST STREAM\r\n SIZE\r\n SITE FREE\r\n SITE MSTAT\r\n SITE RMDIR\r\n"
+#if FTP_SITE_SYNC == 1
+					" SITE SYNC\r\n"
+#endif
+#if FTP_JOURNAL == 1
+					" SITE CHANGES\r\n"
+#endif
+#if FTP_SITE_WATCH == 1
+					" SITE WATCH\r\n"
+#endif
+#if FTP_SITE_COPY == 1
+					" SITE CPFR\r\n SITE CPTO\r\n"
+#endif
+					"211 End.\r\n"));
+}
+
+static ftp_result_t ftp_cmd_syst(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "215 FTP Server, V1.0\r\n"));
+}
+
+static ftp_result_t ftp_cmd_mdtm(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	uint16_t date;
+	uint16_t time;
+	uint8_t gettime = date_time_get(ftp->parameters, &date, &time);
+	char *fname = ftp->parameters + gettime;
+
+	if (strlen(fname) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	if (!path_build(ftp->path, fname)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+	if (ftp_stat(ftp->path, &ftp->finfo) != FR_OK) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 file \"%s\" not found\r\n", ftp->parameters));
+	}
+
+	if (!gettime) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "213 %s\r\n", data_time_to_str(ftp->date_str, ftp->finfo.fdate, ftp->finfo.ftime)));
+	}
+
+	ftp->finfo.fdate = date;
+	ftp->finfo.ftime = time;
+	ftp_path_changed(ftp->path);
+	FRESULT file_err = FTP_F_UTIME(ftp->path, &ftp->finfo);
+	if (file_err == FR_OK) {
+		ftp_change(FTP_CHANGE_MODIFIED, ftp->path, NULL, ftp->finfo.fsize);
+	}
+	path_up_a_level(ftp->path);
+	if (file_err == FR_OK) {
+		return (ftp_send(ftp, "200 Ok\r\n"));
+	} else {
+		return (ftp_send(ftp, "550 Unable to modify time\r\n"));
+	}
+}
+
+static ftp_result_t ftp_cmd_size(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+
+	if (strlen(ftp->parameters) == 0) {
+		return (ftp_send(ftp, "501 No file name\r\n"));
+	}
+	if (!path_build(ftp->path, ftp->parameters)) {
+		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	}
+
+	if (ftp_stat(ftp->path, &ftp->finfo) != FR_OK || (ftp->finfo.fattrib & AM_DIR)) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 No such file\r\n"));
+	} else {
+		path_up_a_level(ftp->path);
+		char size_str[FTP_U64_STRING_SIZE];
+		return (ftp_send(ftp, "213 %s\r\n", u64_to_str(size_str, ftp->finfo.fsize)));
+	}
+}
+
+static ftp_result_t ftp_cmd_rest(ftp_data_t *ftp) {
+	if (!FTP_IS_LOGGED_IN(ftp)) {
+		return (FTP_RES_OK);
+	}
+	if (!str_to_u64(ftp->parameters, &ftp->restart_offset)) {
+		ftp->restart_offset = 0;
+		return (ftp_send(ftp, "501 Invalid restart position\r\n"));
+	}
+	char size_str[FTP_U64_STRING_SIZE];
+	return (ftp_send(ftp, "350 Restarting at %s\r\n", u64_to_str(size_str, ftp->restart_offset)));
+}
+
+static ftp_result_t ftp_site_free(ftp_data_t *ftp) {
+	FATFS *fs;
+	uint32_t free_clust;
+	FTP_F_GETFREE("0:", &free_clust, &fs);
+	return (ftp_send(ftp, "211 %lu MB free of %lu MB capacity\r\n", (uint32_t) (((uint64_t) free_clust * fs->csize) >> 11),
+			(uint32_t) (((uint64_t) (fs->n_fatent - 2) * fs->csize) >> 11)));
+}
+
+// Multi-line reply collected in transfer buffer
+//
+// lines are collected at beginning of transfer buffer and sent when there is no room for next one,
+// rest of the buffer is free for the command
+#define FTP_BATCH_LINE_MAX			(FTP_CWD_SIZE + 96) // facts and name
+
+typedef struct {
+	uint32_t out_len;
+	uint32_t out_size;
+} ftp_batch_t;
+
+static ftp_result_t ftp_batch_flush(ftp_data_t *ftp, ftp_batch_t *batch) {
+	ftp_result_t res = FTP_RES_OK;
+	if (batch->out_len) {
+		res = ftp_netconn_write(ftp->ctrlconn, ftp->ftp_buff, batch->out_len, NETCONN_COPY, FTP_SERVER_WRITE_TIMEOUT_MS);
+		batch->out_len = 0;
+	}
+	return (res);
+}
+
+// Add line with MLSD-like facts of name
+//
+// fi == NULL: only status is reported, or Type=dir when status is NULL too
+static ftp_result_t ftp_batch_facts(ftp_data_t *ftp, ftp_batch_t *batch, const char *status, const FILINFO *fi, const char *name) {
+	if (batch->out_size - batch->out_len < FTP_BATCH_LINE_MAX && ftp_batch_flush(ftp, batch) != FTP_RES_OK) {
 		return (FTP_RES_ERROR);
 	}
+	char *out = ftp->ftp_buff + batch->out_len;
+	uint32_t out_free = batch->out_size - batch->out_len;
+	int len;
+	if (fi == NULL) {
+		len = status ? snprintf(out, out_free, " Status=%s; %s\r\n", status, name) : snprintf(out, out_free, " Type=dir; %s\r\n", name);
+	} else {
+		char size_str[FTP_U64_STRING_SIZE];
+		u64_to_str(size_str, fi->fsize);
+		len = snprintf(out, out_free, " %s%s%sType=%s;Size=%s;", status ? "Status=" : "", status ? status : "", status ? ";" : "",
+				fi->fattrib & AM_DIR ? "dir" : "file", size_str);
+		if (len > 0 && (uint32_t) len < out_free) {
+			int rest;
+			if (fi->fdate != 0) {
+				rest = snprintf(out + len, out_free - len, "Modify=%s; %s\r\n", data_time_to_str(ftp->date_str, fi->fdate, fi->ftime), name);
+			} else {
+				rest = snprintf(out + len, out_free - len, " %s\r\n", name);
+			}
+			len = rest < 0 ? rest : len + rest;
+		}
+	}
+	batch->out_len += (len > 0 && (uint32_t) len < out_free) ? (uint32_t) len : 0;
+	return (FTP_RES_OK);
+}
+
+// Read lines from data connection until it is closed, CR is dropped and too long lines are cut
+//
+// return: FTP_RES_ERROR when connection failed or on_line returned error
+static ftp_result_t ftp_data_read_lines(ftp_data_t *ftp, char *line, uint32_t line_size,
+		ftp_result_t (*on_line)(ftp_data_t *ftp, void *ctx, char *line), void *ctx) {
+	ftp_result_t res = FTP_RES_OK;
+	uint32_t line_len = 0;
+	ftp_stall_t stall;
+	ftp_stall_start(ftp, &stall);
+	while (res == FTP_RES_OK) {
+		struct pbuf *rcvbuf = NULL;
+		int8_t con_err = FTP_NETCONN_RECV_TCP_PBUF(ftp->dataconn, &rcvbuf);
+		if (con_err == ERR_TIMEOUT && !ftp_should_stop(ftp) && !ftp_stall_check(ftp, &stall)) {
+			continue;
+		}
+		if (con_err != ERR_OK) {
+			res = (con_err == ERR_CLSD) ? FTP_RES_OK : FTP_RES_ERROR;
+			break;
+		}
+		for (struct pbuf *q = rcvbuf; q != NULL && res == FTP_RES_OK; q = q->next) {
+			ftp->bytes_transfered += q->len;
+			for (uint16_t i = 0; i < q->len && res == FTP_RES_OK; i++) {
+				char c = ((char*) q->payload)[i];
+				if (c == '\n') {
+					line[line_len] = 0;
+					if (line_len) {
+						res = on_line(ftp, ctx, line);
+					}
+					line_len = 0;
+				} else if (c != '\r' && line_len < line_size - 1) {
+					line[line_len++] = c;
+				}
+			}
+		}
+		FTP_PBUF_FREE(rcvbuf);
+	}
+	if (res == FTP_RES_OK && line_len) {
+		line[line_len] = 0;
+		res = on_line(ftp, ctx, line);
+	}
+	return (res);
+}
+
+// Batch status query
+//
+// line received from data connection and working directory are kept at end of transfer buffer
+#define FTP_MSTAT_CWD_OFS			(FTP_BUF_SIZE - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_MSTAT_LINE_OFS			(FTP_MSTAT_CWD_OFS - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_MSTAT_CWD(ftp)			((ftp)->ftp_buff + FTP_MSTAT_CWD_OFS)
+#define FTP_MSTAT_LINE(ftp)			((ftp)->ftp_buff + FTP_MSTAT_LINE_OFS)
+#define FTP_MSTAT_OUT_SIZE			FTP_MSTAT_LINE_OFS
+FTP_STATIC_ASSERT(FTP_MSTAT_OUT_SIZE >= FTP_BATCH_LINE_MAX, "FTP_BUF_SIZE is too small for SITE MSTAT");
 
-	while (FTP_F_READDIR(&dir, &ftp->finfo) == FR_OK) {
-		if (ftp->finfo.fname[0] == 0) {
-			break;
-		}
-		if (ftp->finfo.fname[0] == '.') {
-			continue;
-		}
-		if (ftp->finfo.fdate != 0) {
-			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "Type=%s;Size=%ld;Modify=%s; %s\r\n", ftp->finfo.fattrib & AM_DIR ? "dir" : "file", ftp->finfo.fsize,
-					data_time_to_str(ftp->date_str, ftp->finfo.fdate, ftp->finfo.ftime), ftp->finfo.fname);
-		} else {
-			snprintf(ftp->ftp_buff, FTP_BUF_SIZE, "Type=%s;Size=%ld; %s\r\n", ftp->finfo.fattrib & AM_DIR ? "dir" : "file", ftp->finfo.fsize, ftp->finfo.fname);
+typedef struct {
+	ftp_batch_t batch;
+	uint32_t found;
+	uint32_t missing;
+} ftp_mstat_t;
+
+static ftp_result_t ftp_mstat_one(ftp_data_t *ftp, void *ctx, char *name) {
+	ftp_mstat_t *ms = ctx;
+	strcpy(ftp->path, FTP_MSTAT_CWD(ftp));
+	bool root = !strcmp(name, "/");
+	if (!path_build(ftp->path, name) || (!root && ftp_stat(ftp->path, &ftp->finfo) != FR_OK)) {
+		ms->missing++;
+		return (ftp_batch_facts(ftp, &ms->batch, "missing", NULL, name));
+	}
+	ms->found++;
+	return (ftp_batch_facts(ftp, &ms->batch, NULL, root ? NULL : &ftp->finfo, name));
+}
+
+// Status of many paths in one reply
+//
+// SITE MSTAT name1 name2 ... - names are separated by space
+// SITE MSTAT - names are read from data connection, one per line, until it is closed
+// every name gets one line of facts like MLSD, with Status=missing when it does not exist
+static ftp_result_t ftp_site_mstat(ftp_data_t *ftp) {
+	ftp_mstat_t ms = { .batch.out_size = FTP_MSTAT_OUT_SIZE };
+	strcpy(FTP_MSTAT_CWD(ftp), ftp->path);
+	bool upload = (ftp->parameters[0] == 0);
+	if (upload) {
+		if (data_con_open(ftp) != FTP_RES_OK) {
+			return (ftp_send(ftp, "425 Can't create connection\r\n"));
 		}
-		if (netconn_write(ftp->dataconn, ftp->ftp_buff, strlen(ftp->ftp_buff)) != FTP_RES_OK) {
-			FTP_F_CLOSEDIR(&dir);
+		if (ftp_send(ftp, "150 Send list of paths\r\n") != FTP_RES_OK) {
 			data_con_close(ftp);
 			return (FTP_RES_ERROR);
 		}
-		nm++;
 	}
+	ftp_result_t res = ftp_send(ftp, "250-Status\r\n");
 
-	FTP_F_CLOSEDIR(&dir);
-	if (data_con_close(ftp) != FTP_RES_OK) {
+	if (!upload) {
+		char *name = ftp->parameters;
+		while (res == FTP_RES_OK && *name) {
+			char *end = strchr(name, ' ');
+			if (end != NULL) {
+				*end = 0;
+			}
+			if (*name) {
+				res = ftp_mstat_one(ftp, &ms, name);
+			}
+			name = (end != NULL) ? end + 1 : name + strlen(name);
+		}
+	} else {
+		if (res == FTP_RES_OK) {
+			res = ftp_data_read_lines(ftp, FTP_MSTAT_LINE(ftp), FTP_CWD_SIZE, ftp_mstat_one, &ms);
+		}
+		if (data_con_close(ftp) != FTP_RES_OK) {
+			res = FTP_RES_ERROR;
+		}
+	}
+
+	strcpy(ftp->path, FTP_MSTAT_CWD(ftp));
+	if (res == FTP_RES_OK) {
+		res = ftp_batch_flush(ftp, &ms.batch);
+	}
+	if (res != FTP_RES_OK) {
+		// 250- reply is open, so it is closed by 250 line with error
+		ftp_send(ftp, "250 Status aborted, %lu found, %lu missing\r\n", ms.found, ms.missing);
 		return (FTP_RES_ERROR);
 	}
-	return (ftp_send(ftp, "226 Options: -a -l, %d matches total\r\n", nm));
+	return (ftp_send(ftp, "250 End, %lu found, %lu missing\r\n", ms.found, ms.missing));
 }
 
-static ftp_result_t ftp_cmd_dele(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
+#if FTP_SITE_SYNC == 1
+// Manifest based sync
+//
+// transfer buffer layout: reply lines | manifest entries -> ... <- entry names | DIR stack | line/walk path | working directory
+// reply lines area is reused for CRC reads, so it holds at least one sector
+#define FTP_SYNC_OUT_SIZE			FTP_ALIGN8(2 * FTP_BATCH_LINE_MAX > 512 ? 2 * FTP_BATCH_LINE_MAX : 512)
+#define FTP_SYNC_CWD_OFS			(FTP_BUF_SIZE - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_SYNC_LINE_OFS			(FTP_SYNC_CWD_OFS - FTP_ALIGN8(FTP_CWD_SIZE))
+#define FTP_SYNC_DIRS_OFS			(FTP_SYNC_LINE_OFS - FTP_ALIGN8(FTP_SYNC_MAX_DEPTH * sizeof(DIR)))
+FTP_STATIC_ASSERT(FTP_SYNC_DIRS_OFS >= FTP_SYNC_OUT_SIZE + 1024, "FTP_BUF_SIZE is too small for SITE SYNC");
+FTP_STATIC_ASSERT((FTP_SYNC_OUT_SIZE & ~511u) != 0, "SITE SYNC CRC chunk must be at least one sector");
+
+#define FTP_SYNC_SIZE				0x01
+#define FTP_SYNC_TIME				0x02
+#define FTP_SYNC_CRC				0x04
+#define FTP_SYNC_SEEN				0x08
 
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No file name\r\n"));
-	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
-	}
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 file %s not found\r\n", ftp->parameters));
-	}
+typedef struct {
+	uint32_t hash; // of name, entries are sorted by it
+	uint32_t name_ofs; // name in transfer buffer
+	uint64_t size;
+	uint32_t crc;
+	uint16_t fdate;
+	uint16_t ftime;
+	uint8_t flags;
+} ftp_sync_entry_t;
 
-	if (FTP_F_UNLINK(ftp->path) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "450 Can't delete %s\r\n", ftp->parameters));
-	}
+typedef struct {
+	ftp_batch_t batch;
+	ftp_sync_entry_t *entries;
+	uint32_t count;
+	uint32_t names_ofs; // names are stored downwards from here
+	uint16_t root_len;
+	bool overflow; // manifest did not fit, rest was compared one by one and new files are not reported
+	uint32_t changed;
+	uint32_t missing;
+	uint32_t added;
+	uint32_t skipped;
+} ftp_sync_t;
+
+// CRC-32 (IEEE 802.3), table for 4 bits
+static uint32_t ftp_crc32(uint32_t crc, const uint8_t *data, uint32_t len) {
+	static const uint32_t table[16] = { 0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C, //
+			0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+	crc = ~crc;
+	while (len--) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+	}
+	return (~crc);
+}
 
-	path_up_a_level(ftp->path);
-	return (ftp_send(ftp, "250 Deleted %s\r\n", ftp->parameters));
+// CRC-32 of file, pending reply lines are sent first and reply area is used as read buffer
+static bool ftp_sync_file_crc(ftp_data_t *ftp, ftp_sync_t *sy, const char *path, uint32_t *crc) {
+	if (ftp_batch_flush(ftp, &sy->batch) != FTP_RES_OK || FTP_F_OPEN(&ftp->file, path, FA_READ) != FR_OK) {
+		return (false);
+	}
+	uint32_t chunk = FTP_SYNC_OUT_SIZE & ~511u;
+	uint32_t bytes_read = 0;
+	FRESULT file_err;
+	*crc = 0;
+	do {
+		ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff, chunk);
+		file_err = FTP_F_READ(&ftp->file, ftp->ftp_buff, chunk, (UINT* ) &bytes_read);
+		ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff, chunk);
+		*crc = ftp_crc32(*crc, (const uint8_t*) ftp->ftp_buff, bytes_read);
+	} while (file_err == FR_OK && bytes_read == chunk && !ftp_should_stop(ftp));
+	FTP_F_CLOSE(&ftp->file);
+	return (file_err == FR_OK);
 }
 
-static ftp_result_t ftp_cmd_noop(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// return: true, if file differs from facts given in manifest
+static bool ftp_sync_differs(ftp_data_t *ftp, ftp_sync_t *sy, const ftp_sync_entry_t *e, const char *path, const FILINFO *fi) {
+	if (((e->flags & FTP_SYNC_SIZE) && e->size != fi->fsize) || ((e->flags & FTP_SYNC_TIME) && (e->fdate != fi->fdate || e->ftime != fi->ftime))) {
+		return (true);
 	}
-	return (ftp_send(ftp, "200 Zzz...\r\n"));
+	uint32_t crc;
+	if ((e->flags & FTP_SYNC_CRC) && !(fi->fattrib & AM_DIR) && (!ftp_sync_file_crc(ftp, sy, path, &crc) || crc != e->crc)) {
+		return (true);
+	}
+	return (false);
 }
 
-static ftp_result_t ftp_cmd_retr(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// Parse manifest line "fact=value;fact=value; name", known facts are Size, Modify and Crc32
+static void ftp_sync_parse(char *line, ftp_sync_entry_t *e, char **name) {
+	*name = line;
+	if (*line == ' ') {
+		(*name)++;
+		return;
+	}
+	char *sep = strstr(line, "; ");
+	if (sep == NULL) {
+		return;
 	}
+	*sep = 0;
+	*name = sep + 2;
+	for (char *fact = line; fact != NULL && *fact;) {
+		char *next = strchr(fact, ';');
+		if (next != NULL) {
+			*next++ = 0;
+		}
+		char *value = strchr(fact, '=');
+		if (value != NULL) {
+			*value++ = 0;
+			for (char *c = fact; *c; c++) {
+				*c = tolower((uint8_t ) *c);
+			}
+			if (!strcmp(fact, "size") && str_to_u64(value, &e->size)) {
+				e->flags |= FTP_SYNC_SIZE;
+			} else if (!strcmp(fact, "modify") && strlen(value) >= 14 && (value[14] == 0 || value[14] == '.')) {
+				char date[16];
+				memcpy(date, value, 14);
+				date[14] = ' ';
+				date[15] = 0;
+				if (date_time_get(date, &e->fdate, &e->ftime)) {
+					e->flags |= FTP_SYNC_TIME;
+				}
+			} else if (!strcmp(fact, "crc32") && strlen(value) == 8) {
+				char *end;
+				e->crc = strtoul(value, &end, 16);
+				if (*end == 0) {
+					e->flags |= FTP_SYNC_CRC;
+				}
+			}
+		}
+		fact = next;
+	}
+}
 
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No file name\r\n"));
+// Store manifest line, when there is no room left entry is compared with file right away
+static ftp_result_t ftp_sync_line(ftp_data_t *ftp, void *ctx, char *line) {
+	ftp_sync_t *sy = ctx;
+	ftp_sync_entry_t e = { 0 };
+	char *name;
+	ftp_sync_parse(line, &e, &name);
+	while (*name == '/') {
+		name++;
 	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	if (*name == 0 || !strcmp(name, "..")) {
+		return (FTP_RES_OK);
 	}
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 File %s not found\r\n", ftp->parameters));
+	uint32_t name_size = strlen(name) + 1;
+	uint32_t entries_end = FTP_SYNC_OUT_SIZE + (sy->count + 1) * sizeof(ftp_sync_entry_t);
+	if (!sy->overflow && entries_end + name_size <= sy->names_ofs) {
+		sy->names_ofs -= name_size;
+		memcpy(ftp->ftp_buff + sy->names_ofs, name, name_size);
+		e.name_ofs = sy->names_ofs;
+		e.hash = ftp_path_hash(name);
+		sy->entries[sy->count++] = e;
+		return (FTP_RES_OK);
 	}
-	if (FTP_F_OPEN(&ftp->file, ftp->path, FA_READ) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "450 Can't open %s\r\n", ftp->parameters));
+
+	sy->overflow = true;
+	ftp_result_t res = FTP_RES_OK;
+	if (!path_build(ftp->path, name) || ftp_stat(ftp->path, &ftp->finfo) != FR_OK) {
+		sy->missing++;
+		res = ftp_batch_facts(ftp, &sy->batch, "missing", NULL, name);
+	} else if (ftp_sync_differs(ftp, sy, &e, ftp->path, &ftp->finfo)) {
+		sy->changed++;
+		res = ftp_batch_facts(ftp, &sy->batch, "changed", &ftp->finfo, name);
+	}
+	ftp->path[sy->root_len] = 0;
+	return (res);
+}
+
+static int ftp_sync_cmp(const void *a, const void *b) {
+	uint32_t ha = ((const ftp_sync_entry_t*) a)->hash;
+	uint32_t hb = ((const ftp_sync_entry_t*) b)->hash;
+	return (ha < hb ? -1 : ha > hb);
+}
+
+// find manifest entry of name in sorted entries
+static ftp_sync_entry_t* ftp_sync_find(ftp_data_t *ftp, ftp_sync_t *sy, const char *name) {
+	uint32_t hash = ftp_path_hash(name);
+	uint32_t lo = 0, hi = sy->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (sy->entries[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	if (data_con_open(ftp) != FTP_RES_OK) {
-		FTP_F_CLOSE(&ftp->file);
-		path_up_a_level(ftp->path);
-		ftp_send(ftp, "425 Can't create connection\r\n");
-		return (FTP_RES_ERROR);
+	for (; lo < sy->count && sy->entries[lo].hash == hash; lo++) {
+		if (!strcmp(ftp->ftp_buff + sy->entries[lo].name_ofs, name)) {
+			return (&sy->entries[lo]);
+		}
 	}
-	DEBUG_PRINT(ftp, "Sending %s\r\n", ftp->parameters);
-	if (ftp_send(ftp, "150 Connected to port %u, %lu bytes to download\r\n", ftp->data_port, FTP_F_SIZE(&ftp->file)) != FTP_RES_OK) {
+	return (NULL);
+}
+
+// Walk the tree under ftp->path once and report changed and new files, explicit stack of FTP_SYNC_MAX_DEPTH directories is used
+static ftp_result_t ftp_sync_walk(ftp_data_t *ftp, ftp_sync_t *sy) {
+	DIR *dirs = (DIR*) (ftp->ftp_buff + FTP_SYNC_DIRS_OFS);
+	char *path = ftp->ftp_buff + FTP_SYNC_LINE_OFS;
+	uint16_t dir_len[FTP_SYNC_MAX_DEPTH];
+	uint16_t rel_ofs = (sy->root_len == 1) ? 1 : sy->root_len + 1;
+	int8_t depth = 0;
+	ftp_result_t res = FTP_RES_OK;
+
+	strcpy(path, ftp->path);
+	dir_len[0] = sy->root_len;
+	if (FTP_F_OPENDIR(&dirs[0], path) != FR_OK) {
 		return (FTP_RES_ERROR);
 	}
-
-	int bytes_transfered = 0;
-	uint32_t bytes_read = 1;
-	while (1) {
-		if (FTP_F_READ(&ftp->file, ftp->ftp_buff, TCP_MSS, (UINT*) &bytes_read) != FR_OK) {
-			if (ftp_send(ftp, "451 Communication error during transfer\r\n") != FTP_RES_OK) {
-				FTP_F_CLOSE(&ftp->file);
-				path_up_a_level(ftp->path);
-				data_con_close(ftp);
-				return (FTP_RES_ERROR);
+	while (depth >= 0) {
+		if (res != FTP_RES_OK || ftp_should_stop(ftp)) {
+			while (depth >= 0) {
+				FTP_F_CLOSEDIR(&dirs[depth--]);
 			}
-			break;
+			return (FTP_RES_ERROR);
 		}
-		if (bytes_read == 0) {
-			break;
+		path[dir_len[depth]] = 0;
+		if (FTP_F_READDIR(&dirs[depth], &ftp->finfo) != FR_OK || ftp->finfo.fname[0] == 0) {
+			FTP_F_CLOSEDIR(&dirs[depth--]);
+			continue;
 		}
-		if (netconn_write(ftp->dataconn, ftp->ftp_buff, bytes_read) != FTP_RES_OK) {
-			FTP_F_CLOSE(&ftp->file);
-			path_up_a_level(ftp->path);
-			ftp_send(ftp, "426 Error during file transfer\r\n");
-			data_con_close(ftp);
-			return (FTP_RES_ERROR);
+		if (ftp_is_dot_entry(ftp->finfo.fname)) {
+			continue;
 		}
-		bytes_transfered += bytes_read;
-	}
+		uint16_t len = dir_len[depth];
+		bool add_slash = (len != 1);
+		if (len + add_slash + strlen(ftp->finfo.fname) >= FTP_CWD_SIZE) {
+			sy->skipped++;
+			continue;
+		}
+		if (add_slash) {
+			path[len++] = '/';
+		}
+		strcpy(path + len, ftp->finfo.fname);
+		const char *rel = path + rel_ofs;
 
-	DEBUG_PRINT(ftp, "Sent %u bytes\r\n", bytes_transfered);
-	FTP_F_CLOSE(&ftp->file);
-	path_up_a_level(ftp->path);
-	if (data_con_close(ftp) != FTP_RES_OK) {
-		return (FTP_RES_ERROR);
+		if (ftp->finfo.fattrib & AM_DIR) {
+			if (depth + 1 < FTP_SYNC_MAX_DEPTH && FTP_F_OPENDIR(&dirs[depth + 1], path) == FR_OK) {
+				depth++;
+				dir_len[depth] = strlen(path);
+			} else {
+				sy->skipped++;
+				res = ftp_batch_facts(ftp, &sy->batch, "skipped", NULL, rel);
+			}
+			continue;
+		}
+		ftp_sync_entry_t *e = ftp_sync_find(ftp, sy, rel);
+		if (e != NULL) {
+			e->flags |= FTP_SYNC_SEEN;
+			if (ftp_sync_differs(ftp, sy, e, path, &ftp->finfo)) {
+				sy->changed++;
+				res = ftp_batch_facts(ftp, &sy->batch, "changed", &ftp->finfo, rel);
+			}
+		} else if (!sy->overflow) {
+			sy->added++;
+			res = ftp_batch_facts(ftp, &sy->batch, "new", &ftp->finfo, rel);
+		}
 	}
-	return (ftp_send(ftp, "226 File successfully transferred\r\n"));
+	return (res);
 }
 
-static ftp_result_t ftp_cmd_stor(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+// Compare client manifest with directory tree
+//
+// SITE SYNC [dir] - manifest is read from data connection, one file per line in MLSD format
+// "Size=123;Modify=20200101120000;Crc32=1234abcd; path/name", all facts are optional,
+// names are relative to dir (working directory by default), reply lists only changed,
+// new (not in manifest) and missing (not on server) files
+static ftp_result_t ftp_site_sync(ftp_data_t *ftp) {
+	ftp_sync_t sy = { .batch.out_size = FTP_SYNC_OUT_SIZE };
+	sy.entries = (ftp_sync_entry_t*) (ftp->ftp_buff + FTP_SYNC_OUT_SIZE);
+	sy.names_ofs = FTP_SYNC_DIRS_OFS;
+	char *cwd = ftp->ftp_buff + FTP_SYNC_CWD_OFS;
+	strcpy(cwd, ftp->path);
+	if (!path_build(ftp->path, ftp->parameters) || (strcmp(ftp->path, "/") && (ftp_stat(ftp->path, &ftp->finfo) != FR_OK || !(ftp->finfo.fattrib & AM_DIR)))) {
+		strcpy(ftp->path, cwd);
+		return (ftp_send(ftp, "550 Directory %s not found\r\n", ftp->parameters));
+	}
+	sy.root_len = strlen(ftp->path);
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		strcpy(ftp->path, cwd);
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
 	}
-
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No file name\r\n"));
+	ftp_result_t res = ftp_send(ftp, "150 Send manifest\r\n");
+	if (res == FTP_RES_OK) {
+		res = ftp_send(ftp, "250-Differences\r\n");
 	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	if (res == FTP_RES_OK) {
+		res = ftp_data_read_lines(ftp, ftp->ftp_buff + FTP_SYNC_LINE_OFS, FTP_CWD_SIZE, ftp_sync_line, &sy);
 	}
-	if (FTP_F_OPEN(&ftp->file, ftp->path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "450 Can't open/create %s\r\n", ftp->parameters));
+	if (data_con_close(ftp) != FTP_RES_OK) {
+		res = FTP_RES_ERROR;
 	}
-	if (data_con_open(ftp) != 0) {
-		FTP_F_CLOSE(&ftp->file);
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+
+	if (res == FTP_RES_OK) {
+		qsort(sy.entries, sy.count, sizeof(ftp_sync_entry_t), ftp_sync_cmp);
+		res = ftp_sync_walk(ftp, &sy);
 	}
-	DEBUG_PRINT(ftp, "Receiving %s\r\n", ftp->parameters);
-	netconn_set_recvtimeout(ftp->dataconn, FTP_STOR_RECV_TIMEOUT_MS);
-	if (ftp_send(ftp, "150 Connected to port %u\r\n", ftp->data_port) != FTP_RES_OK) {
+	for (uint32_t i = 0; i < sy.count && res == FTP_RES_OK; i++) {
+		if (!(sy.entries[i].flags & FTP_SYNC_SEEN)) {
+			sy.missing++;
+			res = ftp_batch_facts(ftp, &sy.batch, "missing", NULL, ftp->ftp_buff + sy.entries[i].name_ofs);
+		}
+	}
+	strcpy(ftp->path, cwd);
+	if (res == FTP_RES_OK) {
+		res = ftp_batch_flush(ftp, &sy.batch);
+	}
+	if (res != FTP_RES_OK) {
+		// 250- reply is open, so it is closed by 250 line with error
+		ftp_send(ftp, "250 Sync aborted, %lu changed, %lu new, %lu missing, %lu skipped\r\n", sy.changed, sy.added, sy.missing, sy.skipped);
 		return (FTP_RES_ERROR);
 	}
+	return (ftp_send(ftp, "250 End, %lu changed, %lu new, %lu missing, %lu skipped%s\r\n", sy.changed, sy.added, sy.missing, sy.skipped,
+			sy.overflow ? ", manifest too big, new files not reported" : ""));
+}
+#endif
 
-	uint32_t bytes_transfered = 0;
-	uint32_t buff_free_bytes = FTP_BUF_SIZE;
-	while (1) {
-		struct pbuf *rcvbuf = NULL;
-		int8_t con_err = netconn_recv_tcp_pbuf(ftp->dataconn, &rcvbuf);
-		if (con_err == ERR_OK) {
-			struct pbuf *rcvbuf_temp = rcvbuf;
-			uint8_t *payload = (uint8_t*) (rcvbuf_temp->payload);
-			FRESULT file_err = FR_OK;
+// SITE commands, parameters of SITE are shifted to hold only parameters of SITE command
+#if FTP_JOURNAL == 1
+// Changes since seq
+//
+// transfer buffer layout: journal data read from file | reply lines
+#define FTP_CHANGES_IN_SIZE			(FTP_BUF_SIZE / 2)
+#define FTP_CHANGES_OUT(ftp)		((ftp)->ftp_buff + FTP_CHANGES_IN_SIZE)
+FTP_STATIC_ASSERT(FTP_CHANGES_IN_SIZE >= FTP_JOURNAL_SECTOR, "FTP_BUF_SIZE is too small for SITE CHANGES");
 
-			while (rcvbuf_temp != NULL) {
-				bytes_transfered += rcvbuf_temp->len;
+typedef struct {
+	uint32_t since;
+	uint32_t last;
+	uint32_t generation;
+	uint32_t out_len;
+	uint32_t count;
+	bool rotated;
+} ftp_changes_t;
+
+// Send records of journal file with seq in (since, last]
+//
+// file is read under journal lock, so it is not rotated while read
+static ftp_result_t ftp_changes_send(ftp_data_t *ftp, ftp_changes_t *ch, const char *path) {
+	ftp_journal_lock();
+	ch->rotated = (ftp_journal.generation != ch->generation);
+	FRESULT file_err = ch->rotated ? FR_DENIED : FTP_F_OPEN(&ftp->file, path, FA_READ);
+	ftp_journal_unlock();
+	if (file_err == FR_NO_FILE) {
+		return (FTP_RES_OK);
+	}
+	if (file_err != FR_OK) {
+		return (FTP_RES_ERROR);
+	}
 
-				if (rcvbuf_temp->len > FTP_BUF_SIZE) {
-					uint32_t bytes_written = 0;
-					file_err = FTP_F_WRITE(&ftp->file, payload, rcvbuf_temp->len, (UINT* ) &bytes_written);
-					if (file_err != FR_OK) {
-						break;
-					}
-					if (rcvbuf_temp->len != bytes_written) {
-						file_err = FR_INT_ERR;
-						break;
-					}
-				} else if (buff_free_bytes > rcvbuf_temp->len) {
-					uint32_t used_bytes = FTP_BUF_SIZE - buff_free_bytes;
-					memcpy(ftp->ftp_buff + used_bytes, payload, rcvbuf_temp->len);
-					buff_free_bytes -= rcvbuf_temp->len;
-				} else {
-					uint32_t used_bytes = FTP_BUF_SIZE - buff_free_bytes;
-					memcpy(ftp->ftp_buff + used_bytes, payload, buff_free_bytes);
-					uint32_t bytes_written = 0;
-					file_err = FTP_F_WRITE(&ftp->file, ftp->ftp_buff, FTP_BUF_SIZE, (UINT* ) &bytes_written);
-					if (file_err != FR_OK) {
-						break;
-					}
-					if (FTP_BUF_SIZE != bytes_written) {
-						file_err = FR_INT_ERR;
-						break;
-					}
-					uint32_t rest_bytes_to_save = rcvbuf_temp->len - buff_free_bytes;
-					if (rest_bytes_to_save) {
-						memcpy(ftp->ftp_buff, payload + buff_free_bytes, rest_bytes_to_save);
-						buff_free_bytes = FTP_BUF_SIZE - rest_bytes_to_save;
-					} else {
-						buff_free_bytes = FTP_BUF_SIZE;
-					}
-				}
-				rcvbuf_temp = rcvbuf_temp->next;
-				payload = (uint8_t*) (rcvbuf_temp->payload);
-			}
-			pbuf_free(rcvbuf);
-			if (file_err != 0) {
-				if (ftp_send(ftp, "451 Communication error during transfer\r\n") != FTP_RES_OK) {
-					FTP_F_CLOSE(&ftp->file);
-					path_up_a_level(ftp->path);
-					data_con_close(ftp);
-					return (FTP_RES_ERROR);
-				}
-				break;
-			}
+	ftp_result_t res = FTP_RES_OK;
+	uint32_t carry = 0;
+	while (res == FTP_RES_OK) {
+		UINT bytes_read = 0;
+		ftp_journal_lock();
+		ch->rotated = (ftp_journal.generation != ch->generation);
+		if (ch->rotated) {
+			file_err = FR_DENIED;
 		} else {
-			FRESULT file_err = FR_OK;
-			if (buff_free_bytes != FTP_BUF_SIZE) {
-				uint32_t rest_bytes = FTP_BUF_SIZE - buff_free_bytes;
-				uint32_t bytes_written = 0;
-				file_err = FTP_F_WRITE(&ftp->file, ftp->ftp_buff, rest_bytes, (UINT* ) &bytes_written);
-				if (rest_bytes != bytes_written) {
-					file_err = FR_INT_ERR;
-				}
-			}
-			if (file_err != 0) {
-				if (ftp_send(ftp, "451 Communication error during transfer\r\n") != FTP_RES_OK) {
-					FTP_F_CLOSE(&ftp->file);
-					path_up_a_level(ftp->path);
-					data_con_close(ftp);
-					return (FTP_RES_ERROR);
-				}
+			ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff + carry, FTP_CHANGES_IN_SIZE - carry);
+			file_err = FTP_F_READ(&ftp->file, ftp->ftp_buff + carry, FTP_CHANGES_IN_SIZE - carry, &bytes_read);
+			ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff + carry, FTP_CHANGES_IN_SIZE - carry);
+		}
+		ftp_journal_unlock();
+		if (file_err != FR_OK) {
+			res = FTP_RES_ERROR;
+			break;
+		}
+		if (bytes_read == 0) {
+			break;
+		}
+
+		char *in = ftp->ftp_buff;
+		uint32_t end = carry + bytes_read;
+		uint32_t start = 0;
+		for (uint32_t i = carry; i < end && res == FTP_RES_OK; i++) {
+			if (in[i] != '\n') {
+				continue;
 			}
-			if (con_err != ERR_CLSD) {
-				if (ftp_send(ftp, "426 Error during file transfer: %d\r\n", con_err) != FTP_RES_OK) {
-					FTP_F_CLOSE(&ftp->file);
-					path_up_a_level(ftp->path);
-					data_con_close(ftp);
-					return (FTP_RES_ERROR);
+			uint32_t len = i - start;
+			// empty lines are padding of sectors
+			if (len && isdigit((uint8_t ) in[start])) {
+				uint32_t seq = strtoul(&in[start], NULL, 10);
+				if (seq > ch->since && seq <= ch->last) {
+					if (ch->out_len + len + 2 > FTP_BUF_SIZE - FTP_CHANGES_IN_SIZE) {
+						res = ftp_data_write(ftp, FTP_CHANGES_OUT(ftp), ch->out_len);
+						ch->out_len = 0;
+					}
+					memcpy(FTP_CHANGES_OUT(ftp) + ch->out_len, &in[start], len);
+					memcpy(FTP_CHANGES_OUT(ftp) + ch->out_len + len, "\r\n", 2);
+					ch->out_len += len + 2;
+					ch->count++;
 				}
 			}
-			break;
+			start = i + 1;
+		}
+		carry = end - start;
+		if (carry == FTP_CHANGES_IN_SIZE) {
+			// no record is that long, file is damaged
+			carry = 0;
 		}
+		memmove(in, in + start, carry);
 	}
-
-	DEBUG_PRINT(ftp, "Received %lu bytes\r\n", bytes_transfered);
 	FTP_F_CLOSE(&ftp->file);
-	path_up_a_level(ftp->path);
-
-	if (data_con_close(ftp) != FTP_RES_OK) {
-		return (FTP_RES_ERROR);
-	}
-	return (ftp_send(ftp, "226 File successfully transferred\r\n"));
+	return (res);
 }
 
-static ftp_result_t ftp_cmd_mkd(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
-
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No directory name\r\n"));
+// Journal records newer than given seq
+//
+// SITE CHANGES SINCE <seq> - records are sent over data connection, reply tells seq of last record,
+// which is used in next query, 0 gets whole journal
+// when records since seq were already dropped from journal, 550 is replied and client must list the tree
+static ftp_result_t ftp_site_changes(ftp_data_t *ftp) {
+	char *arg = ftp->parameters;
+	if (!strncmp(arg, "SINCE ", 6)) {
+		arg += 6;
+	}
+	uint64_t since;
+	if (!str_to_u64(arg, &since) || since > UINT32_MAX) {
+		return (ftp_send(ftp, "501 Usage: SITE CHANGES SINCE <seq>\r\n"));
+	}
+
+	ftp_changes_t ch = { .since = since };
+	ftp_journal_lock();
+	ftp_journal_load();
+	ftp_journal_write();
+	ch.last = ftp_journal.seq;
+	ch.generation = ftp_journal.generation;
+	uint32_t first = ftp_journal.first_seq;
+	ftp_journal_unlock();
+
+	if (ch.since > ch.last) {
+		return (ftp_send(ftp, "550 Sequence %lu is newer than last change %lu\r\n", ch.since, ch.last));
+	}
+	if (first != 0 ? ch.since + 1 < first : ch.since < ch.last) {
+		return (ftp_send(ftp, "550 Journal starts at %lu, list whole tree\r\n", first));
 	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
 	}
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "521 \"%s\" directory already exists\r\n", ftp->parameters));
+	if (ftp_send(ftp, "150 Sending changes since %lu\r\n", ch.since) != FTP_RES_OK) {
+		data_con_close(ftp);
+		return (FTP_RES_ERROR);
 	}
 
-	if (FTP_F_MKDIR(ftp->path) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 Can't create \"%s\"\r\n", ftp->parameters));
+	ftp_result_t res = FTP_RES_OK;
+	if (ch.since < ch.last) {
+		res = ftp_changes_send(ftp, &ch, FTP_JOURNAL_OLD_PATH);
+		if (res == FTP_RES_OK) {
+			res = ftp_changes_send(ftp, &ch, FTP_JOURNAL_PATH);
+		}
+		if (res == FTP_RES_OK && ch.out_len) {
+			res = ftp_data_write(ftp, FTP_CHANGES_OUT(ftp), ch.out_len);
+		}
 	}
-
-	DEBUG_PRINT(ftp, "Creating directory %s\r\n", ftp->parameters);
-	return (ftp_send(ftp, "257 \"%s\" created\r\n", ftp->parameters));
-}
-
-static ftp_result_t ftp_cmd_rmd(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+	if (data_con_close(ftp) != FTP_RES_OK) {
+		res = FTP_RES_ERROR;
 	}
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No directory name\r\n"));
+	if (res != FTP_RES_OK) {
+		if (ch.rotated) {
+			return (ftp_send(ftp, "451 Journal was rotated, try again\r\n"));
+		}
+		ftp_send(ftp, "451 Sending of changes aborted\r\n");
+		return (FTP_RES_ERROR);
 	}
-	if (!path_build(ftp->path, ftp->parameters)) {
+	return (ftp_send(ftp, "226 %lu changes, last %lu\r\n", ch.count, ch.last));
+}
+#endif
+
+#if FTP_SITE_WATCH == 1
+// Stream changes as they happen
+//
+// SITE WATCH [path] - changes of path and below it (working directory by default) are sent over data connection,
+// one line per change: "<C|M|D|R|N> <size> <path>", R has old path and is followed by N with new path,
+// "OVERFLOW <count>" tells that count changes were dropped because queue was full, client should list again,
+// watch ends when client closes data connection
+static ftp_result_t ftp_site_watch(ftp_data_t *ftp) {
+	char *watched = ftp->ftp_buff + FTP_WATCH_PATH_OFS;
+	char *line = ftp->ftp_buff + FTP_WATCH_LINE_OFS;
+	strcpy(watched, ftp->path);
+	if (ftp->parameters[0] && !path_build(watched, ftp->parameters)) {
 		return (ftp_send(ftp, "500 Command line too long\r\n"));
 	}
-	DEBUG_PRINT(ftp, "Deleting %s\r\n", ftp->path);
+	if (!strcmp(watched, "/")) {
+		watched[0] = 0;
+	}
+	if (data_con_open(ftp) != FTP_RES_OK) {
+		return (ftp_send(ftp, "425 Can't create connection\r\n"));
+	}
+	if (ftp_send(ftp, "150 Watching %s\r\n", watched[0] ? watched : "/") != FTP_RES_OK) {
+		data_con_close(ftp);
+		return (FTP_RES_ERROR);
+	}
+	// receive only detects closing by client, so it is used as wait for next event
+	FTP_NETCONN_SET_RECVTIMEOUT(ftp->dataconn, FTP_WATCH_POLL_MS);
 
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 Directory \"%s\" not found\r\n", ftp->parameters));
+	ftp_watch_t *w = &ftp_watches[ftp->ftp_con_num];
+	ftp_stats_lock();
+	w->head = 0;
+	w->count = 0;
+	w->lost = 0;
+	w->active = true;
+	ftp_stats_unlock();
+
+	ftp_result_t res = FTP_RES_OK;
+	uint32_t sent = 0;
+	while (res == FTP_RES_OK && !ftp_should_stop(ftp)) {
+		int len = 0;
+		ftp_stats_lock();
+		if (w->count) {
+			ftp_watch_event_t *e = &FTP_WATCH_QUEUE(ftp->ftp_con_num)[w->head];
+			len = snprintf(line, FTP_WATCH_LINE_MAX, "%c %s %s\r\n", e->change, u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, e->size), e->path);
+			w->head = (w->head + 1) % FTP_WATCH_QUEUE_LEN;
+			w->count--;
+		} else if (w->lost) {
+			// reported after queued events, which are older
+			len = snprintf(line, FTP_WATCH_LINE_MAX, "OVERFLOW %lu\r\n", (unsigned long) w->lost);
+			w->lost = 0;
+		}
+		ftp_stats_unlock();
+		if (len > 0 && len < FTP_WATCH_LINE_MAX) {
+			// events are pushed at once, not held for full segment
+			res = ftp_netconn_write(ftp->dataconn, line, len, NETCONN_COPY, FTP_SERVER_WRITE_TIMEOUT_MS);
+			ftp->bytes_transfered += len;
+			sent++;
+			continue;
+		}
+		struct pbuf *rcvbuf = NULL;
+		int8_t con_err = FTP_NETCONN_RECV_TCP_PBUF(ftp->dataconn, &rcvbuf);
+		if (con_err == ERR_OK) {
+			FTP_PBUF_FREE(rcvbuf);
+		} else if (con_err != ERR_TIMEOUT) {
+			break;
+		}
 	}
 
-	if (FTP_F_UNLINK(ftp->path) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "501 Can't delete \"%s\"\r\n", ftp->parameters));
+	ftp_stats_lock();
+	w->active = false;
+	ftp_stats_unlock();
+	if (data_con_close(ftp) != FTP_RES_OK || res != FTP_RES_OK) {
+		ftp_send(ftp, "426 Watch aborted\r\n");
+		return (FTP_RES_ERROR);
 	}
-	path_up_a_level(ftp->path);
-	return (ftp_send(ftp, "250 \"%s\" removed\r\n", ftp->parameters));
+	return (ftp_send(ftp, "226 Watch ended, %lu changes sent\r\n", sent));
 }
+#endif
 
-static ftp_result_t ftp_cmd_rnfr(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+#if FTP_SITE_COPY == 1
+// Server side copy
+//
+// transfer buffer layout: chunk | destination FIL, source uses FIL of session
+#define FTP_COPY_FIL_OFS			(FTP_BUF_SIZE - FTP_ALIGN8(sizeof(FIL)))
+#define FTP_COPY_FIL(ftp)			((FIL*) ((ftp)->ftp_buff + FTP_COPY_FIL_OFS))
+FTP_STATIC_ASSERT(FTP_COPY_FIL_OFS >= 512, "FTP_BUF_SIZE is too small for SITE CPTO");
+
+typedef struct {
+	uint64_t size;
+	uint64_t done;
+	uint32_t start_ms;
+	bool cancelled;
+} ftp_copy_t;
+
+// Answer STAT and ABOR sent during copy, other commands are refused
+//
+// return: true, when copy must be stopped
+static bool ftp_copy_poll(ftp_data_t *ftp, ftp_copy_t *cp) {
+	FTP_NETCONN_SET_RECVTIMEOUT(ftp->ctrlconn, 1);
+	err_t err = FTP_NETCONN_RECV(ftp->ctrlconn, &ftp->inbuf);
+	if (err == ERR_TIMEOUT) {
+		return (false);
+	}
+	if (err != ERR_OK || ftp_parse_command(ftp) != FTP_RES_OK) {
+		return (true);
+	}
+	ftp_trace_command(ftp);
+	if (!strcmp(ftp->command, "ABOR")) {
+		cp->cancelled = true;
+		return (true);
+	}
+	if (!strcmp(ftp->command, "STAT")) {
+		uint32_t elapsed_ms = FTP_TIME_MS() - cp->start_ms;
+		uint32_t rate_kBps = elapsed_ms ? (uint32_t) (cp->done / elapsed_ms) : 0;
+		return (ftp_send(ftp, "213-Copy in progress\r\n %s of %s bytes, %lu kB/s\r\n213 End\r\n",
+				u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, cp->done), u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, cp->size), rate_kBps)
+				!= FTP_RES_OK);
+	}
+	return (ftp_send(ftp, "503 Copy in progress, only STAT and ABOR are accepted\r\n") != FTP_RES_OK);
+}
+
+// Bytes copied at once, multiple of destination cluster or its part when cluster does not fit in buffer,
+// so every write but last one covers whole clusters, fs is volume of destination or NULL when unknown
+static uint32_t ftp_copy_chunk(const FATFS *fs) {
+	uint32_t chunk = FTP_COPY_FIL_OFS & ~511u;
+	if (fs != NULL) {
+		uint32_t cluster = (uint32_t) fs->csize * 512;
+		if (cluster <= chunk) {
+			chunk -= chunk % cluster;
+		} else {
+			while (cluster > chunk) {
+				cluster /= 2;
+			}
+			chunk = cluster;
+		}
 	}
+	return (chunk);
+}
 
+// SITE CPFR <path> - source of copy
+static ftp_result_t ftp_site_cpfr(ftp_data_t *ftp) {
 	if (strlen(ftp->parameters) == 0) {
 		return (ftp_send(ftp, "501 No file name\r\n"));
 	}
 	memcpy(ftp->path_rename, ftp->path, FTP_CWD_SIZE);
 	if (!path_build(ftp->path_rename, ftp->parameters)) {
+		ftp->path_rename[0] = 0;
 		return (ftp_send(ftp, "500 Command line too long\r\n"));
 	}
-	if (FTP_F_STAT(ftp->path_rename, &ftp->finfo) != FR_OK) {
+	if (ftp_stat(ftp->path_rename, &ftp->finfo) != FR_OK || (ftp->finfo.fattrib & AM_DIR)) {
+		ftp->path_rename[0] = 0;
 		return (ftp_send(ftp, "550 file \"%s\" not found\r\n", ftp->parameters));
 	}
-	DEBUG_PRINT(ftp, "Renaming %s\r\n", ftp->path_rename);
-	return (ftp_send(ftp, "350 RNFR accepted - file exists, ready for destination\r\n"));
+	return (ftp_send(ftp, "350 File exists, ready for destination\r\n"));
 }
 
-static ftp_result_t ftp_cmd_rnto(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
-	}
-
-	if (!strlen(ftp->parameters)) {
+// SITE CPTO <path> - copy file from SITE CPFR, existing file is replaced
+//
+// data are copied by server, destination is preallocated when FATFS has f_expand,
+// STAT shows progress and ABOR cancels copy, destination is deleted when copy does not finish
+// paths have no drive prefix, so source and destination are on default volume, copy between volumes is not supported
+static ftp_result_t ftp_site_cpto(ftp_data_t *ftp) {
+	if (strlen(ftp->parameters) == 0) {
 		return (ftp_send(ftp, "501 No file name\r\n"));
 	}
-	if (!strlen(ftp->path_rename)) {
-		return (ftp_send(ftp, "503 Need RNFR before RNTO\r\n"));
+	if (strlen(ftp->path_rename) == 0) {
+		return (ftp_send(ftp, "503 Need SITE CPFR before SITE CPTO\r\n"));
 	}
 	if (!path_build(ftp->path, ftp->parameters)) {
 		return (ftp_send(ftp, "500 Command line too long\r\n"));
 	}
-
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) == FR_OK) {
+	const char *src = ftp->path_rename;
+	// FAT finds names regardless of case, destination in other case would truncate source
+	if (ftp_path_equal(src, ftp->path, FTP_CWD_SIZE)) {
 		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "553 \"%s\" already exists\r\n", ftp->parameters));
+		return (ftp_send(ftp, "553 Source and destination are the same\r\n"));
 	}
-
-	DEBUG_PRINT(ftp, "Renaming %s to %s\r\n", ftp->path_rename, ftp->path);
-	if (FTP_F_RENAME(ftp->path_rename, ftp->path) != FR_OK) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "451 Rename/move failure\r\n"));
-	} else {
+	if (ftp_stat(src, &ftp->finfo) != FR_OK || (ftp->finfo.fattrib & AM_DIR)) {
 		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "250 File successfully renamed or moved\r\n"));
-	}
-}
-
-static ftp_result_t ftp_cmd_feat(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+		return (ftp_send(ftp, "550 Source file not found\r\n"));
 	}
-	return (ftp_send(ftp, "211 Extensions supported:\r\n MDTM\r\n MLSD\r\n SIZE\r\n SITE FREE\r\n211 End.\r\n"));
-}
+	ftp_copy_t cp = { .size = ftp->finfo.fsize, .start_ms = FTP_TIME_MS() };
+	WORD fdate = ftp->finfo.fdate;
+	WORD ftime = ftp->finfo.ftime;
 
-static ftp_result_t ftp_cmd_syst(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+	// paths have no drive prefix, so free space is of default volume
+	FATFS *fs = NULL;
+	uint32_t free_clust = 0;
+	if (FTP_F_GETFREE(ftp->path, &free_clust, &fs) != FR_OK) {
+		fs = NULL;
 	}
-	return (ftp_send(ftp, "215 FTP Server, V1.0\r\n"));
-}
-
-static ftp_result_t ftp_cmd_mdtm(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+	if (fs != NULL && (uint64_t) free_clust * fs->csize * 512 < cp.size) {
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "452 Not enough space\r\n"));
 	}
-
-	uint16_t date;
-	uint16_t time;
-	uint8_t gettime = date_time_get(ftp->parameters, &date, &time);
-	char *fname = ftp->parameters + gettime;
-
-	if (strlen(fname) == 0) {
-		return (ftp_send(ftp, "501 No file name\r\n"));
+	// source is read locked, so it is not written, deleted or renamed during copy
+	if (!ftp_lock(ftp, ftp->path, FTP_LOCK_WRITE) || ftp_path_reserved(src, FTP_LOCK_READ) || !ftp_lock_slot(ftp, 1, src, FTP_LOCK_READ)) {
+		ftp_unlock(ftp);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "450 %s is in use\r\n", ftp->parameters));
 	}
-	if (!path_build(ftp->path, fname)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	bool existed = (ftp_changes_recorded() && ftp_stat(ftp->path, &ftp->finfo) == FR_OK);
+	ftp_path_changed(ftp->path);
+	FIL *dst = FTP_COPY_FIL(ftp);
+	if (ftp_open_read(src, &ftp->file) != FR_OK) {
+		ftp_unlock(ftp);
+		path_up_a_level(ftp->path);
+		return (ftp_send(ftp, "550 Can't open source file\r\n"));
 	}
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK) {
+	if (ftp_fs_open(ftp->path, dst, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		FTP_F_CLOSE(&ftp->file);
+		ftp_unlock(ftp);
 		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 file \"%s\" not found\r\n", ftp->parameters));
+		return (ftp_send(ftp, "450 Can't open/create %s\r\n", ftp->parameters));
 	}
-
-	path_up_a_level(ftp->path);
-	if (!gettime) {
-		return (ftp_send(ftp, "213 %s\r\n", data_time_to_str(ftp->date_str, ftp->finfo.fdate, ftp->finfo.ftime)));
+#ifdef FTP_F_EXPAND
+	// contiguous clusters are written without FAT updates, fragmented volume is copied without it
+	FTP_F_EXPAND(dst, cp.size, 1);
+#endif
+	uint32_t chunk = ftp_copy_chunk(fs);
+	DEBUG_PRINT(ftp, "Copying %s to %s in %lu bytes chunks\r\n", src, ftp->path, chunk);
+
+	ftp_result_t res = ftp_send(ftp, "150 Copying %s bytes\r\n", u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, cp.size));
+	FRESULT file_err = FR_OK;
+	bool stopped = false;
+	uint32_t poll_ms = FTP_TIME_MS();
+	while (res == FTP_RES_OK && cp.done < cp.size) {
+		if (ftp_should_stop(ftp)) {
+			stopped = true;
+			break;
+		}
+		if (FTP_TIME_MS() - poll_ms >= FTP_COPY_POLL_MS) {
+			poll_ms = FTP_TIME_MS();
+			if (ftp_copy_poll(ftp, &cp)) {
+				stopped = true;
+				break;
+			}
+		}
+		UINT bytes_read = 0;
+		UINT bytes_written = 0;
+		ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff, chunk);
+		file_err = FTP_F_READ(&ftp->file, ftp->ftp_buff, chunk, &bytes_read);
+		ftp_dcache_invalidate_buff(ftp, ftp->ftp_buff, chunk);
+		if (file_err != FR_OK || bytes_read == 0) {
+			file_err = (file_err != FR_OK) ? file_err : FR_INT_ERR;
+			break;
+		}
+		ftp_dcache_clean(ftp->ftp_buff, bytes_read);
+		file_err = FTP_F_WRITE(dst, ftp->ftp_buff, bytes_read, &bytes_written);
+		if (file_err != FR_OK || bytes_written != bytes_read) {
+			file_err = (file_err != FR_OK) ? file_err : FR_DENIED;
+			break;
+		}
+		cp.done += bytes_read;
+	}
+	FTP_F_CLOSE(&ftp->file);
+	if (FTP_F_CLOSE(dst) != FR_OK && file_err == FR_OK) {
+		file_err = FR_INT_ERR;
 	}
 
-	ftp->finfo.fdate = date;
-	ftp->finfo.ftime = time;
-	if (FTP_F_UTIME(ftp->path, &ftp->finfo) == FR_OK) {
-		return (ftp_send(ftp, "200 Ok\r\n"));
+	bool copied = (res == FTP_RES_OK && !stopped && file_err == FR_OK);
+	if (copied) {
+		ftp->finfo.fdate = fdate;
+		ftp->finfo.ftime = ftime;
+		FTP_F_UTIME(ftp->path, &ftp->finfo);
+		ftp_change(existed ? FTP_CHANGE_MODIFIED : FTP_CHANGE_CREATED, ftp->path, NULL, cp.size);
 	} else {
-		return (ftp_send(ftp, "550 Unable to modify time\r\n"));
+		FTP_F_UNLINK(ftp->path);
+		if (existed) {
+			ftp_change(FTP_CHANGE_DELETED, ftp->path, NULL, 0);
+		}
 	}
-}
+	ftp_unlock(ftp);
+	path_up_a_level(ftp->path);
+	ftp->path_rename[0] = 0;
 
-static ftp_result_t ftp_cmd_size(ftp_data_t *ftp) {
-	if (!FTP_IS_LOGGED_IN(ftp)) {
-		return (FTP_RES_OK);
+	if (copied) {
+		return (ftp_send(ftp, "250 Copied %s bytes\r\n", u64_to_str((char[FTP_U64_STRING_SIZE] ) { 0 }, cp.size)));
 	}
-
-	if (strlen(ftp->parameters) == 0) {
-		return (ftp_send(ftp, "501 No file name\r\n"));
+	if (cp.cancelled) {
+		ftp_send(ftp, "426 Copy aborted\r\n");
+		return (ftp_send(ftp, "226 ABOR command successful\r\n"));
 	}
-	if (!path_build(ftp->path, ftp->parameters)) {
-		return (ftp_send(ftp, "500 Command line too long\r\n"));
+	if (res == FTP_RES_OK && !stopped) {
+		return (ftp_send(ftp, "451 Copy failed: %d\r\n", file_err));
 	}
+	return (FTP_RES_ERROR);
+}
+#endif
 
-	if (FTP_F_STAT(ftp->path, &ftp->finfo) != FR_OK || (ftp->finfo.fattrib & AM_DIR)) {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "550 No such file\r\n"));
-	} else {
-		path_up_a_level(ftp->path);
-		return (ftp_send(ftp, "213 %lu\r\n", ftp->finfo.fsize));
+// SITE RMDIR [-r] <dir> - directory is always removed with its content, like RMDA
+static ftp_result_t ftp_site_rmdir(ftp_data_t *ftp) {
+	if (!strncmp(ftp->parameters, "-r ", 3)) {
+		memmove(ftp->parameters, ftp->parameters + 3, strlen(ftp->parameters + 3) + 1);
 	}
+	return (ftp_cmd_rmda(ftp));
 }
 
+static const ftp_cmd_t ftp_site_commands[] = { //
+		{ "FREE", ftp_site_free }, //
+		{ "MSTAT", ftp_site_mstat }, //
+		{ "RMDIR", ftp_site_rmdir }, //
+#if FTP_SITE_SYNC == 1
+		{ "SYNC", ftp_site_sync }, //
+#endif
+#if FTP_JOURNAL == 1
+		{ "CHANGES", ftp_site_changes }, //
+#endif
+#if FTP_SITE_WATCH == 1
+		{ "WATCH", ftp_site_watch }, //
+#endif
+#if FTP_SITE_COPY == 1
+		{ "CPFR", ftp_site_cpfr }, //
+		{ "CPTO", ftp_site_cpto }, //
+#endif
+		{ NULL, NULL } //
+		};
+
 static ftp_result_t ftp_cmd_site(ftp_data_t *ftp) {
 	if (!FTP_IS_LOGGED_IN(ftp)) {
 		return (FTP_RES_OK);
 	}
 
-	if (!strcmp(ftp->parameters, "FREE")) {
-		FATFS *fs;
-		uint32_t free_clust;
-		FTP_F_GETFREE("0:", &free_clust, &fs);
-		return (ftp_send(ftp, "211 %lu MB free of %lu MB capacity\r\n", free_clust * fs->csize >> 11, (fs->n_fatent - 2) * fs->csize >> 11));
-	} else {
-		return (ftp_send(ftp, "550 Unknown SITE command %s\r\n", ftp->parameters));
+	size_t len = strcspn(ftp->parameters, " ");
+	for (const ftp_cmd_t *site = ftp_site_commands; site->cmd != NULL; site++) {
+		if (strlen(site->cmd) == len && !strncmp(ftp->parameters, site->cmd, len)) {
+			char *args = ftp->parameters + len;
+			args += (*args == ' ');
+			memmove(ftp->parameters, args, strlen(args) + 1);
+			return (site->func(ftp));
+		}
 	}
+	return (ftp_send(ftp, "550 Unknown SITE command %s\r\n", ftp->parameters));
 }
 
 static ftp_result_t ftp_cmd_stat(ftp_data_t *ftp) {
@@ -1226,7 +4088,7 @@ static ftp_result_t ftp_cmd_stat(ftp_data_t *ftp) {
 		return (FTP_RES_OK);
 	}
 	return (ftp_send(ftp, "221 FTP Server status: you will be disconnected after %d minutes of inactivity\r\n",
-			(FTP_SERVER_INACTIVE_CNT * FTP_SERVER_READ_TIMEOUT_MS) / 60000));
+			FTP_SERVER_INACTIVE_TIMEOUT_MS / 60000));
 }
 
 static ftp_result_t ftp_cmd_auth(ftp_data_t *ftp) {
@@ -1271,11 +4133,13 @@ static ftp_cmd_t ftpd_commands[] = { //
 		{ "STOR", ftp_cmd_stor }, //
 		{ "MKD", ftp_cmd_mkd }, //
 		{ "RMD", ftp_cmd_rmd }, //
+		{ "RMDA", ftp_cmd_rmda }, //
 		{ "RNFR", ftp_cmd_rnfr }, //
 		{ "RNTO", ftp_cmd_rnto }, //
 		{ "FEAT", ftp_cmd_feat }, //
 		{ "MDTM", ftp_cmd_mdtm }, //
 		{ "SIZE", ftp_cmd_size }, //
+		{ "REST", ftp_cmd_rest }, //
 		{ "SITE", ftp_cmd_site }, //
 		{ "STAT", ftp_cmd_stat }, //
 		{ "SYST", ftp_cmd_syst }, //
@@ -1291,6 +4155,36 @@ static ftp_cmd_t ftpd_commands[] = { //
 //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// account one command in latency statistics
+static void ftp_stats_op(const char *cmd, bool failed, uint32_t duration_ms) {
+	ftp_op_t op = FTP_OP_OTHER;
+	if (!strcmp(cmd, "LIST") || !strcmp(cmd, "NLST") || !strcmp(cmd, "MLSD")) {
+		op = FTP_OP_LIST;
+	} else if (!strcmp(cmd, "RETR")) {
+		op = FTP_OP_RETR;
+	} else if (!strcmp(cmd, "STOR")) {
+		op = FTP_OP_STOR;
+	} else if (!strcmp(cmd, "SIZE")) {
+		op = FTP_OP_SIZE;
+	}
+	uint8_t bucket = duration_ms ? 32 - __builtin_clz(duration_ms) : 0;
+	if (bucket >= FTP_LATENCY_BUCKETS) {
+		bucket = FTP_LATENCY_BUCKETS - 1;
+	}
+	ftp_stats_lock();
+	ftp_op_stats_t *stats = &FTP.stats.ops[op];
+	stats->count++;
+	if (failed) {
+		stats->failed++;
+	}
+	if (duration_ms > stats->max_ms) {
+		stats->max_ms = duration_ms;
+	}
+	stats->total_ms += duration_ms;
+	stats->histogram[bucket]++;
+	ftp_stats_unlock();
+}
+
 static ftp_result_t ftp_process_command(ftp_data_t *ftp, bool *quit) {
 	if (!strcmp(ftp->command, "QUIT")) {
 		*quit = true;
@@ -1305,9 +4199,31 @@ static ftp_result_t ftp_process_command(ftp_data_t *ftp, bool *quit) {
 	}
 	if (cmd->cmd != NULL && cmd->func != NULL) {
 		FTP_CMD_BEGIN_CALLBACK(cmd->cmd);
+		ftp->bytes_transfered = 0;
+		ftp->transfer_failed = false;
+		ftp->reply_code = 0;
+		uint32_t start_ms = FTP_TIME_MS();
 		ftp_result_t res = cmd->func(ftp);
+		ftp_trace_done(ftp, res, start_ms);
+		// transfer which replied 451/426 keeps session, so failure is taken from reply
+		bool failed = (res != FTP_RES_OK || ftp->transfer_failed || ftp->reply_code >= 400);
+		ftp_stats_op(cmd->cmd, failed, FTP_TIME_MS() - start_ms);
 		FTP_CMD_END_CALLBACK(cmd->cmd);
-		if (res == FTP_RES_OK) {
+		if (!strcmp(cmd->cmd, "RETR") || !strcmp(cmd->cmd, "STOR")) {
+			ftp->restart_offset = 0;
+			ftp_unlock(ftp);
+		}
+		ftp_journal_tick();
+		if (ftp->bytes_transfered) {
+			ftp_stats_lock();
+			if (!strcmp(cmd->cmd, "RETR")) {
+				FTP.stats.bytes_sent += ftp->bytes_transfered;
+			} else {
+				FTP.stats.bytes_received += ftp->bytes_transfered;
+			}
+			ftp_stats_unlock();
+		}
+		if (!failed) {
 			if (!strcmp(cmd->cmd, "RETR")) {
 				ftp_stats_lock();
 				FTP.stats.files_send_successfully++;
@@ -1356,34 +4272,39 @@ static void ftp_service(struct netconn *ctrlcn, ftp_data_t *ftp, bool *stop) {
 	memset(ftp->path_rename, 0, FTP_CWD_SIZE);
 
 	// variables initialization
+	ftp->stop = stop;
 	ftp->ctrlconn = ctrlcn;
 	ftp->listdataconn = NULL;
 	ftp->dataconn = NULL;
 	ftp->data_port = 0;
 	ftp->data_conn_mode = DCM_NOT_SET;
 	ftp->user = FTP_USER_NONE;
+	ftp->restart_offset = 0;
+	ftp->transfer_type = FTP_TYPE_BINARY;
+	ftp->xfer_rate_Bps = 0;
+	ftp_conn_profile(ctrlcn, true);
 
 	// bugfix which works around ports which are already in use (from a previous connection)
 	ftp->data_port_incremented = (ftp->data_port_incremented + 1) % PORT_INCREMENT_OFFSET;
 
 	//  Get the local and peer IP
-	netconn_addr(ftp->ctrlconn, &ftp->ipserver, &dummy);
-	netconn_peer(ftp->ctrlconn, &ippeer, &dummy);
-	// Set disconnection timeout to one second
-	netconn_set_recvtimeout(ftp->ctrlconn, FTP_SERVER_READ_TIMEOUT_MS);
-	netconn_set_sendtimeout(ftp->ctrlconn, FTP_SERVER_WRITE_TIMEOUT_MS);
+	FTP_NETCONN_ADDR(ftp->ctrlconn, &ftp->ipserver, &dummy);
+	FTP_NETCONN_PEER(ftp->ctrlconn, &ippeer, &dummy);
+	// receive timeout is set before every wait for command
+	ftp_trace(ftp, FTP_TRACE_CONNECT, &ippeer.addr, sizeof(ippeer.addr));
 
 	// send welcome message
 	if (ftp_send(ftp, "220 -> CMS FTP Server, FTP Version %s\r\n", FTP_VERSION) == FTP_RES_OK) {
 		DEBUG_PRINT(ftp, "Client connected!\r\n");
 		bool quit = false;
 		while (1) {
-			if (ftp_read_command(ftp, stop) != FTP_RES_OK) {
+			if (ftp_read_command(ftp) != FTP_RES_OK) {
 				break;
 			}
 			if (ftp_parse_command(ftp) != FTP_RES_OK) {
 				break;
 			}
+			ftp_trace_command(ftp);
 			if (ftp_process_command(ftp, &quit) != FTP_RES_OK) {
 				break;
 			}
@@ -1395,6 +4316,8 @@ static void ftp_service(struct netconn *ctrlcn, ftp_data_t *ftp, bool *stop) {
 
 	pasv_con_close(ftp);
 	data_con_close(ftp);
+	ftp_journal_flush();
+	ftp_trace(ftp, FTP_TRACE_DISCONNECT, NULL, 0);
 	DEBUG_PRINT(ftp, "Client disconnected\r\n");
 }
 
@@ -1413,15 +4336,21 @@ static void ftp_task(void *param) {
 			ftp_stats_lock();
 			FTP.stats.clients_connected++;
 			FTP.stats.clients_active++;
+			if (FTP.stats.clients_active > FTP.stats.clients_active_peak) {
+				FTP.stats.clients_active_peak = FTP.stats.clients_active;
+			}
 			ftp_stats_unlock();
 			FTP_CONNECTED_CALLBACK();
 			FTP_LOG_PRINT("FTP %d connected\r\n", ftp->number);
 			ftp_service(ftp->ftp_connection, &ftp->ftp_data, &ftp->stop);
-			if (netconn_delete(ftp->ftp_connection) != ERR_OK) {
+			// connection is deleted under lock, so ftp_stopping() can not wake already deleted one
+			ftp_stats_lock();
+			if (FTP_NETCONN_DELETE(ftp->ftp_connection) != ERR_OK) {
 				FTP_LOG_PRINT("server NETCONN delete error\r\n");
 				ftp_set_error(FTP_ERROR_CLIENT_NETCONN_DELETE);
 			}
 			ftp->ftp_connection = NULL;
+			ftp_stats_unlock();
 			FTP_LOG_PRINT("FTP %d disconnected\r\n", ftp->number);
 			FTP_DISCONNECTED_CALLBACK();
 			ftp_stats_lock();
@@ -1432,7 +4361,7 @@ static void ftp_task(void *param) {
 			ftp_stats_unlock();
 			ftp->busy = false;
 		} else {
-			vTaskDelay(500);
+			FTP_DELAY_MS(500);
 		}
 	}
 }
@@ -1473,21 +4402,21 @@ void ftp_clear_errors(void) {
 }
 
 static struct netconn* ftp_starting(void) {
-	struct netconn *ftp_srv_conn = netconn_new(NETCONN_TCP);
+	struct netconn *ftp_srv_conn = FTP_NETCONN_NEW(NETCONN_TCP);
 	if (ftp_srv_conn == NULL) {
 		FTP_LOG_PRINT("Failed to create socket\r\n");
 		ftp_set_error(FTP_ERROR_SERVER_NETCONN_NEW);
 	} else if (FTP.port == 0) {
 		FTP_LOG_PRINT("Port is 0\r\n");
 		ftp_set_error(FTP_ERROR_PORT_IS_ZERO);
-	} else if (netconn_bind(ftp_srv_conn, NULL, FTP.port) != ERR_OK) {
+	} else if (FTP_NETCONN_BIND(ftp_srv_conn, NULL, FTP.port) != ERR_OK) {
 		FTP_LOG_PRINT("Can not bin to port\r\n");
 		ftp_set_error(FTP_ERROR_BIND_TO_PORT);
-	} else if (netconn_listen(ftp_srv_conn) != ERR_OK) {
+	} else if (FTP_NETCONN_LISTEN(ftp_srv_conn) != ERR_OK) {
 		FTP_LOG_PRINT("Can not listen on this NETCONN\r\n");
 		ftp_set_error(FTP_ERROR_SERVER_NETCONN_LISTEN);
 	} else {
-		netconn_set_recvtimeout(ftp_srv_conn, FTP_PSV_ACCEPT_TIMEOUT_MS);
+		FTP_NETCONN_SET_RECVTIMEOUT(ftp_srv_conn, FTP_PSV_ACCEPT_TIMEOUT_MS);
 		FTP.status = FTP_RUNNING;
 	}
 	return (ftp_srv_conn);
@@ -1495,48 +4424,55 @@ static struct netconn* ftp_starting(void) {
 
 static void ftp_running(struct netconn *ftp_srv_conn) {
 	struct netconn *ftp_client_conn = NULL;
-	if (netconn_accept(ftp_srv_conn, &ftp_client_conn) == ERR_OK) {
+	if (FTP_NETCONN_ACCEPT(ftp_srv_conn, &ftp_client_conn) == ERR_OK) {
 		uint8_t index = 0;
+		ftp_stats_lock();
 		for (index = 0; index < FTP_NBR_CLIENTS; index++) {
 			if (ftp_links[index].ftp_connection == NULL && ftp_links[index].busy == false) {
+				ftp_links[index].stop = false;
+				ftp_links[index].ftp_connection = ftp_client_conn;
 				break;
 			}
 		}
+		ftp_stats_unlock();
 		if (index >= FTP_NBR_CLIENTS) {
+			ftp_stats_lock();
 			FTP.stats.clients_denied++;
+			ftp_stats_unlock();
 			FTP_LOG_PRINT("FTP connection denied, all connections in use\r\n");
-			netconn_set_recvtimeout(ftp_client_conn, FTP_SERVER_READ_TIMEOUT_MS);
-			netconn_set_sendtimeout(ftp_client_conn, FTP_SERVER_WRITE_TIMEOUT_MS);
-			err_t err = netconn_write(ftp_client_conn, no_conn_allowed, strlen(no_conn_allowed));
-			if (err != ERR_OK && err != ERR_TIMEOUT) {
-				FTP_LOG_PRINT("client NETCONN write error\r\n");
-				ftp_set_error(FTP_ERROR_CLIENT_NETCONN_WRITE);
-			}
-			if (netconn_delete(ftp_client_conn) != ERR_OK) {
+			FTP_NETCONN_SET_RECVTIMEOUT(ftp_client_conn, FTP_SERVER_READ_TIMEOUT_MS);
+			// write error is already reported by ftp_netconn_write, timeout is not an error here
+			ftp_netconn_write(ftp_client_conn, no_conn_allowed, strlen(no_conn_allowed), NETCONN_COPY, FTP_SERVER_WRITE_TIMEOUT_MS);
+			if (FTP_NETCONN_DELETE(ftp_client_conn) != ERR_OK) {
 				FTP_LOG_PRINT("client NETCONN delete error\r\n");
 				ftp_set_error(FTP_ERROR_CLIENT_NETCONN_DELETE);
 			}
-			vTaskDelay(500);
-		} else {
-			ftp_links[index].stop = false;
-			ftp_links[index].ftp_connection = ftp_client_conn;
+			FTP_DELAY_MS(500);
 		}
 	}
 }
 
 static void ftp_stopping(struct netconn *ftp_srv_conn) {
-	if (netconn_delete(ftp_srv_conn) != ERR_OK) {
+	if (FTP_NETCONN_DELETE(ftp_srv_conn) != ERR_OK) {
 		FTP_LOG_PRINT("server NETCONN delete error\r\n");
 		ftp_set_error(FTP_ERROR_SERVER_NETCONN_DELETE);
 	}
 	for (uint8_t index = 0; index < FTP_NBR_CLIENTS; ++index) {
 		if (ftp_links[index].busy) {
 			ftp_links[index].stop = true;
+#if FTP_WAKE_ON_STOP == 1
+			// interrupt blocking wait for command
+			ftp_stats_lock();
+			if (ftp_links[index].ftp_connection != NULL) {
+				FTP_NETCONN_SHUTDOWN(ftp_links[index].ftp_connection, 1, 0);
+			}
+			ftp_stats_unlock();
+#endif
 		}
 	}
 	bool all_tasks_disable = false;
 	for (uint8_t cnt = 0; cnt < 6; ++cnt) {
-		vTaskDelay(1000);
+		FTP_DELAY_MS(1000);
 		bool some_task_is_still_running = false;
 		for (uint8_t index = 0; index < FTP_NBR_CLIENTS; ++index) {
 			if (ftp_links[index].busy) {
@@ -1564,9 +4500,11 @@ static void ftp_server(void *argument) {
 	struct netconn *ftp_srv_conn = NULL;
 
 	while (1) {
+		// records of idle sessions and of application are written here
+		ftp_journal_tick();
 		switch (FTP.status) {
 		case FTP_IDLE:
-			vTaskDelay(1000);
+			FTP_DELAY_MS(1000);
 			break;
 		case FTP_STARTING:
 			ftp_srv_conn = ftp_starting();
@@ -1585,15 +4523,30 @@ static void ftp_server(void *argument) {
 			FTP.status = FTP_ERROR;
 			break;
 		case FTP_ERROR:
-			vTaskDelay(1000);
+			FTP_DELAY_MS(1000);
 			break;
 		default:
-			vTaskDelay(1000);
+			FTP_DELAY_MS(1000);
 			break;
 		}
 	}
 }
 
+static SemaphoreHandle_t ftp_mutex_check(SemaphoreHandle_t mutex) {
+	if (mutex == NULL) {
+		FTP_CRITICAL_ERROR_HANDLER();
+	}
+	FTP_MUTEX_POST_INIT_HANDLE(mutex);
+	return (mutex);
+}
+
+// recursive mutex, static one uses <name>_static of ftp_static
+#if FTP_MUTEX_STATIC == 1
+#define ftp_mutex_create(name)		ftp_mutex_check(xSemaphoreCreateRecursiveMutexStatic(&ftp_static.name##_static))
+#else
+#define ftp_mutex_create(name)		ftp_mutex_check(xSemaphoreCreateRecursiveMutex())
+#endif
+
 /**
  * @brief init all tasks
  * call this before kernel start
@@ -1603,16 +4556,23 @@ void ftp_init(void) {
 		FTP.inited = true;
 		FTP.stats.clients_max = FTP_NBR_CLIENTS;
 
-		FTP.stats_mutex = xSemaphoreCreateRecursiveMutex();
-		FTP_MUTEX_POST_INIT_HANDLE(FTP.stats_mutex);
+		FTP.stats_mutex = ftp_mutex_create(stats_mutex);
+#if FTP_CWD_RELATIVE == 1
+		FTP.fs_mutex = ftp_mutex_create(fs_mutex);
+#endif
+#if FTP_JOURNAL == 1
+		FTP.journal_mutex = ftp_mutex_create(journal_mutex);
+#endif
 
 		char name[configMAX_TASK_NAME_LEN + 1] = { 0 };
 		for (uint8_t index = 0; index < FTP_NBR_CLIENTS; ++index) {
 			server_stru_t *data = &ftp_links[index];
 			ftp_links[index].number = index;
+			ftp_links[index].ftp_data.ftp_buff = ftp_buffers[index];
 			snprintf(name, configMAX_TASK_NAME_LEN, "ftp_client_%d", data->number);
 #if FTP_CLIENT_TASK_STATIC == 1
-			data->task_handle = xTaskCreateStatic(ftp_task, name, FTP_TASK_STACK_SIZE, data, FTP_TASK_PRIORITY, data->task_stack, &data->task_static);
+			data->task_handle = xTaskCreateStatic(ftp_task, name, FTP_CLIENT_TASK_STACK_SIZE, data, FTP_CLIENT_TASK_PRIORITY, data->task_stack,
+					&data->task_static);
 			if (data->task_handle == NULL) {
 				FTP_CRITICAL_ERROR_HANDLER();
 			}
@@ -1623,9 +4583,17 @@ void ftp_init(void) {
 #endif
 		}
 
+#if FTP_SERVER_TASK_STATIC == 1
+		FTP.server_task_handle = xTaskCreateStatic(ftp_server, "ftp_server", FTP_SERVER_TASK_STACK_SIZE, NULL, FTP_SERVER_TASK_PRIORITY,
+				ftp_static.server_task_stack, &ftp_static.server_task_static);
+		if (FTP.server_task_handle == NULL) {
+			FTP_CRITICAL_ERROR_HANDLER();
+		}
+#else
 		if (xTaskCreate(ftp_server, "ftp_server", FTP_SERVER_TASK_STACK_SIZE, NULL, FTP_SERVER_TASK_PRIORITY, &FTP.server_task_handle) != pdPASS) {
 			FTP_CRITICAL_ERROR_HANDLER();
 		}
+#endif
 	}
 }
 
@@ -1677,3 +4645,229 @@ uint16_t ftp_get_port(void) {
 const ftp_stats_t* ftp_get_stats(void) {
 	return (&FTP.stats);
 }
+
+/**
+ * @brief clear statistics counters, f.e. before load test,
+ * number of active clients and max clients are kept
+ */
+void ftp_clear_stats(void) {
+	if (!FTP.inited) {
+		return;
+	}
+	ftp_stats_lock();
+	uint8_t active = FTP.stats.clients_active;
+	memset(&FTP.stats, 0, sizeof(FTP.stats));
+	FTP.stats.clients_active = active;
+	FTP.stats.clients_active_peak = active;
+	FTP.stats.clients_max = FTP_NBR_CLIENTS;
+	ftp_stats_unlock();
+}
+
+/**
+ * @brief drop cached data of file or directory tree changed by application,
+ * must be called when files are modified outside FTP while server runs,
+ * NULL drops everything and must be used after volume is mounted again
+ */
+void ftp_invalidate_path(const char *path) {
+	if (!FTP.inited) {
+		return;
+	}
+	ftp_path_changed(path == NULL ? "" : path);
+#if FTP_JOURNAL == 1
+	if (path == NULL) {
+		// journal is found again on mounted volume
+		ftp_stats_lock();
+		ftp_journal.loaded = false;
+		ftp_journal.dirty = false;
+		ftp_stats_unlock();
+	}
+#endif
+}
+
+/**
+ * @brief report file or directory changed by application, so cached data are dropped
+ * and change is recorded in journal
+ * @param change kind of change
+ * @param path changed path, old path for FTP_CHANGE_RENAMED
+ * @param new_path new path for FTP_CHANGE_RENAMED, otherwise NULL
+ * @param size size of file after change, 0 for directory
+ */
+void ftp_notify_change(ftp_change_t change, const char *path, const char *new_path, uint64_t size) {
+	if (!FTP.inited || path == NULL) {
+		return;
+	}
+	ftp_path_changed(path);
+	if (new_path != NULL) {
+		ftp_path_changed(new_path);
+	}
+	ftp_change(change, path, new_path, size);
+}
+
+/**
+ * @brief write records waiting in RAM to change journal, f.e. before power down
+ */
+void ftp_journal_flush(void) {
+#if FTP_JOURNAL == 1
+	if (!FTP.inited) {
+		return;
+	}
+	ftp_journal_lock();
+	ftp_journal_write();
+	ftp_journal_unlock();
+#endif
+}
+
+// write and read back test file with one chunk size, buffer of client 0 is used
+static bool ftp_bench_point(const char *path, uint32_t file_size, ftp_bench_point_t *point) {
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	char *buff = ftp->ftp_buff + point->misaligned;
+	uint32_t done = 0;
+	UINT bytes = 0;
+
+	for (uint32_t i = 0; i < point->chunk_size; i++) {
+		buff[i] = (char) i;
+	}
+	uint32_t start_ms = FTP_TIME_MS();
+	if (FTP_F_OPEN(&ftp->file, path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		return (false);
+	}
+	while (done < file_size) {
+		uint32_t call_ms = FTP_TIME_MS();
+		ftp_dcache_clean(buff, point->chunk_size);
+		if (FTP_F_WRITE(&ftp->file, buff, point->chunk_size, &bytes) != FR_OK || bytes != point->chunk_size) {
+			FTP_F_CLOSE(&ftp->file);
+			return (false);
+		}
+		call_ms = FTP_TIME_MS() - call_ms;
+		if (call_ms > point->write_max_ms) {
+			point->write_max_ms = call_ms;
+		}
+		done += bytes;
+	}
+	if (FTP_F_CLOSE(&ftp->file) != FR_OK) {
+		return (false);
+	}
+	uint32_t elapsed_ms = FTP_TIME_MS() - start_ms;
+	point->write_kBps = done / (elapsed_ms ? elapsed_ms : 1);
+
+	done = 0;
+	start_ms = FTP_TIME_MS();
+	if (FTP_F_OPEN(&ftp->file, path, FA_READ) != FR_OK) {
+		return (false);
+	}
+	while (1) {
+		uint32_t call_ms = FTP_TIME_MS();
+		ftp_dcache_invalidate_buff(ftp, buff, point->chunk_size);
+		if (FTP_F_READ(&ftp->file, buff, point->chunk_size, &bytes) != FR_OK) {
+			FTP_F_CLOSE(&ftp->file);
+			return (false);
+		}
+		ftp_dcache_invalidate_buff(ftp, buff, point->chunk_size);
+		call_ms = FTP_TIME_MS() - call_ms;
+		if (call_ms > point->read_max_ms) {
+			point->read_max_ms = call_ms;
+		}
+		if (bytes == 0) {
+			break;
+		}
+		done += bytes;
+	}
+	FTP_F_CLOSE(&ftp->file);
+	elapsed_ms = FTP_TIME_MS() - start_ms;
+	point->read_kBps = done / (elapsed_ms ? elapsed_ms : 1);
+	return (true);
+}
+
+/**
+ * @brief measure storage throughput through FTP_F_* layer
+ * sweeps chunk sizes from 512 B to FTP_BUF_SIZE, with aligned and misaligned buffer,
+ * and recommends smallest buffer which reaches 90% of best throughput,
+ * FTP server must be stopped, buffer of first client is used
+ * @param path test file, overwritten and deleted at the end
+ * @param file_size size of test file, rounded up to chunk size
+ * @param report measured points and recommendation
+ * @return true if benchmark was done
+ */
+bool ftp_storage_benchmark(const char *path, uint32_t file_size, ftp_bench_report_t *report) {
+	if (path == NULL || report == NULL || file_size == 0 || !FTP.inited || (FTP.status != FTP_IDLE && FTP.status != FTP_ERROR)) {
+		return (false);
+	}
+	// buffer of first client is taken from sessions, server picks links under the same mutex
+	bool links_free = true;
+	ftp_stats_lock();
+	for (uint8_t index = 0; index < FTP_NBR_CLIENTS; index++) {
+		if (ftp_links[index].busy || ftp_links[index].ftp_connection != NULL) {
+			links_free = false;
+		}
+	}
+	ftp_links[0].busy = links_free;
+	ftp_stats_unlock();
+	if (!links_free) {
+		return (false);
+	}
+	memset(report, 0, sizeof(ftp_bench_report_t));
+
+	uint32_t best_kBps = 0;
+	for (uint32_t chunk = 512; chunk <= FTP_BUF_SIZE && report->count < FTP_BENCH_POINTS; chunk <<= 1) {
+		for (uint8_t misaligned = 0; misaligned <= 1 && report->count < FTP_BENCH_POINTS; misaligned++) {
+			if (chunk + misaligned > FTP_BUF_SIZE) {
+				continue;
+			}
+			ftp_bench_point_t *point = &report->points[report->count];
+			point->chunk_size = chunk;
+			point->misaligned = misaligned;
+			if (!ftp_bench_point(path, file_size, point)) {
+				FTP_F_UNLINK(path);
+				ftp_links[0].busy = false;
+				return (false);
+			}
+			FTP_LOG_PRINT("FTP bench %lu B%s: write %lu kB/s (max %lu ms), read %lu kB/s (max %lu ms)\r\n", point->chunk_size,
+					misaligned ? " misaligned" : "", point->write_kBps, point->write_max_ms, point->read_kBps, point->read_max_ms);
+			uint32_t kBps = point->write_kBps < point->read_kBps ? point->write_kBps : point->read_kBps;
+			if (!misaligned && kBps > best_kBps) {
+				best_kBps = kBps;
+			}
+			report->count++;
+		}
+	}
+	FTP_F_UNLINK(path);
+	ftp_links[0].busy = false;
+
+	// smallest aligned chunk within 90% of the best, but not less than TCP_MSS
+	for (uint8_t i = 0; i < report->count; i++) {
+		ftp_bench_point_t *point = &report->points[i];
+		uint32_t kBps = point->write_kBps < point->read_kBps ? point->write_kBps : point->read_kBps;
+		if (!point->misaligned && point->chunk_size >= TCP_MSS && kBps * 10 >= best_kBps * 9) {
+			report->recommended_buf_size = point->chunk_size;
+			break;
+		}
+	}
+	if (report->recommended_buf_size < FTP_BUF_SIZE_MIN) {
+		report->recommended_buf_size = FTP_BUF_SIZE_MIN;
+	}
+	report->recommended_buf_size_mult = report->recommended_buf_size / FTP_BUF_SIZE_MIN;
+	FTP_LOG_PRINT("FTP bench: recommended FTP_BUF_SIZE_MULT %lu\r\n", report->recommended_buf_size_mult);
+	return (true);
+}
+
+/**
+ * @brief get RAM used by FTP server
+ * @return memory budget of current configuration
+ */
+const ftp_mem_report_t* ftp_get_mem_report(void) {
+	return (&ftp_mem_report);
+}
+
+/**
+ * @brief print RAM used by FTP server with FTP_LOG_PRINT
+ */
+void ftp_print_mem_report(void) {
+	FTP_LOG_PRINT("FTP memory, %d clients:\r\n", FTP_NBR_CLIENTS);
+	FTP_LOG_PRINT(" session data:   %lu B (buffer %lu B)\r\n", (unsigned long) ftp_mem_report.session_data, (unsigned long) ftp_mem_report.session_buffer);
+	FTP_LOG_PRINT(" session task:   %lu B\r\n", (unsigned long) ftp_mem_report.session_task);
+	FTP_LOG_PRINT(" session total:  %lu B\r\n", (unsigned long) ftp_mem_report.session_total);
+	FTP_LOG_PRINT(" server task:    %lu B\r\n", (unsigned long) ftp_mem_report.server_task);
+	FTP_LOG_PRINT(" static total:   %lu B\r\n", (unsigned long) ftp_mem_report.static_total);
+	FTP_LOG_PRINT(" heap total:     %lu B\r\n", (unsigned long) ftp_mem_report.heap_total);
+	FTP_LOG_PRINT(" lwip netconns:  %lu\r\n", (unsigned long) ftp_mem_report.lwip_netconns);
+}
@@ -9,6 +9,7 @@
 #define _FTP_SERVER_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "ftp_config.h"
 
 typedef enum {
@@ -26,7 +27,7 @@ typedef enum {
 	FTP_ERROR_BIND_TO_PORT,
 	FTP_ERROR_SERVER_NETCONN_LISTEN,
 	FTP_ERROR_SERVER_NETCONN_DELETE,
-	FTP_ERROR_CLIENT_NETCONN_WRITE,
+	FTP_ERROR_CLIENT_NETCONN_WRITE, // not set anymore, write error ends only session of that client, kept for compatibility
 	FTP_ERROR_CLIENT_NETCONN_DELETE,
 	FTP_ERROR_NOT_ALL_TASK_DISABLED,
 	FTP_ERROR_LISTEN_DATA_NETCONN_NEW,
@@ -40,8 +41,30 @@ typedef enum {
 	FTP_ERROR_DATA_NETCONN_DELETE,
 } ftp_error_t;
 
+// operation classes for latency statistics
+typedef enum {
+	FTP_OP_LIST, // LIST, NLST, MLSD
+	FTP_OP_RETR,
+	FTP_OP_STOR,
+	FTP_OP_SIZE,
+	FTP_OP_OTHER,
+	FTP_OP_CNT
+} ftp_op_t;
+
+// bucket n counts operations which took less than 2^n ms, last bucket counts all longer ones
+#define FTP_LATENCY_BUCKETS 16
+
+typedef struct {
+	uint32_t count;
+	uint32_t failed; // final reply 4xx/5xx or session dropped
+	uint32_t max_ms;
+	uint64_t total_ms;
+	uint32_t histogram[FTP_LATENCY_BUCKETS];
+} ftp_op_stats_t;
+
 typedef struct {
 	uint8_t clients_active;
+	uint8_t clients_active_peak;
 	uint8_t clients_max;
 	uint32_t clients_connected;
 	uint32_t clients_disconnected;
@@ -50,8 +73,97 @@ typedef struct {
 	uint32_t files_send_failed;
 	uint32_t files_received_successfully;
 	uint32_t files_received_failed;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint32_t write_timeouts;
+	// RETR dedup ratio is (retr_storage_bytes + retr_shared_bytes) / retr_storage_bytes
+	uint64_t retr_storage_bytes; // read from storage
+	uint64_t retr_shared_bytes; // taken from shared read window of other session
+	uint32_t path_walks; // FATFS path lookups done by open file cache
+	uint32_t path_walks_avoided; // lookups served from open file cache
+	uint32_t relative_lookups; // FATFS lookups of name in current directory
+	uint32_t dir_scans_avoided; // directory levels which were not scanned thanks to relative lookups
+	uint32_t lock_conflicts; // commands refused with 450 because other session uses the file
+	uint32_t journal_records; // changes recorded to journal
+	uint32_t journal_writes; // sectors written to journal file
+	uint32_t journal_errors; // failed writes and rotations of journal file
+	uint32_t watch_events_lost; // changes dropped because queue of SITE WATCH was full
+	ftp_op_stats_t ops[FTP_OP_CNT];
 } ftp_stats_t;
 
+// kind of change reported by ftp_notify_change(), value is letter used in change journal
+typedef enum {
+	FTP_CHANGE_CREATED = 'C',
+	FTP_CHANGE_MODIFIED = 'M',
+	FTP_CHANGE_DELETED = 'D',
+	FTP_CHANGE_RENAMED = 'R'
+} ftp_change_t;
+
+/**
+ * RAM used by FTP server in bytes, computed at compile time
+ * lwip_netconns is count of netconns which must be available in lwIP pools (MEMP_NUM_NETCONN, MEMP_NUM_TCP_PCB)
+ */
+typedef struct {
+	uint32_t session_data;
+	uint32_t session_buffer;
+	uint32_t session_task;
+	uint32_t session_total;
+	uint32_t server_task;
+	uint32_t static_total;
+	uint32_t heap_total;
+	uint32_t lwip_netconns;
+} ftp_mem_report_t;
+
+/**
+ * Session trace record, written with FTP_TRACE_WRITE when FTP_TRACE_ENABLE is 1
+ * record is ftp_trace_hdr_t followed by len bytes of payload, multi-byte fields in CPU byte order
+ * payload:
+ *  FTP_TRACE_CONNECT - peer IPv4 address (4 bytes)
+ *  FTP_TRACE_COMMAND - command line without CRLF, parameters of PASS are not recorded
+ *  FTP_TRACE_REPLY - reply code (uint16_t)
+ *  FTP_TRACE_DONE - ftp_trace_done_t
+ *  FTP_TRACE_DISCONNECT - none
+ */
+typedef enum {
+	FTP_TRACE_CONNECT,
+	FTP_TRACE_COMMAND,
+	FTP_TRACE_REPLY,
+	FTP_TRACE_DONE,
+	FTP_TRACE_DISCONNECT
+} ftp_trace_type_t;
+
+typedef struct {
+	uint32_t time_ms;
+	uint16_t len;
+	uint8_t type;
+	uint8_t session;
+} ftp_trace_hdr_t;
+
+typedef struct {
+	uint64_t bytes;
+	uint32_t duration_ms;
+	uint32_t result;
+} ftp_trace_done_t;
+
+// storage benchmark, one measured point of chunk size/alignment sweep
+typedef struct {
+	uint32_t chunk_size;
+	uint8_t misaligned; // buffer address is not word aligned
+	uint32_t write_kBps;
+	uint32_t read_kBps;
+	uint32_t write_max_ms; // longest single FTP_F_WRITE call
+	uint32_t read_max_ms; // longest single FTP_F_READ call
+} ftp_bench_point_t;
+
+#define FTP_BENCH_POINTS 32
+
+typedef struct {
+	uint8_t count;
+	ftp_bench_point_t points[FTP_BENCH_POINTS];
+	uint32_t recommended_buf_size;
+	uint32_t recommended_buf_size_mult; // value for FTP_BUF_SIZE_MULT
+} ftp_bench_report_t;
+
 void ftp_set_username(const char *name);
 void ftp_set_password(const char *pass);
 void ftp_set_port(uint16_t port);
@@ -64,5 +176,12 @@ void ftp_start(void);
 void ftp_stop(void);
 void ftp_clear_errors(void);
 const ftp_stats_t* ftp_get_stats(void);
+void ftp_clear_stats(void);
+void ftp_invalidate_path(const char *path);
+void ftp_notify_change(ftp_change_t change, const char *path, const char *new_path, uint64_t size);
+void ftp_journal_flush(void);
+bool ftp_storage_benchmark(const char *path, uint32_t file_size, ftp_bench_report_t *report);
+const ftp_mem_report_t* ftp_get_mem_report(void);
+void ftp_print_mem_report(void);
 
 #endif /* ETH_FTP_FTP_SERVER_H_ */
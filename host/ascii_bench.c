@@ -0,0 +1,189 @@
+/*
+ * ascii_bench.c
+ *
+ * Microbenchmark of TYPE A conversion against TYPE I
+ *
+ * text of given line length is converted in chunks of half of transfer buffer
+ * like in RETR (ascii_lf_to_crlf) and in received segments like in STOR
+ * (ascii_crlf_to_lf), TYPE I is copy of same data, which is upper bound of
+ * what conversion may cost over binary transfer
+ *
+ * scalar is byte loop without word scan, sse2 (x86 hosts only) scans 16 bytes
+ * at once, server uses word scan of ftp_scan2 which runs on Cortex-M too,
+ * so these show how far word scan is from simple loop and from SIMD of host
+ *
+ * usage: ascii_bench [MB]
+ */
+
+#include "../ftp_server.c"
+#include <stdio.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BENCH_CHUNK			(FTP_BUF_SIZE / 2)
+#define BENCH_MIN_NS		200000000ull
+
+static char bench_src[BENCH_CHUNK];
+static char bench_dst[2 * BENCH_CHUNK];
+static volatile uint32_t bench_sink;
+
+static uint64_t bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+// reference, one byte at a time
+static uint32_t scalar_lf_to_crlf(char *last, char *dst, const char *src, uint32_t len) {
+	char *out = dst;
+	char l = *last;
+	for (uint32_t i = 0; i < len; i++) {
+		if (src[i] == '\n' && l != '\r') {
+			*out++ = '\r';
+		}
+		l = *out++ = src[i];
+	}
+	*last = l;
+	return (out - dst);
+}
+
+#if defined(__SSE2__)
+static const char* sse2_scan(const char *p, const char *end, char c) {
+	const __m128i m = _mm_set1_epi8(c);
+	while (p + 16 <= end) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), m));
+		if (mask) {
+			return (p + __builtin_ctz(mask));
+		}
+		p += 16;
+	}
+	while (p < end && *p != c) {
+		p++;
+	}
+	return (p);
+}
+
+// same as ascii_lf_to_crlf with 16 bytes scan
+static uint32_t sse2_lf_to_crlf(char *last, char *dst, const char *src, uint32_t len) {
+	const char *end = src + len;
+	char *out = dst;
+	char l = *last;
+	while (src < end) {
+		const char *lf = sse2_scan(src, end, '\n');
+		uint32_t run = lf - src;
+		if (run) {
+			memcpy(out, src, run);
+			out += run;
+			l = lf[-1];
+		}
+		if (lf == end) {
+			break;
+		}
+		if (l != '\r') {
+			*out++ = '\r';
+		}
+		*out++ = '\n';
+		l = '\n';
+		src = lf + 1;
+	}
+	*last = l;
+	return (out - dst);
+}
+#endif
+
+// text with LF (crlf == false) or CRLF line ends, line_len 0 is data without line ends
+static void bench_fill(uint32_t line_len, bool crlf) {
+	uint32_t col = 0;
+	for (uint32_t i = 0; i < sizeof(bench_src); i++) {
+		if (line_len && col >= line_len) {
+			if (crlf && col == line_len && i + 1 < sizeof(bench_src)) {
+				bench_src[i] = '\r';
+				col++;
+				continue;
+			}
+			bench_src[i] = '\n';
+			col = 0;
+			continue;
+		}
+		bench_src[i] = (char) ('a' + (i * 7) % 26);
+		col++;
+	}
+}
+
+typedef enum {
+	BENCH_COPY,
+	BENCH_SEND,
+	BENCH_SEND_SCALAR,
+	BENCH_SEND_SSE2,
+	BENCH_RECV,
+	BENCH_CNT
+} bench_kind_t;
+
+static const char *bench_names[BENCH_CNT] = { "TYPE I copy", "TYPE A send", "send scalar", "send sse2", "TYPE A recv" };
+
+// return: MB/s of source data
+static double bench_run(bench_kind_t kind, uint64_t total) {
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	uint64_t start = bench_now_ns();
+	uint64_t done = 0;
+	uint64_t ns;
+	do {
+		for (uint64_t i = 0; i < total; i += BENCH_CHUNK) {
+			switch (kind) {
+			case BENCH_COPY:
+				memcpy(bench_dst, bench_src, BENCH_CHUNK);
+				bench_sink += bench_dst[0];
+				break;
+			case BENCH_SEND:
+				bench_sink += ascii_lf_to_crlf(ftp, bench_dst, bench_src, BENCH_CHUNK);
+				break;
+			case BENCH_SEND_SCALAR:
+				bench_sink += scalar_lf_to_crlf(&ftp->ascii_last, bench_dst, bench_src, BENCH_CHUNK);
+				break;
+			case BENCH_SEND_SSE2:
+#if defined(__SSE2__)
+				bench_sink += sse2_lf_to_crlf(&ftp->ascii_last, bench_dst, bench_src, BENCH_CHUNK);
+#endif
+				break;
+			case BENCH_RECV:
+				// received segment is converted in place, so it is copied first like TYPE I
+				memcpy(bench_dst, bench_src, BENCH_CHUNK);
+				bench_sink += ascii_crlf_to_lf(ftp, bench_dst, BENCH_CHUNK);
+				break;
+			default:
+				break;
+			}
+		}
+		done += total;
+		ns = bench_now_ns() - start;
+	} while (ns < BENCH_MIN_NS);
+	return ((double) done / (1 << 20) / (ns / 1e9));
+}
+
+int main(int argc, char **argv) {
+	uint64_t total = (uint64_t) (argc > 1 ? atoi(argv[1]) : 16) << 20;
+	static const uint32_t line_lens[] = { 0, 8, 40, 80, 1000 };
+	printf("chunk %u B, MB/s of file data\n", BENCH_CHUNK);
+	printf("%-6s", "line");
+	for (uint32_t k = 0; k < BENCH_CNT; k++) {
+		printf(" %12s", bench_names[k]);
+	}
+	printf("\n");
+	for (uint32_t l = 0; l < sizeof(line_lens) / sizeof(line_lens[0]); l++) {
+		printf("%-6u", line_lens[l]);
+		for (uint32_t k = 0; k < BENCH_CNT; k++) {
+#if !defined(__SSE2__)
+			if (k == BENCH_SEND_SSE2) {
+				printf(" %12s", "-");
+				continue;
+			}
+#endif
+			bench_fill(line_lens[l], k == BENCH_RECV);
+			printf(" %12.0f", bench_run((bench_kind_t) k, total));
+		}
+		printf("\n");
+	}
+	return (0);
+}
@@ -0,0 +1,148 @@
+/*
+ * client.c
+ *
+ * Minimal blocking FTP client over POSIX sockets, shared by host tools
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "client.h"
+
+uint64_t client_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void client_sleep_until_us(uint64_t t_us) {
+	uint64_t now = client_now_us();
+	if (t_us > now) {
+		usleep((useconds_t) (t_us - now));
+	}
+}
+
+int client_connect(const char *host, const char *port, int timeout_s) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		return (-1);
+	}
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		struct timeval tv = { .tv_sec = timeout_s };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return (fd);
+}
+
+static bool read_line(client_reader_t *r, char *line, size_t size) {
+	size_t n = 0;
+	while (1) {
+		if (r->pos == r->len) {
+			ssize_t got = recv(r->fd, r->buf, sizeof(r->buf), 0);
+			if (got <= 0) {
+				return (false);
+			}
+			r->len = got;
+			r->pos = 0;
+		}
+		char c = r->buf[r->pos++];
+		if (c == '\n') {
+			if (n && line[n - 1] == '\r') {
+				n--;
+			}
+			line[n] = 0;
+			return (true);
+		}
+		if (n < size - 1) {
+			line[n++] = c;
+		}
+	}
+}
+
+uint16_t client_read_reply(client_reader_t *r, char *line, size_t size) {
+	char multi[4] = { 0 };
+	while (read_line(r, line, size)) {
+		bool coded = isdigit((uint8_t) line[0]) && isdigit((uint8_t) line[1]) && isdigit((uint8_t) line[2]);
+		if (!coded) {
+			// continuation line of batch reply
+			continue;
+		}
+		if (line[3] == '-') {
+			if (!multi[0]) {
+				memcpy(multi, line, 3);
+			}
+			continue;
+		}
+		if (multi[0] && strncmp(multi, line, 3)) {
+			continue;
+		}
+		return ((uint16_t) atoi(line));
+	}
+	return (0);
+}
+
+bool client_send_line(int fd, const char *line) {
+	char buf[CLIENT_LINE_SIZE + 2];
+	int len = snprintf(buf, sizeof(buf), "%s\r\n", line);
+	if (len >= (int) sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	return (send(fd, buf, len, MSG_NOSIGNAL) == len);
+}
+
+bool client_pasv_port(const char *reply, char *port, size_t size) {
+	const char *p = strchr(reply, '(');
+	unsigned h[6];
+	if (p == NULL || sscanf(p, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5]) != 6) {
+		return (false);
+	}
+	snprintf(port, size, "%u", (h[4] << 8) | h[5]);
+	return (true);
+}
+
+bool client_cmd_is(const char *line, const char *name) {
+	size_t len = strlen(name);
+	return (!strncasecmp(line, name, len) && (line[len] == 0 || line[len] == ' '));
+}
+
+uint64_t client_transfer(int data_fd, bool upload, uint64_t upload_bytes) {
+	static __thread char buf[16384];
+	uint64_t moved = 0;
+	if (upload) {
+		memset(buf, 'x', sizeof(buf));
+		while (moved < upload_bytes) {
+			size_t len = upload_bytes - moved < sizeof(buf) ? upload_bytes - moved : sizeof(buf);
+			ssize_t sent = send(data_fd, buf, len, MSG_NOSIGNAL);
+			if (sent <= 0) {
+				break;
+			}
+			moved += sent;
+		}
+		shutdown(data_fd, SHUT_WR);
+	}
+	ssize_t got;
+	while ((got = recv(data_fd, buf, sizeof(buf), 0)) > 0) {
+		moved += upload ? 0 : got;
+	}
+	return (moved);
+}
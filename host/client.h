@@ -0,0 +1,44 @@
+/*
+ * client.h
+ *
+ * Minimal blocking FTP client over POSIX sockets, shared by host tools
+ * which run against server on device
+ */
+
+#ifndef HOST_CLIENT_H_
+#define HOST_CLIENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CLIENT_LINE_SIZE		512
+
+typedef struct {
+	int fd;
+	char buf[4096];
+	size_t len;
+	size_t pos;
+} client_reader_t;
+
+uint64_t client_now_us(void);
+void client_sleep_until_us(uint64_t t_us);
+
+// return: socket, -1 when connection failed
+int client_connect(const char *host, const char *port, int timeout_s);
+
+// return: code of final reply, 0 when connection is closed, line holds last line of reply
+uint16_t client_read_reply(client_reader_t *r, char *line, size_t size);
+bool client_send_line(int fd, const char *line);
+
+// port from "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)"
+bool client_pasv_port(const char *reply, char *port, size_t size);
+
+// command name of line matches name, case insensitive
+bool client_cmd_is(const char *line, const char *name);
+
+// upload sends upload_bytes and closes sending side, then data are read to end
+// return: bytes moved in direction of transfer
+uint64_t client_transfer(int data_fd, bool upload, uint64_t upload_bytes);
+
+#endif /* HOST_CLIENT_H_ */
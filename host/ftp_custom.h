@@ -0,0 +1,67 @@
+/*
+ * ftp_custom.h
+ *
+ * Configuration of host build, server runs on simulated netconn and FatFs of sim.h
+ * with virtual time
+ */
+
+#ifndef HOST_FTP_CUSTOM_H_
+#define HOST_FTP_CUSTOM_H_
+
+#include <stdlib.h>
+#include "sim.h"
+
+/* *********** TARGET HAL ************** */
+#define UNUSED(x)							((void) (x))
+#define ALIGN_32BYTES(buf)					buf __attribute__((aligned(32)))
+
+/* *********** DEBUG ************** */
+#define FTP_LOG_PRINT(...)					sim_log(__VA_ARGS__)
+#define FTP_CRITICAL_ERROR_HANDLER()		abort()
+
+/* *********** FATFS ************** */
+#define FTP_CUSTOM_FATFS
+#define FTP_F_STAT(path, fno) 				sim_f_stat(path, fno)
+#define FTP_F_OPENDIR(dp, path) 			sim_f_opendir(dp, path)
+#define FTP_F_CLOSEDIR(dp)					sim_f_closedir(dp)
+#define FTP_F_READDIR(dp, fno) 				sim_f_readdir(dp, fno)
+#define FTP_F_UNLINK(path) 					sim_f_unlink(path)
+#define FTP_F_OPEN(fp, path, mode) 			sim_f_open(fp, path, mode)
+#define FTP_F_SIZE(fp) 						f_size(fp)
+#define FTP_F_LSEEK(fp, ofs) 				sim_f_lseek(fp, ofs)
+#define FTP_F_CLOSE(fp) 					sim_f_close(fp)
+#define FTP_F_WRITE(fp, buff, btw, bw) 		sim_f_write(fp, buff, btw, bw)
+#define FTP_F_READ(fp, buff, btr, br) 		sim_f_read(fp, buff, btr, br)
+#define FTP_F_MKDIR(path) 					sim_f_mkdir(path)
+#define FTP_F_RENAME(path_old, path_new) 	sim_f_rename(path_old, path_new)
+#define FTP_F_UTIME(path, fno) 				sim_f_utime(path, fno)
+#define FTP_F_GETFREE(path, nclst, fatfs) 	sim_f_getfree(path, nclst, fatfs)
+#define FTP_F_CHDIR(path) 					sim_f_chdir(path)
+#define FTP_F_EXPAND(fp, fsz, opt) 			sim_f_expand(fp, fsz, opt)
+
+/* *********** LWIP NETCONN ************** */
+#define FTP_CUSTOM_NETCONN
+#define FTP_NETCONN_NEW(type)							sim_netconn_new(type)
+#define FTP_NETCONN_BIND(conn, addr, port)				sim_netconn_bind(conn, addr, port)
+#define FTP_NETCONN_LISTEN(conn)						sim_netconn_listen(conn)
+#define FTP_NETCONN_ACCEPT(conn, new_conn)				sim_netconn_accept(conn, new_conn)
+#define FTP_NETCONN_CONNECT(conn, addr, port)			sim_netconn_connect(conn, addr, port)
+#define FTP_NETCONN_CLOSE(conn)							sim_netconn_close(conn)
+#define FTP_NETCONN_SHUTDOWN(conn, rx, tx)				sim_netconn_shutdown(conn, rx, tx)
+#define FTP_NETCONN_DELETE(conn)						sim_netconn_delete(conn)
+#define FTP_NETCONN_ADDR(conn, addr, port)				sim_netconn_getaddr(conn, addr, port, 1)
+#define FTP_NETCONN_PEER(conn, addr, port)				sim_netconn_getaddr(conn, addr, port, 0)
+#define FTP_NETCONN_RECV(conn, new_buf)					sim_netconn_recv(conn, new_buf)
+#define FTP_NETCONN_RECV_TCP_PBUF(conn, new_buf)		sim_netconn_recv_tcp_pbuf(conn, new_buf)
+#define FTP_NETCONN_WRITE_PARTLY(conn, data, size, flags, written)	sim_netconn_write_partly(conn, data, size, flags, written)
+#define FTP_NETCONN_SET_RECVTIMEOUT(conn, timeout)		sim_netconn_set_recvtimeout(conn, timeout)
+#define FTP_NETCONN_SET_SENDTIMEOUT(conn, timeout)		sim_netconn_set_sendtimeout(conn, timeout)
+#define FTP_NETBUF_DATA(buf, data, len)					sim_netbuf_data(buf, data, len)
+#define FTP_NETBUF_DELETE(buf)							sim_netbuf_delete(buf)
+#define FTP_PBUF_FREE(p)								sim_pbuf_free(p)
+
+/* *********** TIME ************** */
+#define FTP_DELAY_MS(ms)					sim_delay_ms(ms)
+#define FTP_TIME_MS()						sim_time_ms()
+
+#endif /* HOST_FTP_CUSTOM_H_ */
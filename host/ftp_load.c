@@ -0,0 +1,565 @@
+/*
+ * ftp_load.c
+ *
+ * Load generator for running server
+ *
+ * every worker keeps one session open and sends random mix of LIST, RETR,
+ * STOR and SIZE until end of run, with -n session is closed and opened
+ * again after given number of operations, so login rate is loaded too
+ *
+ * RETR and SIZE use existing file given with -r, STOR writes its own file
+ * per worker (prefix given with -s), transfers use passive mode,
+ * latency of operation is time from command to final reply, same as
+ * operation statistics of server (ftp_stats_get), LOGIN is time from
+ * connect to reply of PASS
+ *
+ * connection which is refused, closed or answered with other than 220
+ * (e.g. 421 when all client slots are used or server is stopped) is counted
+ * as denied, worker tries again after LOAD_DENIED_DELAY_MS, also after failed login
+ *
+ * report holds per operation count, failures by reply code, percentiles
+ * and histogram of latency, denied connections, logins per second and
+ * throughput, -C prints it as CSV with label given by -L, so runs against
+ * different builds can be concatenated and compared
+ *
+ * exit code is 1 when no login succeeded
+ *
+ * usage: ftp_load [options] host [port]
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ftp_server.h"
+#include "client.h"
+
+#define LOAD_WORKERS_MAX		256
+#define LOAD_CODES				16
+#define LOAD_DENIED_DELAY_MS	100
+
+typedef enum {
+	LOAD_LOGIN,
+	LOAD_LIST,
+	LOAD_RETR,
+	LOAD_STOR,
+	LOAD_SIZE,
+	LOAD_OP_CNT
+} load_op_t;
+
+static const char *load_op_names[LOAD_OP_CNT] = { "LOGIN", "LIST", "RETR", "STOR", "SIZE" };
+
+// reply codes and their counts, 0 is closed connection
+typedef struct {
+	uint16_t code[LOAD_CODES];
+	uint32_t count[LOAD_CODES];
+	uint32_t cnt;
+} load_codes_t;
+
+typedef struct {
+	uint32_t *us; // latency of every operation
+	uint32_t cnt;
+	uint32_t cap;
+	uint32_t failed;
+	load_codes_t failures;
+	uint64_t bytes; // moved by successful transfers
+} load_stat_t;
+
+typedef struct {
+	uint32_t id;
+	pthread_t thread;
+	unsigned seed;
+	load_stat_t stats[LOAD_OP_CNT];
+	uint32_t denied;
+	load_codes_t denied_codes;
+	uint32_t dropped; // session closed by server during operation
+} load_worker_t;
+
+static load_worker_t workers[LOAD_WORKERS_MAX];
+
+static uint32_t opt_workers = 4;
+static uint32_t opt_duration_s = 10;
+static uint32_t opt_ops_per_login;
+static uint32_t opt_mix[LOAD_OP_CNT] = { 0, 1, 2, 1, 1 };
+static const char *opt_user = FTP_USER_NAME_DEFAULT;
+static const char *opt_password = FTP_USER_PASS_DEFAULT;
+static const char *opt_retr_file = "load.bin";
+static const char *opt_stor_prefix = "load_";
+static const char *opt_list_dir = "";
+static uint64_t opt_upload_bytes = 65536;
+static int opt_timeout_s = 30;
+static unsigned opt_seed = 1;
+static bool opt_csv;
+static const char *opt_label = "";
+static const char *opt_host;
+static const char *opt_port = "21";
+
+static uint64_t end_us;
+
+// =========================================================
+//
+//                    Statistics
+//
+// =========================================================
+
+static void codes_add(load_codes_t *codes, uint16_t code) {
+	uint32_t i;
+	for (i = 0; i < codes->cnt; i++) {
+		if (codes->code[i] == code) {
+			break;
+		}
+	}
+	if (i == codes->cnt) {
+		if (codes->cnt == LOAD_CODES) {
+			// table is full, rare codes are counted with last one
+			i = LOAD_CODES - 1;
+		} else {
+			codes->code[codes->cnt++] = code;
+		}
+	}
+	codes->count[i]++;
+}
+
+static void codes_merge(load_codes_t *dst, const load_codes_t *src) {
+	for (uint32_t i = 0; i < src->cnt; i++) {
+		for (uint32_t j = 0; j < src->count[i]; j++) {
+			codes_add(dst, src->code[i]);
+		}
+	}
+}
+
+static void stat_add(load_stat_t *st, uint64_t us, bool failed, uint16_t code) {
+	if (st->cnt == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 1024;
+		st->us = realloc(st->us, st->cap * sizeof(uint32_t));
+		if (st->us == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	st->us[st->cnt++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+	if (failed) {
+		st->failed++;
+		codes_add(&st->failures, code);
+	}
+}
+
+// =========================================================
+//
+//                    Workers
+//
+// =========================================================
+
+static bool running(void) {
+	return (client_now_us() < end_us);
+}
+
+static load_op_t op_pick(load_worker_t *w) {
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < LOAD_OP_CNT; i++) {
+		total += opt_mix[i];
+	}
+	uint32_t r = (uint32_t) rand_r(&w->seed) % total;
+	for (uint32_t i = 0; i < LOAD_OP_CNT; i++) {
+		if (r < opt_mix[i]) {
+			return ((load_op_t) i);
+		}
+		r -= opt_mix[i];
+	}
+	return (LOAD_SIZE);
+}
+
+static void denied(load_worker_t *w, uint16_t code) {
+	w->denied++;
+	codes_add(&w->denied_codes, code);
+	client_sleep_until_us(client_now_us() + LOAD_DENIED_DELAY_MS * 1000);
+}
+
+// return: final reply code, 0 when control connection is closed
+static uint16_t op_run(load_worker_t *w, client_reader_t *ctrl, load_op_t op) {
+	char line[CLIENT_LINE_SIZE];
+	char cmd[CLIENT_LINE_SIZE];
+	int data_fd = -1;
+	uint16_t code;
+	if (op != LOAD_SIZE) {
+		if (!client_send_line(ctrl->fd, "PASV")) {
+			return (0);
+		}
+		code = client_read_reply(ctrl, line, sizeof(line));
+		char port[8];
+		if (code != 227 || !client_pasv_port(line, port, sizeof(port))) {
+			stat_add(&w->stats[op], 0, true, code);
+			return (code);
+		}
+		// when connection fails, server answers command after its accept timeout
+		data_fd = client_connect(opt_host, port, opt_timeout_s);
+	}
+	switch (op) {
+	case LOAD_LIST:
+		snprintf(cmd, sizeof(cmd), *opt_list_dir ? "LIST %s" : "LIST", opt_list_dir);
+		break;
+	case LOAD_RETR:
+		snprintf(cmd, sizeof(cmd), "RETR %s", opt_retr_file);
+		break;
+	case LOAD_STOR:
+		snprintf(cmd, sizeof(cmd), "STOR %s%u.bin", opt_stor_prefix, w->id);
+		break;
+	default:
+		snprintf(cmd, sizeof(cmd), "SIZE %s", opt_retr_file);
+		break;
+	}
+	uint64_t start = client_now_us();
+	uint64_t bytes = 0;
+	code = 0;
+	if (client_send_line(ctrl->fd, cmd)) {
+		code = client_read_reply(ctrl, line, sizeof(line));
+		if (code >= 100 && code < 200) {
+			if (data_fd >= 0) {
+				bytes = client_transfer(data_fd, op == LOAD_STOR, opt_upload_bytes);
+			}
+			code = client_read_reply(ctrl, line, sizeof(line));
+		}
+	}
+	if (data_fd >= 0) {
+		close(data_fd);
+	}
+	bool failed = code < 200 || code >= 300;
+	stat_add(&w->stats[op], client_now_us() - start, failed, code);
+	if (!failed) {
+		w->stats[op].bytes += bytes;
+	}
+	return (code);
+}
+
+// one session from connect to QUIT
+static void session_run(load_worker_t *w) {
+	char line[CLIENT_LINE_SIZE];
+	uint64_t start = client_now_us();
+	int fd = client_connect(opt_host, opt_port, opt_timeout_s);
+	if (fd < 0) {
+		denied(w, 0);
+		return;
+	}
+	client_reader_t ctrl = { .fd = fd };
+	uint16_t code = client_read_reply(&ctrl, line, sizeof(line));
+	if (code != 220) {
+		close(fd);
+		denied(w, code);
+		return;
+	}
+	snprintf(line, sizeof(line), "USER %s", opt_user);
+	code = client_send_line(fd, line) ? client_read_reply(&ctrl, line, sizeof(line)) : 0;
+	if (code == 331) {
+		snprintf(line, sizeof(line), "PASS %s", opt_password);
+		code = client_send_line(fd, line) ? client_read_reply(&ctrl, line, sizeof(line)) : 0;
+	}
+	stat_add(&w->stats[LOAD_LOGIN], client_now_us() - start, code != 230, code);
+	if (code != 230) {
+		close(fd);
+		client_sleep_until_us(client_now_us() + LOAD_DENIED_DELAY_MS * 1000);
+		return;
+	}
+	if (client_send_line(fd, "TYPE I")) {
+		client_read_reply(&ctrl, line, sizeof(line));
+	}
+	for (uint32_t ops = 0; running() && (!opt_ops_per_login || ops < opt_ops_per_login); ops++) {
+		if (op_run(w, &ctrl, op_pick(w)) == 0) {
+			w->dropped++;
+			close(fd);
+			return;
+		}
+	}
+	if (client_send_line(fd, "QUIT")) {
+		client_read_reply(&ctrl, line, sizeof(line));
+	}
+	close(fd);
+}
+
+static void* worker_thread(void *arg) {
+	load_worker_t *w = arg;
+	while (running()) {
+		session_run(w);
+	}
+	return (NULL);
+}
+
+// =========================================================
+//
+//                    Report
+//
+// =========================================================
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return ((x > y) - (x < y));
+}
+
+// nearest rank percentile of sorted samples, in ms
+static double percentile_ms(const load_stat_t *st, uint32_t permille) {
+	if (st->cnt == 0) {
+		return (0);
+	}
+	uint64_t rank = ((uint64_t) st->cnt * permille + 999) / 1000;
+	return (st->us[rank ? rank - 1 : 0] / 1000.0);
+}
+
+// buckets of server operation statistics, bucket n counts latency under 2^n ms
+static void histogram(const load_stat_t *st, uint32_t *buckets) {
+	memset(buckets, 0, FTP_LATENCY_BUCKETS * sizeof(uint32_t));
+	for (uint32_t i = 0; i < st->cnt; i++) {
+		uint32_t ms = st->us[i] / 1000;
+		uint32_t bucket = ms ? 32 - __builtin_clz(ms) : 0;
+		buckets[bucket < FTP_LATENCY_BUCKETS ? bucket : FTP_LATENCY_BUCKETS - 1]++;
+	}
+}
+
+static void codes_print(FILE *f, const load_codes_t *codes, const char *sep) {
+	for (uint32_t i = 0; i < codes->cnt; i++) {
+		if (codes->code[i]) {
+			fprintf(f, "%s%u x%u", i ? sep : "", codes->code[i], codes->count[i]);
+		} else {
+			fprintf(f, "%sclosed x%u", i ? sep : "", codes->count[i]);
+		}
+	}
+}
+
+// return: successful logins
+static uint32_t report(uint64_t wall_us) {
+	static load_stat_t total[LOAD_OP_CNT];
+	load_codes_t denied_codes = { 0 };
+	uint32_t denied_cnt = 0;
+	uint32_t dropped = 0;
+	for (uint32_t i = 0; i < opt_workers; i++) {
+		load_worker_t *w = &workers[i];
+		denied_cnt += w->denied;
+		dropped += w->dropped;
+		codes_merge(&denied_codes, &w->denied_codes);
+		for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+			load_stat_t *st = &w->stats[op];
+			for (uint32_t j = 0; j < st->cnt; j++) {
+				stat_add(&total[op], st->us[j], false, 0);
+			}
+			total[op].failed += st->failed;
+			total[op].bytes += st->bytes;
+			codes_merge(&total[op].failures, &st->failures);
+			free(st->us);
+		}
+	}
+	double wall_s = wall_us / 1e6;
+	uint64_t bytes = 0;
+	uint32_t ops = 0;
+	for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+		qsort(total[op].us, total[op].cnt, sizeof(uint32_t), cmp_u32);
+		bytes += total[op].bytes;
+		ops += op == LOAD_LOGIN ? 0 : total[op].cnt;
+	}
+	uint32_t logins = total[LOAD_LOGIN].cnt - total[LOAD_LOGIN].failed;
+	uint32_t buckets[FTP_LATENCY_BUCKETS];
+
+	if (opt_csv) {
+		printf("label,op,count,failed,ops_per_s,p50_ms,p90_ms,p99_ms,max_ms,mean_ms,bytes,bytes_per_s,failures");
+		for (uint32_t b = 0; b < FTP_LATENCY_BUCKETS; b++) {
+			printf(",h%u", b);
+		}
+		printf("\n");
+		for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+			load_stat_t *st = &total[op];
+			uint64_t sum = 0;
+			for (uint32_t j = 0; j < st->cnt; j++) {
+				sum += st->us[j];
+			}
+			printf("%s,%s,%u,%u,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%.0f,", opt_label, load_op_names[op], st->cnt, st->failed,
+					st->cnt / wall_s, percentile_ms(st, 500), percentile_ms(st, 900), percentile_ms(st, 990), percentile_ms(st, 1000),
+					st->cnt ? sum / 1000.0 / st->cnt : 0, (unsigned long long) st->bytes, st->bytes / wall_s);
+			codes_print(stdout, &st->failures, " ");
+			histogram(st, buckets);
+			for (uint32_t b = 0; b < FTP_LATENCY_BUCKETS; b++) {
+				printf(",%u", buckets[b]);
+			}
+			printf("\n");
+		}
+		printf("%s,TOTAL,%u,,%.2f,,,,,,%llu,%.0f,\n", opt_label, ops, ops / wall_s, (unsigned long long) bytes, bytes / wall_s);
+		printf("%s,DENIED,%u,,%.2f,,,,,,,,", opt_label, denied_cnt, denied_cnt / wall_s);
+		codes_print(stdout, &denied_codes, " ");
+		printf("\n%s,DROPPED,%u,,,,,,,,,,\n", opt_label, dropped);
+		return (logins);
+	}
+
+	printf("%s%s%u workers, %.2f s", opt_label, *opt_label ? ": " : "", opt_workers, wall_s);
+	if (opt_ops_per_login) {
+		printf(", login after %u operations", opt_ops_per_login);
+	}
+	printf(", mix");
+	for (uint32_t op = LOAD_LIST; op < LOAD_OP_CNT; op++) {
+		printf(" %s=%u", load_op_names[op], opt_mix[op]);
+	}
+	printf("\nlogins: %u (%.1f/s), denied connections: %u (%.1f/s", logins, logins / wall_s, denied_cnt, denied_cnt / wall_s);
+	if (denied_cnt) {
+		printf(", ");
+		codes_print(stdout, &denied_codes, ", ");
+	}
+	printf("), sessions dropped by server: %u\n", dropped);
+	printf("throughput: %.0f B/s (%llu bytes), operations: %.1f/s\n", bytes / wall_s, (unsigned long long) bytes, ops / wall_s);
+
+	printf("\n%-6s %8s %7s %9s %9s %9s %9s %9s %12s\n", "op", "count", "failed", "ops/s", "p50_ms", "p90_ms", "p99_ms", "max_ms",
+			"bytes");
+	for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+		load_stat_t *st = &total[op];
+		printf("%-6s %8u %7u %9.1f %9.2f %9.2f %9.2f %9.2f %12llu\n", load_op_names[op], st->cnt, st->failed, st->cnt / wall_s,
+				percentile_ms(st, 500), percentile_ms(st, 900), percentile_ms(st, 990), percentile_ms(st, 1000),
+				(unsigned long long) st->bytes);
+	}
+	for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+		if (total[op].failed) {
+			printf("%s failures: ", load_op_names[op]);
+			codes_print(stdout, &total[op].failures, ", ");
+			printf("\n");
+		}
+	}
+
+	printf("\nlatency histogram, column n counts operations under 2^n ms, last one all longer\n%-6s", "op");
+	for (uint32_t b = 0; b < FTP_LATENCY_BUCKETS; b++) {
+		printf(" %6u", b);
+	}
+	printf("\n");
+	for (uint32_t op = 0; op < LOAD_OP_CNT; op++) {
+		histogram(&total[op], buckets);
+		printf("%-6s", load_op_names[op]);
+		for (uint32_t b = 0; b < FTP_LATENCY_BUCKETS; b++) {
+			printf(" %6u", buckets[b]);
+		}
+		printf("\n");
+	}
+	return (logins);
+}
+
+// "list=1,retr=4,stor=1,size=2", operations not given are not sent
+static bool mix_parse(const char *arg) {
+	uint32_t mix[LOAD_OP_CNT] = { 0 };
+	uint32_t total = 0;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%s", arg);
+	for (char *save, *tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '=');
+		if (eq == NULL) {
+			return (false);
+		}
+		*eq = 0;
+		uint32_t op;
+		for (op = LOAD_LIST; op < LOAD_OP_CNT; op++) {
+			if (!strcasecmp(tok, load_op_names[op])) {
+				break;
+			}
+		}
+		if (op == LOAD_OP_CNT) {
+			return (false);
+		}
+		mix[op] = (uint32_t) strtoul(eq + 1, NULL, 10);
+		total += mix[op];
+	}
+	if (total == 0) {
+		return (false);
+	}
+	memcpy(opt_mix, mix, sizeof(mix));
+	return (true);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: ftp_load [options] host [port]\n"
+			"  -c n     concurrent sessions (default 4, max %u)\n"
+			"  -d s     duration of run in seconds (default 10)\n"
+			"  -n n     close session and log in again after n operations (default 0, never)\n"
+			"  -m mix   weights of operations (default list=1,retr=2,stor=1,size=1)\n"
+			"  -r file  existing file for RETR and SIZE (default load.bin)\n"
+			"  -s pfx   prefix of files written by STOR, worker number is appended (default load_)\n"
+			"  -b n     bytes uploaded by STOR (default 65536)\n"
+			"  -l dir   directory listed by LIST (default current)\n"
+			"  -u user  user name (default \"%s\")\n"
+			"  -p pass  password (default \"%s\")\n"
+			"  -t s     timeout of socket operations in seconds (default 30)\n"
+			"  -S seed  seed of operation mix (default 1)\n"
+			"  -C       print report as CSV\n"
+			"  -L text  label of run, e.g. build, first column of CSV\n", LOAD_WORKERS_MAX, FTP_USER_NAME_DEFAULT, FTP_USER_PASS_DEFAULT);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:n:m:r:s:b:l:u:p:t:S:CL:")) != -1) {
+		switch (opt) {
+		case 'c':
+			opt_workers = (uint32_t) atoi(optarg);
+			break;
+		case 'd':
+			opt_duration_s = (uint32_t) atoi(optarg);
+			break;
+		case 'n':
+			opt_ops_per_login = (uint32_t) atoi(optarg);
+			break;
+		case 'm':
+			if (!mix_parse(optarg)) {
+				usage();
+			}
+			break;
+		case 'r':
+			opt_retr_file = optarg;
+			break;
+		case 's':
+			opt_stor_prefix = optarg;
+			break;
+		case 'b':
+			opt_upload_bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			opt_list_dir = optarg;
+			break;
+		case 'u':
+			opt_user = optarg;
+			break;
+		case 'p':
+			opt_password = optarg;
+			break;
+		case 't':
+			opt_timeout_s = atoi(optarg);
+			break;
+		case 'S':
+			opt_seed = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			opt_csv = true;
+			break;
+		case 'L':
+			opt_label = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 1 || opt_workers == 0 || opt_workers > LOAD_WORKERS_MAX) {
+		usage();
+	}
+	opt_host = argv[optind];
+	if (argc - optind > 1) {
+		opt_port = argv[optind + 1];
+	}
+
+	uint64_t start = client_now_us();
+	end_us = start + (uint64_t) opt_duration_s * 1000000;
+	for (uint32_t i = 0; i < opt_workers; i++) {
+		workers[i].id = i;
+		workers[i].seed = opt_seed + i;
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+			perror("pthread_create");
+			return (2);
+		}
+	}
+	for (uint32_t i = 0; i < opt_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	uint32_t logins = report(client_now_us() - start);
+	return (logins ? 0 : 1);
+}
@@ -0,0 +1,431 @@
+/*
+ * ftp_replay.c
+ *
+ * Replay of session trace (FTP_TRACE_ENABLE) against running server
+ *
+ * every recorded session is replayed on its own connection, sessions of one
+ * server slot run one after another, so concurrency of recording is kept,
+ * commands are sent at recorded times or as fast as server answers (-m)
+ *
+ * data transfers use passive mode, PORT/EPRT/EPSV are replaced with PASV,
+ * downloads are read to end, uploads send as many bytes as were recorded,
+ * password is not recorded and is given with -p
+ *
+ * report compares final reply codes and durations of commands with recording,
+ * exit code is 1 when any reply differs
+ *
+ * usage: ftp_replay [-m] [-v] [-p password] [-t timeout_s] trace host [port]
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ftp_server.h"
+#include "client.h"
+
+#define REPLAY_LINE_SIZE		CLIENT_LINE_SIZE
+#define REPLAY_SLOTS			256
+#define REPLAY_CMD_NAMES		64
+
+typedef struct {
+	uint32_t time_ms; // recorded time of command from start of session
+	char line[REPLAY_LINE_SIZE];
+	uint16_t reply; // recorded final reply, 0 when not recorded
+	bool done; // command was dispatched, duration and bytes are recorded
+	bool replaced; // sent as PASV, only class of reply is compared
+	uint64_t bytes;
+	uint32_t duration_ms;
+	uint16_t replay_reply;
+	uint32_t replay_ms;
+	uint64_t replay_bytes;
+} replay_cmd_t;
+
+typedef struct {
+	uint8_t slot;
+	bool partial; // trace starts inside this session
+	uint32_t start_ms;
+	uint32_t end_ms;
+	replay_cmd_t *cmds;
+	uint32_t cmd_cnt;
+	uint32_t cmd_cap;
+	bool denied;
+	bool aborted;
+	uint32_t replay_ms;
+} replay_session_t;
+
+static replay_session_t *sessions;
+static uint32_t session_cnt;
+static uint32_t trace_start_ms;
+
+static bool opt_max_speed;
+static bool opt_verbose;
+static const char *opt_password = FTP_USER_PASS_DEFAULT;
+static int opt_timeout_s = 30;
+static const char *opt_host;
+static const char *opt_port = "21";
+
+static uint64_t replay_start_ms;
+
+static uint64_t now_ms(void) {
+	return (client_now_us() / 1000);
+}
+
+static void sleep_until(uint64_t t_ms) {
+	client_sleep_until_us(t_ms * 1000);
+}
+
+// =========================================================
+//
+//                    Trace
+//
+// =========================================================
+
+static replay_session_t* session_new(uint8_t slot, uint32_t time_ms, bool partial) {
+	replay_session_t *s = realloc(sessions, (session_cnt + 1) * sizeof(replay_session_t));
+	if (s == NULL) {
+		perror("realloc");
+		exit(2);
+	}
+	sessions = s;
+	s = &sessions[session_cnt++];
+	memset(s, 0, sizeof(replay_session_t));
+	s->slot = slot;
+	s->start_ms = time_ms;
+	s->end_ms = time_ms;
+	s->partial = partial;
+	return (s);
+}
+
+static replay_cmd_t* session_cmd_new(replay_session_t *s) {
+	if (s->cmd_cnt == s->cmd_cap) {
+		s->cmd_cap = s->cmd_cap ? s->cmd_cap * 2 : 16;
+		s->cmds = realloc(s->cmds, s->cmd_cap * sizeof(replay_cmd_t));
+		if (s->cmds == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	replay_cmd_t *cmd = &s->cmds[s->cmd_cnt++];
+	memset(cmd, 0, sizeof(replay_cmd_t));
+	return (cmd);
+}
+
+// sessions are kept by index, array is reallocated while trace is read
+static bool trace_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return (false);
+	}
+	int32_t current[REPLAY_SLOTS];
+	for (uint32_t i = 0; i < REPLAY_SLOTS; i++) {
+		current[i] = -1;
+	}
+	bool first = true;
+	ftp_trace_hdr_t hdr;
+	static uint8_t data[65536];
+	while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+		if (hdr.len && fread(data, 1, hdr.len, f) != hdr.len) {
+			fprintf(stderr, "%s: truncated record\n", path);
+			break;
+		}
+		if (first) {
+			trace_start_ms = hdr.time_ms;
+			first = false;
+		}
+		if (hdr.type == FTP_TRACE_CONNECT || current[hdr.session] < 0) {
+			session_new(hdr.session, hdr.time_ms, hdr.type != FTP_TRACE_CONNECT);
+			current[hdr.session] = session_cnt - 1;
+		}
+		replay_session_t *s = &sessions[current[hdr.session]];
+		s->end_ms = hdr.time_ms;
+		replay_cmd_t *last = s->cmd_cnt ? &s->cmds[s->cmd_cnt - 1] : NULL;
+		switch (hdr.type) {
+		case FTP_TRACE_COMMAND: {
+			replay_cmd_t *cmd = session_cmd_new(s);
+			size_t len = hdr.len < REPLAY_LINE_SIZE - 1 ? hdr.len : REPLAY_LINE_SIZE - 1;
+			memcpy(cmd->line, data, len);
+			// command without parameters is recorded with trailing space
+			while (len && cmd->line[len - 1] == ' ') {
+				len--;
+			}
+			cmd->line[len] = 0;
+			cmd->time_ms = hdr.time_ms - s->start_ms;
+			break;
+		}
+		case FTP_TRACE_REPLY: {
+			uint16_t code = 0;
+			memcpy(&code, data, hdr.len < sizeof(code) ? hdr.len : sizeof(code));
+			if (last != NULL && code) {
+				last->reply = code;
+			}
+			break;
+		}
+		case FTP_TRACE_DONE:
+			if (last != NULL && hdr.len >= sizeof(ftp_trace_done_t)) {
+				ftp_trace_done_t done;
+				memcpy(&done, data, sizeof(done));
+				last->done = true;
+				last->bytes = done.bytes;
+				last->duration_ms = done.duration_ms;
+			}
+			break;
+		case FTP_TRACE_DISCONNECT:
+			current[hdr.session] = -1;
+			break;
+		default:
+			break;
+		}
+	}
+	fclose(f);
+	return (true);
+}
+
+// =========================================================
+//
+//                    Replay
+//
+// =========================================================
+
+static void session_replay(replay_session_t *s) {
+	uint64_t start = now_ms();
+	int fd = client_connect(opt_host, opt_port, opt_timeout_s);
+	if (fd < 0) {
+		s->denied = true;
+		return;
+	}
+	client_reader_t ctrl = { .fd = fd };
+	char line[REPLAY_LINE_SIZE];
+	uint16_t code = client_read_reply(&ctrl, line, sizeof(line));
+	if (code != 220) {
+		s->denied = true;
+		close(fd);
+		return;
+	}
+	int data_fd = -1;
+	for (uint32_t i = 0; i < s->cmd_cnt; i++) {
+		replay_cmd_t *cmd = &s->cmds[i];
+		if (!opt_max_speed) {
+			sleep_until(start + cmd->time_ms);
+		}
+		char send_buf[REPLAY_LINE_SIZE];
+		bool pasv = client_cmd_is(cmd->line, "PASV") || client_cmd_is(cmd->line, "PORT") || client_cmd_is(cmd->line, "EPRT") || client_cmd_is(cmd->line, "EPSV");
+		if (client_cmd_is(cmd->line, "PASS")) {
+			snprintf(send_buf, sizeof(send_buf), "PASS %s", opt_password);
+		} else {
+			snprintf(send_buf, sizeof(send_buf), "%s", pasv ? "PASV" : cmd->line);
+		}
+		cmd->replaced = pasv && !client_cmd_is(cmd->line, "PASV");
+		if (pasv && data_fd >= 0) {
+			close(data_fd);
+			data_fd = -1;
+		}
+		uint64_t cmd_start = now_ms();
+		if (!client_send_line(fd, send_buf)) {
+			s->aborted = true;
+			break;
+		}
+		code = client_read_reply(&ctrl, line, sizeof(line));
+		if (pasv && code == 227) {
+			char port[8];
+			if (client_pasv_port(line, port, sizeof(port))) {
+				data_fd = client_connect(opt_host, port, opt_timeout_s);
+			}
+		} else if (code >= 100 && code < 200) {
+			if (data_fd >= 0) {
+				bool upload = client_cmd_is(cmd->line, "STOR") || client_cmd_is(cmd->line, "APPE") || client_cmd_is(cmd->line, "STOU");
+				cmd->replay_bytes = client_transfer(data_fd, upload, cmd->bytes);
+				close(data_fd);
+				data_fd = -1;
+			}
+			code = client_read_reply(&ctrl, line, sizeof(line));
+		} else if (data_fd >= 0 && code >= 400) {
+			// data command failed, passive connection is not used anymore
+			close(data_fd);
+			data_fd = -1;
+		}
+		cmd->replay_reply = code;
+		cmd->replay_ms = (uint32_t) (now_ms() - cmd_start);
+		if (opt_verbose) {
+			printf("[%u] %-30s %3u/%3u %6u/%6u ms\n", s->slot, cmd->line, cmd->reply, code, cmd->duration_ms, cmd->replay_ms);
+		}
+		if (code == 0) {
+			// server closed control connection
+			s->aborted = (i + 1 < s->cmd_cnt);
+			break;
+		}
+	}
+	if (data_fd >= 0) {
+		close(data_fd);
+	}
+	close(fd);
+	s->replay_ms = (uint32_t) (now_ms() - start);
+}
+
+// sessions of one slot in recorded order
+static void* slot_thread(void *arg) {
+	uint8_t slot = (uint8_t) (uintptr_t) arg;
+	for (uint32_t i = 0; i < session_cnt; i++) {
+		replay_session_t *s = &sessions[i];
+		if (s->slot != slot) {
+			continue;
+		}
+		if (!opt_max_speed) {
+			sleep_until(replay_start_ms + (s->start_ms - trace_start_ms));
+		}
+		session_replay(s);
+	}
+	return (NULL);
+}
+
+// =========================================================
+//
+//                    Report
+//
+// =========================================================
+
+typedef struct {
+	char name[8];
+	uint32_t count;
+	uint32_t mismatches;
+	uint64_t recorded_ms;
+	uint64_t replay_ms;
+	uint64_t bytes;
+} replay_stat_t;
+
+static replay_stat_t* stat_find(replay_stat_t *stats, uint32_t *cnt, const char *line) {
+	char name[8];
+	size_t len = strcspn(line, " ");
+	len = len < sizeof(name) - 1 ? len : sizeof(name) - 1;
+	for (size_t i = 0; i < len; i++) {
+		name[i] = toupper((uint8_t) line[i]);
+	}
+	name[len] = 0;
+	for (uint32_t i = 0; i < *cnt; i++) {
+		if (!strcmp(stats[i].name, name)) {
+			return (&stats[i]);
+		}
+	}
+	if (*cnt == REPLAY_CMD_NAMES) {
+		return (&stats[REPLAY_CMD_NAMES - 1]);
+	}
+	replay_stat_t *st = &stats[(*cnt)++];
+	memset(st, 0, sizeof(replay_stat_t));
+	strcpy(st->name, name);
+	return (st);
+}
+
+static uint32_t report(uint64_t wall_ms) {
+	static replay_stat_t stats[REPLAY_CMD_NAMES];
+	uint32_t stat_cnt = 0;
+	uint32_t mismatches = 0;
+	uint32_t denied = 0;
+	uint32_t aborted = 0;
+	uint32_t partial = 0;
+	uint64_t recorded_session_ms = 0;
+	uint64_t replay_session_ms = 0;
+	for (uint32_t i = 0; i < session_cnt; i++) {
+		replay_session_t *s = &sessions[i];
+		denied += s->denied;
+		aborted += s->aborted;
+		partial += s->partial;
+		recorded_session_ms += s->end_ms - s->start_ms;
+		replay_session_ms += s->replay_ms;
+		for (uint32_t j = 0; j < s->cmd_cnt && !s->denied; j++) {
+			replay_cmd_t *cmd = &s->cmds[j];
+			replay_stat_t *st = stat_find(stats, &stat_cnt, cmd->line);
+			st->count++;
+			st->recorded_ms += cmd->duration_ms;
+			st->replay_ms += cmd->replay_ms;
+			st->bytes += cmd->replay_bytes;
+			bool same = cmd->replaced ? (cmd->reply / 100 == cmd->replay_reply / 100) : (cmd->reply == cmd->replay_reply);
+			if (cmd->reply && !same) {
+				st->mismatches++;
+				mismatches++;
+				printf("mismatch: session %u slot %u command %u \"%s\": recorded %u, replay %u\n", i, s->slot, j, cmd->line, cmd->reply,
+						cmd->replay_reply);
+			}
+		}
+	}
+	printf("\nsessions: %u, denied: %u, aborted: %u, started before trace: %u\n", session_cnt, denied, aborted, partial);
+	printf("session time: recorded %llu ms, replay %llu ms, wall time of replay %llu ms (%s)\n", (unsigned long long) recorded_session_ms,
+			(unsigned long long) replay_session_ms, (unsigned long long) wall_ms, opt_max_speed ? "max speed" : "recorded speed");
+	printf("\n%-8s %8s %10s %12s %12s %8s %12s\n", "command", "count", "mismatch", "recorded_ms", "replay_ms", "ratio", "bytes");
+	for (uint32_t i = 0; i < stat_cnt; i++) {
+		replay_stat_t *st = &stats[i];
+		double ratio = st->recorded_ms ? (double) st->replay_ms / st->recorded_ms : 0;
+		printf("%-8s %8u %10u %12llu %12llu %8.2f %12llu\n", st->name, st->count, st->mismatches, (unsigned long long) st->recorded_ms,
+				(unsigned long long) st->replay_ms, ratio, (unsigned long long) st->bytes);
+	}
+	return (mismatches + denied + aborted);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: ftp_replay [-m] [-v] [-p password] [-t timeout_s] trace host [port]\n"
+			"  -m  send commands as fast as server answers, not at recorded times\n"
+			"  -v  print every command\n"
+			"  -p  password sent instead of recorded PASS (default \"%s\")\n"
+			"  -t  timeout of socket operations in seconds (default 30)\n", FTP_USER_PASS_DEFAULT);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "mvp:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			opt_max_speed = true;
+			break;
+		case 'v':
+			opt_verbose = true;
+			break;
+		case 'p':
+			opt_password = optarg;
+			break;
+		case 't':
+			opt_timeout_s = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2) {
+		usage();
+	}
+	opt_host = argv[optind + 1];
+	if (argc - optind > 2) {
+		opt_port = argv[optind + 2];
+	}
+	if (!trace_load(argv[optind])) {
+		return (2);
+	}
+
+	bool used[REPLAY_SLOTS] = { false };
+	pthread_t threads[REPLAY_SLOTS];
+	for (uint32_t i = 0; i < session_cnt; i++) {
+		used[sessions[i].slot] = true;
+	}
+	replay_start_ms = now_ms();
+	for (uint32_t i = 0; i < REPLAY_SLOTS; i++) {
+		if (used[i] && pthread_create(&threads[i], NULL, slot_thread, (void*) (uintptr_t) i) != 0) {
+			perror("pthread_create");
+			return (2);
+		}
+	}
+	for (uint32_t i = 0; i < REPLAY_SLOTS; i++) {
+		if (used[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	uint32_t problems = report(now_ms() - replay_start_ms);
+	for (uint32_t i = 0; i < session_cnt; i++) {
+		free(sessions[i].cmds);
+	}
+	free(sessions);
+	return (problems ? 1 : 0);
+}
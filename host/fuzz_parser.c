@@ -0,0 +1,179 @@
+/*
+ * fuzz_parser.c
+ *
+ * Fuzz target of control connection parsing and command handlers,
+ * storage and netconn are simulated by sim.h
+ *
+ * first byte selects target, ('0' + n) selects target n:
+ *   0 - command line through ftp_parse_command
+ *   1 - lines as parameters of path_build, starting from root
+ *   2 - MDTM parameters through date_time_get
+ *   3 - PORT parameters through port_parse
+ *   4 - lines as commands of logged in session on small simulated volume
+ *
+ * libFuzzer: make fuzz && ./fuzz_parser_libfuzzer corpus
+ * AFL and replay of files: FUZZ_STANDALONE build reads files given as arguments or stdin
+ */
+
+#include "../ftp_server.c"
+#include <stdio.h>
+
+#define FUZZ_SESSION_LINES		64
+
+static ftp_data_t* fuzz_ftp(void) {
+	static bool inited;
+	if (!inited) {
+		inited = true;
+		ftp_init();
+	}
+	return (&ftp_links[0].ftp_data);
+}
+
+// copy of input as string, bounded like parameters received by server
+static void fuzz_string(char *dst, size_t dst_size, const uint8_t *data, size_t size) {
+	size_t len = size < dst_size - 1 ? size : dst_size - 1;
+	memcpy(dst, data, len);
+	dst[len] = 0;
+}
+
+static void fuzz_command(const uint8_t *data, size_t size) {
+	ftp_data_t *ftp = fuzz_ftp();
+	if (size > 0xFFFF) {
+		return;
+	}
+	// payload ends at end of allocation, so any read past it is caught by ASan
+	struct netbuf *buf = calloc(1, sizeof(struct netbuf));
+	struct pbuf *p = malloc(sizeof(struct pbuf) + size);
+	if (buf == NULL || p == NULL) {
+		abort();
+	}
+	p->next = NULL;
+	p->payload = p + 1;
+	memcpy(p->payload, data, size);
+	p->len = p->tot_len = (u16_t) size;
+	buf->p = p;
+	ftp->inbuf = buf;
+	if (ftp_parse_command(ftp) == FTP_RES_OK) {
+		if (strlen(ftp->command) >= FTP_CMD_SIZE || strlen(ftp->parameters) >= FTP_PARAM_SIZE) {
+			abort();
+		}
+	}
+}
+
+static void fuzz_path(const uint8_t *data, size_t size) {
+	char path[FTP_CWD_SIZE] = "/";
+	char param[FTP_PARAM_SIZE];
+	while (size) {
+		const uint8_t *eol = memchr(data, '\n', size);
+		size_t len = eol ? (size_t) (eol - data) : size;
+		fuzz_string(param, sizeof(param), data, len);
+		path_build(path, param);
+		if (strlen(path) >= FTP_CWD_SIZE || path[0] != '/') {
+			abort();
+		}
+		len += (eol != NULL);
+		data += len;
+		size -= len;
+	}
+}
+
+static void fuzz_date(const uint8_t *data, size_t size) {
+	char param[FTP_PARAM_SIZE];
+	uint16_t date = 0;
+	uint16_t time = 0;
+	fuzz_string(param, sizeof(param), data, size);
+	if (date_time_get(param, &date, &time) && (date >> 9) > 2107 - 1980) {
+		abort();
+	}
+}
+
+static void fuzz_port(const uint8_t *data, size_t size) {
+	char param[FTP_PARAM_SIZE];
+	uint8_t ip[4];
+	uint16_t port;
+	fuzz_string(param, sizeof(param), data, size);
+	port_parse(param, ip, &port);
+}
+
+static void fuzz_session(const uint8_t *data, size_t size) {
+	static const char *login[] = { "USER " FTP_USER_NAME_DEFAULT, "PASS " FTP_USER_PASS_DEFAULT };
+	static char lines[FUZZ_SESSION_LINES][FTP_PARAM_SIZE + FTP_CMD_SIZE + 1];
+	const char *script[2 + FUZZ_SESSION_LINES + 1];
+	ftp_data_t *ftp = fuzz_ftp();
+	uint32_t n = 0;
+	script[n++] = login[0];
+	script[n++] = login[1];
+	for (uint32_t i = 0; size && i < FUZZ_SESSION_LINES; i++) {
+		const uint8_t *eol = memchr(data, '\n', size);
+		size_t len = eol ? (size_t) (eol - data) : size;
+		fuzz_string(lines[i], sizeof(lines[i]), data, len);
+		script[n++] = lines[i];
+		len += (eol != NULL);
+		data += len;
+		size -= len;
+	}
+	script[n] = NULL;
+
+	sim_reset();
+	ftp_invalidate_path(NULL);
+	FTP.status = FTP_IDLE;
+	sim_dir_create("/dir");
+	sim_file_create("/a.bin", NULL, 3000);
+	sim_file_create("/dir/c.txt", "hello\r\nworld\n", 13);
+	static const uint8_t upload[] = "uploaded\r\nby fuzzer\n";
+	sim_client_t client = { .script = script, .upload = upload, .upload_len = sizeof(upload) - 1 };
+	bool stop = false;
+	struct netconn *conn = sim_client_connect(&client);
+	ftp_service(conn, ftp, &stop);
+	sim_netconn_delete(conn);
+	ftp_unlock(ftp);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size == 0) {
+		return (0);
+	}
+	switch ((uint8_t) (data[0] - '0') % 5) {
+	case 0:
+		fuzz_command(data + 1, size - 1);
+		break;
+	case 1:
+		fuzz_path(data + 1, size - 1);
+		break;
+	case 2:
+		fuzz_date(data + 1, size - 1);
+		break;
+	case 3:
+		fuzz_port(data + 1, size - 1);
+		break;
+	default:
+		fuzz_session(data + 1, size - 1);
+		break;
+	}
+	return (0);
+}
+
+#ifdef FUZZ_STANDALONE
+static int fuzz_file(FILE *f) {
+	static uint8_t data[1 << 20];
+	size_t size = fread(data, 1, sizeof(data), f);
+	return (LLVMFuzzerTestOneInput(data, size));
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		return (fuzz_file(stdin));
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			return (1);
+		}
+		fuzz_file(f);
+		fclose(f);
+	}
+	printf("%d inputs ok\n", argc - 1);
+	return (0);
+}
+#endif
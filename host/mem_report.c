@@ -0,0 +1,67 @@
+/*
+ * mem_report.c
+ *
+ * RAM budget of configuration, server is built with options given on
+ * command line of compiler (make mem_report MEM_CONFIG="-DFTP_NBR_CLIENTS=2 ...")
+ * and ftp_get_mem_report is printed, so configurations can be compared
+ * without building firmware
+ *
+ * sizes are of host build: pointers and alignment of PC make structures
+ * bigger than on 32-bit target, buffers, stacks and counts of netconns
+ * are same as on target
+ *
+ * -C prints CSV line with label given by -L, so reports of more
+ * configurations can be concatenated
+ *
+ * usage: mem_report [-C] [-L label]
+ */
+
+#include "../ftp_server.c"
+#include <stdio.h>
+#include <unistd.h>
+
+static void mem_report_print(const ftp_mem_report_t *r) {
+	printf("FTP memory, %d clients, buffer %d B, stack %d words:\n", FTP_NBR_CLIENTS, FTP_BUF_SIZE, FTP_CLIENT_TASK_STACK_SIZE);
+	printf(" session data:   %8lu B (buffer %lu B)\n", (unsigned long) r->session_data, (unsigned long) r->session_buffer);
+	printf(" session task:   %8lu B\n", (unsigned long) r->session_task);
+	printf(" session total:  %8lu B\n", (unsigned long) r->session_total);
+	printf(" server task:    %8lu B\n", (unsigned long) r->server_task);
+	printf(" static total:   %8lu B\n", (unsigned long) r->static_total);
+	printf(" heap total:     %8lu B\n", (unsigned long) r->heap_total);
+	printf(" RAM total:      %8lu B\n", (unsigned long) r->static_total + r->heap_total);
+	printf(" lwip netconns:  %8lu\n", (unsigned long) r->lwip_netconns);
+}
+
+static void mem_report_csv(const ftp_mem_report_t *r, const char *label) {
+	printf("label,clients,session_data,session_buffer,session_task,session_total,server_task,static_total,heap_total,lwip_netconns\n");
+	printf("%s,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", label, FTP_NBR_CLIENTS, (unsigned long) r->session_data,
+			(unsigned long) r->session_buffer, (unsigned long) r->session_task, (unsigned long) r->session_total,
+			(unsigned long) r->server_task, (unsigned long) r->static_total, (unsigned long) r->heap_total,
+			(unsigned long) r->lwip_netconns);
+}
+
+int main(int argc, char **argv) {
+	bool csv = false;
+	const char *label = "build";
+	int opt;
+	while ((opt = getopt(argc, argv, "CL:")) != -1) {
+		switch (opt) {
+		case 'C':
+			csv = true;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-C] [-L label]\n", argv[0]);
+			return (2);
+		}
+	}
+	const ftp_mem_report_t *r = ftp_get_mem_report();
+	if (csv) {
+		mem_report_csv(r, label);
+	} else {
+		mem_report_print(r);
+	}
+	return (0);
+}
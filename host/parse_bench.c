@@ -0,0 +1,134 @@
+/*
+ * parse_bench.c
+ *
+ * Parse rate of control connection commands, word scan against byte loop
+ *
+ * mix of command lines of typical session (login, PASV, transfers with
+ * long paths, listing) is parsed by ftp_parse_command_check, which finds
+ * end of line with word scan of ftp_scan2, and by same parser with byte
+ * loop, every line is checked to give same command and parameters
+ *
+ * usage: parse_bench [lines in millions]
+ */
+
+#include "../ftp_server.c"
+#include <stdio.h>
+#include <time.h>
+
+static const char *const bench_lines[] = {
+	"USER anonymous\r\n",
+	"PASS guest@example.com\r\n",
+	"SYST\r\n",
+	"FEAT\r\n",
+	"PWD\r\n",
+	"TYPE I\r\n",
+	"CWD /sd/logs/2020/08\r\n",
+	"PASV\r\n",
+	"MLSD\r\n",
+	"SIZE measurement_2020-08-20_12-00-00.csv\r\n",
+	"MDTM measurement_2020-08-20_12-00-00.csv\r\n",
+	"PASV\r\n",
+	"RETR measurement_2020-08-20_12-00-00.csv\r\n",
+	"REST 1048576\r\n",
+	"PASV\r\n",
+	"STOR /sd/firmware/update_package_v2.3.1_release_candidate.bin\r\n",
+	"RNFR /sd/firmware/update_package_v2.3.1_release_candidate.bin\r\n",
+	"RNTO /sd/firmware/update.bin\r\n",
+	"SITE MSTAT config.ini network.ini calibration/sensor_table_0001.dat\r\n",
+	"NOOP\r\n",
+	"QUIT\r\n",
+};
+
+#define BENCH_LINE_CNT		(sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+static struct pbuf bench_pbufs[BENCH_LINE_CNT];
+static struct netbuf bench_bufs[BENCH_LINE_CNT];
+static volatile uint32_t bench_sink;
+
+static uint64_t bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+// ftp_parse_command_check with end of line found one byte at a time
+static int scalar_parse_command_check(ftp_data_t *ftp) {
+	char *pbuf;
+	uint16_t buflen;
+
+	ftp->command[0] = 0;
+	ftp->parameters[0] = 0;
+	FTP_NETBUF_DATA(ftp->inbuf, (void**) &pbuf, &buflen);
+	const char *end = pbuf + buflen;
+	const char *eol = pbuf;
+	while (eol < end && *eol != '\r' && *eol != '\n') {
+		eol++;
+	}
+	const char *p = pbuf;
+	uint8_t i = 0;
+	while (p < eol && i < (FTP_CMD_SIZE - 1) && FTP_IS_ALPHA(*p)) {
+		ftp->command[i++] = *p++ & ~0x20;
+	}
+	ftp->command[i] = 0;
+	if (p < eol && FTP_IS_ALPHA(*p)) {
+		ftp->command[0] = 0;
+		return (0);
+	}
+	if (p >= eol || *p != ' ') {
+		return (0);
+	}
+	while (p < eol && *p == ' ') {
+		p++;
+	}
+	int ret = eol - p;
+	if (ret + 1 >= FTP_PARAM_SIZE) {
+		return (-1);
+	}
+	memcpy(ftp->parameters, p, ret);
+	ftp->parameters[ret] = 0;
+	return (ret);
+}
+
+// return: ns per line
+static double bench_run(int (*parse)(ftp_data_t*), uint64_t lines) {
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	uint64_t start = bench_now_ns();
+	for (uint64_t n = 0; n < lines; n += BENCH_LINE_CNT) {
+		for (uint32_t i = 0; i < BENCH_LINE_CNT; i++) {
+			ftp->inbuf = &bench_bufs[i];
+			bench_sink += parse(ftp);
+		}
+	}
+	return ((double) (bench_now_ns() - start) / lines);
+}
+
+int main(int argc, char **argv) {
+	uint64_t lines = (uint64_t) (argc > 1 ? atoi(argv[1]) : 20) * 1000000;
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	uint32_t bytes = 0;
+	for (uint32_t i = 0; i < BENCH_LINE_CNT; i++) {
+		bench_pbufs[i].payload = (void*) bench_lines[i];
+		bench_pbufs[i].len = bench_pbufs[i].tot_len = (u16_t) strlen(bench_lines[i]);
+		bench_bufs[i].p = &bench_pbufs[i];
+		bytes += bench_pbufs[i].len;
+
+		// both parsers must agree
+		char command[FTP_CMD_SIZE];
+		ftp->inbuf = &bench_bufs[i];
+		int ret = scalar_parse_command_check(ftp);
+		strcpy(command, ftp->command);
+		char parameters[FTP_PARAM_SIZE];
+		strcpy(parameters, ftp->parameters);
+		if (ftp_parse_command_check(ftp) != ret || strcmp(command, ftp->command) || strcmp(parameters, ftp->parameters)) {
+			printf("parsers differ on: %s", bench_lines[i]);
+			return (1);
+		}
+	}
+	printf("%u command lines, %.1f B per line\n", (unsigned) BENCH_LINE_CNT, (double) bytes / BENCH_LINE_CNT);
+	double scalar_ns = bench_run(scalar_parse_command_check, lines);
+	double swar_ns = bench_run(ftp_parse_command_check, lines);
+	printf("%-8s %10s %12s\n", "scan", "ns/line", "Mlines/s");
+	printf("%-8s %10.1f %12.2f\n", "byte", scalar_ns, 1000 / scalar_ns);
+	printf("%-8s %10.1f %12.2f\n", "word", swar_ns, 1000 / swar_ns);
+	return (0);
+}
@@ -0,0 +1,985 @@
+/*
+ * sim.c
+ *
+ * Deterministic simulation of lwIP netconn and FatFs for host tests
+ */
+
+#include "sim.h"
+#include "lwip.h"
+#include "semphr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define SIM_NODES					128
+#define SIM_PATH_SIZE				(_MAX_LFN + 8)
+#define SIM_CLUSTER_SECTORS			8
+#define SIM_FREE_CLUSTERS			65536
+#define SIM_MUTEXES					4
+#define SIM_DATA_MAX				(64 * 1024 * 1024) // file data kept in memory, rest of bigger file is sparse
+
+typedef enum {
+	SIM_CONN_CTRL,
+	SIM_CONN_LISTEN,
+	SIM_CONN_DATA
+} sim_conn_kind_t;
+
+struct sim_conn {
+	sim_conn_kind_t kind;
+	uint32_t recv_timeout_ms;
+	uint32_t send_timeout_ms;
+	uint32_t wait_left_ms; // time client still needs before its next data is ready
+	uint32_t script_pos;
+	uint32_t upload_pos;
+	uint8_t *rx; // data received by client
+	uint32_t rx_len;
+	uint32_t rx_cap;
+};
+
+typedef struct {
+	bool used;
+	bool dir;
+	char path[SIM_PATH_SIZE];
+	uint8_t *data; // first data_len bytes, following bytes up to size are sim_pattern() of offset
+	uint32_t data_len;
+	uint64_t size;
+	WORD fdate;
+	WORD ftime;
+	BYTE attr;
+} sim_node_t;
+
+sim_op_cfg_t sim_ops[SIM_OP_CNT];
+const ip_addr_t ip_addr_any = { 0 };
+
+static uint32_t sim_now_ms;
+static sim_node_t sim_nodes[SIM_NODES];
+static FATFS sim_fatfs = { .csize = SIM_CLUSTER_SECTORS, .n_fatent = SIM_FREE_CLUSTERS + 2 };
+static sim_client_t sim_client;
+static char *sim_reply_text;
+static uint32_t sim_reply_len;
+static uint8_t *sim_last_download;
+static uint32_t sim_last_download_len;
+static uint32_t sim_data_conn_cnt;
+static char sim_cwd[SIM_PATH_SIZE] = "/";
+static uint32_t sim_dir_scan_cnt;
+
+// =========================================================
+//
+//                    Virtual time
+//
+// =========================================================
+
+static void sim_advance(uint32_t ms) {
+	sim_now_ms += ms;
+}
+
+uint32_t sim_time_ms(void) {
+	return (sim_now_ms);
+}
+
+void sim_delay_ms(uint32_t ms) {
+	sim_advance(ms ? ms : 1);
+}
+
+// count call and return error when this call fails, 0 otherwise
+static int sim_op_fail(sim_op_t op) {
+	sim_op_cfg_t *cfg = &sim_ops[op];
+	cfg->calls++;
+	if (cfg->fail_at && cfg->calls >= cfg->fail_at && (cfg->fail_count == 0 || cfg->calls < cfg->fail_at + cfg->fail_count)) {
+		return (cfg->fail_err);
+	}
+	return (0);
+}
+
+// spend latency of call, return error when this call fails
+static int sim_op(sim_op_t op) {
+	sim_advance(sim_ops[op].latency_ms);
+	return (sim_op_fail(op));
+}
+
+// bytes moved by one call
+static uint32_t sim_op_len(sim_op_t op, uint32_t len) {
+	uint32_t short_len = sim_ops[op].short_len;
+	return ((short_len && len > short_len) ? short_len : len);
+}
+
+// virtual time of moving len bytes
+static uint32_t sim_op_time(sim_op_t op, uint32_t len) {
+	uint32_t bw = sim_ops[op].bytes_per_ms;
+	return (bw ? (len + bw - 1) / bw : 0);
+}
+
+void sim_reset(void) {
+	for (uint32_t i = 0; i < SIM_NODES; i++) {
+		free(sim_nodes[i].data);
+	}
+	memset(sim_nodes, 0, sizeof(sim_nodes));
+	memset(sim_ops, 0, sizeof(sim_ops));
+	free(sim_reply_text);
+	sim_reply_text = NULL;
+	sim_reply_len = 0;
+	free(sim_last_download);
+	sim_last_download = NULL;
+	sim_last_download_len = 0;
+	sim_data_conn_cnt = 0;
+	strcpy(sim_cwd, "/");
+	sim_dir_scan_cnt = 0;
+	sim_now_ms = 0;
+}
+
+void sim_log(const char *fmt, ...) {
+	if (getenv("SIM_LOG") == NULL) {
+		return;
+	}
+	va_list args;
+	va_start(args, fmt);
+	printf("%8u ", (unsigned) sim_now_ms);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+// =========================================================
+//
+//                    FreeRTOS
+//
+// =========================================================
+
+void vTaskDelay(TickType_t ticks) {
+	sim_delay_ms(ticks);
+}
+
+TickType_t xTaskGetTickCount(void) {
+	return (sim_now_ms);
+}
+
+// sessions are run by test directly, tasks are never started
+BaseType_t xTaskCreate(void (*task)(void*), const char *name, uint32_t stack, void *param, UBaseType_t priority, TaskHandle_t *handle) {
+	(void) task;
+	(void) name;
+	(void) stack;
+	(void) param;
+	(void) priority;
+	*handle = NULL;
+	return (pdPASS);
+}
+
+TaskHandle_t xTaskCreateStatic(void (*task)(void*), const char *name, uint32_t stack, void *param, UBaseType_t priority, StackType_t *stack_buffer,
+		StaticTask_t *task_buffer) {
+	(void) task;
+	(void) name;
+	(void) stack;
+	(void) param;
+	(void) priority;
+	(void) stack_buffer;
+	return ((TaskHandle_t) task_buffer);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t *buffer) {
+	buffer->depth = 0;
+	return (buffer);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+	static host_mutex_t mutexes[SIM_MUTEXES];
+	static uint32_t count;
+	return (count < SIM_MUTEXES ? xSemaphoreCreateRecursiveMutexStatic(&mutexes[count++]) : NULL);
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t timeout) {
+	(void) timeout;
+	mutex->depth++;
+	return (pdTRUE);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex) {
+	if (mutex->depth == 0) {
+		return (pdFALSE);
+	}
+	mutex->depth--;
+	return (pdTRUE);
+}
+
+// =========================================================
+//
+//                    Volume
+//
+// =========================================================
+
+uint8_t sim_pattern(uint64_t offset) {
+	return ((uint8_t) ((offset * 7) ^ (offset >> 8)));
+}
+
+static sim_node_t* sim_node_find(const char *path) {
+	for (uint32_t i = 0; i < SIM_NODES; i++) {
+		if (sim_nodes[i].used && !strcmp(sim_nodes[i].path, path)) {
+			return (&sim_nodes[i]);
+		}
+	}
+	return (NULL);
+}
+
+// return: true, if directory in parent of path exists
+static bool sim_parent_exists(const char *path) {
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return (false);
+	}
+	if (slash == path) {
+		return (true);
+	}
+	char parent[SIM_PATH_SIZE];
+	size_t len = slash - path;
+	memcpy(parent, path, len);
+	parent[len] = 0;
+	sim_node_t *node = sim_node_find(parent);
+	return (node != NULL && node->dir);
+}
+
+// return: true, if path is directly in directory dir
+static bool sim_is_child(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+	if (len == 1 && dir[0] == '/') {
+		len = 0;
+	} else if (strncmp(path, dir, len)) {
+		return (false);
+	}
+	return (path[len] == '/' && path[len + 1] != 0 && strchr(path + len + 1, '/') == NULL);
+}
+
+static sim_node_t* sim_node_new(const char *path, bool dir) {
+	if (strlen(path) >= SIM_PATH_SIZE || path[0] != '/' || !sim_parent_exists(path) || sim_node_find(path) != NULL) {
+		return (NULL);
+	}
+	for (uint32_t i = 0; i < SIM_NODES; i++) {
+		sim_node_t *node = &sim_nodes[i];
+		if (!node->used) {
+			memset(node, 0, sizeof(sim_node_t));
+			node->used = true;
+			node->dir = dir;
+			strcpy(node->path, path);
+			node->attr = dir ? AM_DIR : AM_ARC;
+			// 2020-08-20 12:00:00
+			node->fdate = ((2020 - 1980) << 9) | (8 << 5) | 20;
+			node->ftime = 12 << 11;
+			return (node);
+		}
+	}
+	return (NULL);
+}
+
+// keep first len bytes in memory, sparse part is filled with pattern, bytes after end with zeros
+static bool sim_node_materialize(sim_node_t *node, uint64_t len) {
+	if (len <= node->data_len) {
+		return (true);
+	}
+	if (len > SIM_DATA_MAX) {
+		return (false);
+	}
+	uint8_t *data = realloc(node->data, len);
+	if (data == NULL) {
+		return (false);
+	}
+	for (uint32_t i = node->data_len; i < len; i++) {
+		data[i] = (i < node->size) ? sim_pattern(i) : 0;
+	}
+	node->data = data;
+	node->data_len = (uint32_t) len;
+	return (true);
+}
+
+// file grows with zeros like on FatFs
+static bool sim_node_resize(sim_node_t *node, uint64_t size) {
+	if (size > node->size && !sim_node_materialize(node, size)) {
+		return (false);
+	}
+	if (size < node->data_len) {
+		node->data_len = (uint32_t) size;
+	}
+	node->size = size;
+	return (true);
+}
+
+bool sim_file_create(const char *path, const void *data, uint64_t size) {
+	sim_node_t *node = sim_node_new(path, false);
+	if (node == NULL || (data != NULL && size > SIM_DATA_MAX)) {
+		return (false);
+	}
+	node->size = size;
+	if (data != NULL) {
+		if (!sim_node_materialize(node, size)) {
+			return (false);
+		}
+		memcpy(node->data, data, size);
+	}
+	return (true);
+}
+
+bool sim_dir_create(const char *path) {
+	return (sim_node_new(path, true) != NULL);
+}
+
+const uint8_t* sim_file_data(const char *path, uint64_t *size) {
+	sim_node_t *node = sim_node_find(path);
+	if (node == NULL || node->dir || !sim_node_materialize(node, node->size)) {
+		return (NULL);
+	}
+	*size = node->size;
+	return (node->data);
+}
+
+bool sim_exists(const char *path) {
+	return (sim_node_find(path) != NULL);
+}
+
+uint32_t sim_dir_scans(void) {
+	return (sim_dir_scan_cnt);
+}
+
+// Absolute path of name given to lookup, relative one is taken from current directory,
+// every component costs one scan of directory
+static const char* sim_lookup(const char *path, char *buf) {
+	if (path[0] != '/' && snprintf(buf, SIM_PATH_SIZE, "%s%s%s", sim_cwd, strcmp(sim_cwd, "/") ? "/" : "", path) < SIM_PATH_SIZE) {
+		path = buf;
+		sim_dir_scan_cnt++;
+		for (const char *p = path + strlen(sim_cwd) + 1; *p; p++) {
+			sim_dir_scan_cnt += (*p == '/');
+		}
+		return (path);
+	}
+	for (const char *p = path; *p; p++) {
+		sim_dir_scan_cnt += (*p == '/' && p[1] != 0);
+	}
+	return (path);
+}
+
+static void sim_fill_info(const sim_node_t *node, FILINFO *fno) {
+	fno->fsize = node->size;
+	fno->fdate = node->fdate;
+	fno->ftime = node->ftime;
+	fno->fattrib = node->attr;
+	strcpy(fno->fname, strrchr(node->path, '/') + 1);
+}
+
+static FRESULT sim_f_open_do(FIL *fp, const char *path, BYTE mode) {
+	fp->node = -1;
+	int err = sim_op(SIM_FS_OPEN);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	char buf[SIM_PATH_SIZE];
+	path = sim_lookup(path, buf);
+	sim_node_t *node = sim_node_find(path);
+	if (node != NULL && node->dir) {
+		return (FR_NO_FILE);
+	}
+	if (node == NULL) {
+		if (!(mode & (FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS))) {
+			return (sim_parent_exists(path) ? FR_NO_FILE : FR_NO_PATH);
+		}
+		node = sim_node_new(path, false);
+		if (node == NULL) {
+			return (sim_parent_exists(path) ? FR_DENIED : FR_NO_PATH);
+		}
+	} else if (mode & FA_CREATE_NEW) {
+		return (FR_EXIST);
+	} else if ((mode & FA_WRITE) && (node->attr & AM_RDO)) {
+		return (FR_DENIED);
+	} else if (mode & FA_CREATE_ALWAYS) {
+		node->size = 0;
+		node->data_len = 0;
+	}
+	fp->node = node - sim_nodes;
+	fp->mode = mode;
+	fp->objsize = node->size;
+	fp->fptr = ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND) ? node->size : 0;
+	return (FR_OK);
+}
+
+FRESULT sim_f_open(FIL *fp, const char *path, BYTE mode) {
+	FRESULT res = sim_f_open_do(fp, path, mode);
+	if (sim_ops[SIM_FS_OPEN].after != NULL) {
+		sim_ops[SIM_FS_OPEN].after();
+	}
+	return (res);
+}
+
+static sim_node_t* sim_fil_node(const FIL *fp) {
+	if (fp->node < 0 || fp->node >= SIM_NODES || !sim_nodes[fp->node].used) {
+		return (NULL);
+	}
+	return (&sim_nodes[fp->node]);
+}
+
+FRESULT sim_f_close(FIL *fp) {
+	if (sim_fil_node(fp) == NULL) {
+		return (FR_INVALID_OBJECT);
+	}
+	fp->node = -1;
+	return (FR_OK);
+}
+
+FRESULT sim_f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+	*br = 0;
+	sim_node_t *node = sim_fil_node(fp);
+	if (node == NULL) {
+		return (FR_INVALID_OBJECT);
+	}
+	if (!(fp->mode & FA_READ)) {
+		return (FR_DENIED);
+	}
+	int err = sim_op(SIM_FS_READ);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	uint32_t len = sim_op_len(SIM_FS_READ, btr);
+	uint64_t left = fp->fptr < node->size ? node->size - fp->fptr : 0;
+	len = len < left ? len : (uint32_t) left;
+	for (uint32_t i = 0; i < len; i++, fp->fptr++) {
+		((uint8_t*) buff)[i] = (fp->fptr < node->data_len) ? node->data[fp->fptr] : sim_pattern(fp->fptr);
+	}
+	*br = len;
+	sim_advance(sim_op_time(SIM_FS_READ, len));
+	return (FR_OK);
+}
+
+FRESULT sim_f_write(FIL *fp, const void *buff, UINT btw, UINT *bw) {
+	*bw = 0;
+	sim_node_t *node = sim_fil_node(fp);
+	if (node == NULL) {
+		return (FR_INVALID_OBJECT);
+	}
+	if (!(fp->mode & FA_WRITE)) {
+		return (FR_DENIED);
+	}
+	int err = sim_op(SIM_FS_WRITE);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	// short write is volume full for FatFs
+	uint32_t len = sim_op_len(SIM_FS_WRITE, btw);
+	if (!sim_node_materialize(node, fp->fptr + len) || (fp->fptr + len > node->size && !sim_node_resize(node, fp->fptr + len))) {
+		return (FR_NOT_ENOUGH_CORE);
+	}
+	memcpy(node->data + fp->fptr, buff, len);
+	fp->fptr += len;
+	fp->objsize = node->size;
+	*bw = len;
+	sim_advance(sim_op_time(SIM_FS_WRITE, len));
+	return (FR_OK);
+}
+
+FRESULT sim_f_lseek(FIL *fp, FSIZE_t ofs) {
+	sim_node_t *node = sim_fil_node(fp);
+	if (node == NULL) {
+		return (FR_INVALID_OBJECT);
+	}
+	if (ofs > node->size) {
+		if (!(fp->mode & FA_WRITE)) {
+			ofs = node->size;
+		} else if (!sim_node_resize(node, ofs)) {
+			return (FR_NOT_ENOUGH_CORE);
+		}
+	}
+	fp->fptr = ofs;
+	fp->objsize = node->size;
+	return (FR_OK);
+}
+
+static FRESULT sim_f_stat_do(const char *path, FILINFO *fno) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	char buf[SIM_PATH_SIZE];
+	path = sim_lookup(path, buf);
+	if (!strcmp(path, "/")) {
+		// FatFs can't stat root directory
+		return (FR_INVALID_NAME);
+	}
+	sim_node_t *node = sim_node_find(path);
+	if (node == NULL) {
+		return (sim_parent_exists(path) ? FR_NO_FILE : FR_NO_PATH);
+	}
+	sim_fill_info(node, fno);
+	return (FR_OK);
+}
+
+FRESULT sim_f_stat(const char *path, FILINFO *fno) {
+	FRESULT res = sim_f_stat_do(path, fno);
+	if (sim_ops[SIM_FS_META].after != NULL) {
+		sim_ops[SIM_FS_META].after();
+	}
+	return (res);
+}
+
+FRESULT sim_f_opendir(DIR *dp, const char *path) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	dp->index = 0;
+	if (!strcmp(path, "/") || path[0] == 0) {
+		dp->node = -1;
+		return (FR_OK);
+	}
+	sim_node_t *node = sim_node_find(path);
+	if (node == NULL || !node->dir) {
+		return (FR_NO_PATH);
+	}
+	dp->node = node - sim_nodes;
+	return (FR_OK);
+}
+
+FRESULT sim_f_closedir(DIR *dp) {
+	(void) dp;
+	return (FR_OK);
+}
+
+FRESULT sim_f_readdir(DIR *dp, FILINFO *fno) {
+	int err = sim_op(SIM_FS_READDIR);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	const char *dir = dp->node < 0 ? "/" : sim_nodes[dp->node].path;
+	while (dp->index < SIM_NODES) {
+		sim_node_t *node = &sim_nodes[dp->index++];
+		if (node->used && sim_is_child(node->path, dir)) {
+			sim_fill_info(node, fno);
+			return (FR_OK);
+		}
+	}
+	fno->fname[0] = 0;
+	return (FR_OK);
+}
+
+FRESULT sim_f_unlink(const char *path) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	sim_node_t *node = sim_node_find(path);
+	if (node == NULL) {
+		return (FR_NO_FILE);
+	}
+	if (node->attr & AM_RDO) {
+		return (FR_DENIED);
+	}
+	for (uint32_t i = 0; node->dir && i < SIM_NODES; i++) {
+		if (sim_nodes[i].used && sim_is_child(sim_nodes[i].path, path)) {
+			return (FR_DENIED);
+		}
+	}
+	free(node->data);
+	memset(node, 0, sizeof(sim_node_t));
+	return (FR_OK);
+}
+
+FRESULT sim_f_mkdir(const char *path) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	if (sim_node_find(path) != NULL) {
+		return (FR_EXIST);
+	}
+	return (sim_dir_create(path) ? FR_OK : FR_NO_PATH);
+}
+
+FRESULT sim_f_rename(const char *path_old, const char *path_new) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	if (sim_node_find(path_old) == NULL) {
+		return (FR_NO_FILE);
+	}
+	if (sim_node_find(path_new) != NULL) {
+		return (FR_EXIST);
+	}
+	if (!sim_parent_exists(path_new)) {
+		return (FR_NO_PATH);
+	}
+	size_t old_len = strlen(path_old);
+	size_t new_len = strlen(path_new);
+	for (uint32_t i = 0; i < SIM_NODES; i++) {
+		sim_node_t *node = &sim_nodes[i];
+		if (node->used && !strncmp(node->path, path_old, old_len) && (node->path[old_len] == 0 || node->path[old_len] == '/')) {
+			if (new_len + strlen(node->path + old_len) >= SIM_PATH_SIZE) {
+				return (FR_INVALID_NAME);
+			}
+			char path[SIM_PATH_SIZE];
+			snprintf(path, sizeof(path), "%s%s", path_new, node->path + old_len);
+			strcpy(node->path, path);
+		}
+	}
+	return (FR_OK);
+}
+
+FRESULT sim_f_utime(const char *path, const FILINFO *fno) {
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	sim_node_t *node = sim_node_find(path);
+	if (node == NULL) {
+		return (FR_NO_FILE);
+	}
+	node->fdate = fno->fdate;
+	node->ftime = fno->ftime;
+	return (FR_OK);
+}
+
+FRESULT sim_f_getfree(const char *path, DWORD *nclst, FATFS **fatfs) {
+	(void) path;
+	int err = sim_op(SIM_FS_META);
+	if (err) {
+		return ((FRESULT) err);
+	}
+	uint64_t used = 0;
+	for (uint32_t i = 0; i < SIM_NODES; i++) {
+		used += (sim_nodes[i].size + SIM_CLUSTER_SECTORS * 512 - 1) / (SIM_CLUSTER_SECTORS * 512);
+	}
+	*nclst = used < SIM_FREE_CLUSTERS ? SIM_FREE_CLUSTERS - (DWORD) used : 0;
+	*fatfs = &sim_fatfs;
+	return (FR_OK);
+}
+
+FRESULT sim_f_chdir(const char *path) {
+	char buf[SIM_PATH_SIZE];
+	path = sim_lookup(path, buf);
+	sim_node_t *node = sim_node_find(path);
+	if (strcmp(path, "/") && (node == NULL || !node->dir)) {
+		return (FR_NO_PATH);
+	}
+	strcpy(sim_cwd, path);
+	return (FR_OK);
+}
+
+FRESULT sim_f_expand(FIL *fp, FSIZE_t fsz, BYTE opt) {
+	(void) fsz;
+	(void) opt;
+	return (sim_fil_node(fp) != NULL ? FR_OK : FR_INVALID_OBJECT);
+}
+
+// =========================================================
+//
+//                    Network
+//
+// =========================================================
+
+static struct netconn* sim_conn_new(sim_conn_kind_t kind) {
+	struct netconn *conn = calloc(1, sizeof(struct netconn));
+	struct sim_conn *sim = calloc(1, sizeof(struct sim_conn));
+	if (conn == NULL || sim == NULL) {
+		abort();
+	}
+	sim->kind = kind;
+	conn->sim = sim;
+	conn->state = NETCONN_NONE;
+	return (conn);
+}
+
+static void sim_append(uint8_t **buf, uint32_t *len, uint32_t *cap, const void *data, uint32_t size) {
+	if (*len + size + 1 > *cap) {
+		uint32_t new_cap = (*len + size + 1) * 2;
+		uint8_t *new_buf = realloc(*buf, new_cap);
+		if (new_buf == NULL) {
+			abort();
+		}
+		*buf = new_buf;
+		*cap = new_cap;
+	}
+	memcpy(*buf + *len, data, size);
+	*len += size;
+	(*buf)[*len] = 0;
+}
+
+struct netconn* sim_client_connect(const sim_client_t *client) {
+	sim_client = *client;
+	free(sim_reply_text);
+	sim_reply_text = NULL;
+	sim_reply_len = 0;
+	free(sim_last_download);
+	sim_last_download = NULL;
+	sim_last_download_len = 0;
+	sim_data_conn_cnt = 0;
+	return (sim_conn_new(SIM_CONN_CTRL));
+}
+
+const char* sim_replies(void) {
+	return (sim_reply_text ? sim_reply_text : "");
+}
+
+uint32_t sim_reply_count(uint16_t code) {
+	uint32_t count = 0;
+	const char *line = sim_replies();
+	while (*line) {
+		if ((uint16_t) atoi(line) == code && line[3] == ' ') {
+			count++;
+		}
+		const char *eol = strchr(line, '\n');
+		if (eol == NULL) {
+			break;
+		}
+		line = eol + 1;
+	}
+	return (count);
+}
+
+const uint8_t* sim_download(uint32_t *len) {
+	*len = sim_last_download_len;
+	return (sim_last_download);
+}
+
+uint32_t sim_data_conns(void) {
+	return (sim_data_conn_cnt);
+}
+
+struct netconn* sim_netconn_new(enum netconn_type type) {
+	(void) type;
+	return (sim_conn_new(SIM_CONN_DATA));
+}
+
+err_t sim_netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port) {
+	(void) conn;
+	(void) addr;
+	(void) port;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_listen(struct netconn *conn) {
+	conn->sim->kind = SIM_CONN_LISTEN;
+	conn->state = NETCONN_LISTEN;
+	return (ERR_OK);
+}
+
+// client opens data connection, to passive port or by accepting active one
+static err_t sim_data_open(struct netconn *conn, uint32_t timeout_ms) {
+	int err = sim_op(SIM_DATA_ACCEPT);
+	if (err == ERR_TIMEOUT) {
+		sim_advance(timeout_ms);
+	}
+	if (err) {
+		return ((err_t) err);
+	}
+	sim_data_conn_cnt++;
+	conn->sim->kind = SIM_CONN_DATA;
+	conn->sim->upload_pos = 0;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_accept(struct netconn *conn, struct netconn **new_conn) {
+	if (conn->sim->kind != SIM_CONN_LISTEN) {
+		return (ERR_VAL);
+	}
+	struct netconn *data = sim_conn_new(SIM_CONN_DATA);
+	err_t err = sim_data_open(data, conn->sim->recv_timeout_ms);
+	if (err != ERR_OK) {
+		sim_netconn_delete(data);
+		return (err);
+	}
+	*new_conn = data;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port) {
+	(void) addr;
+	(void) port;
+	return (sim_data_open(conn, conn->sim->recv_timeout_ms));
+}
+
+err_t sim_netconn_close(struct netconn *conn) {
+	conn->state = NETCONN_CLOSE;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_shutdown(struct netconn *conn, u8_t rx, u8_t tx) {
+	(void) conn;
+	(void) rx;
+	(void) tx;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_delete(struct netconn *conn) {
+	if (conn == NULL) {
+		return (ERR_VAL);
+	}
+	struct sim_conn *sim = conn->sim;
+	if (sim->kind == SIM_CONN_DATA && sim->rx_len) {
+		free(sim_last_download);
+		sim_last_download = sim->rx;
+		sim_last_download_len = sim->rx_len;
+		sim->rx = NULL;
+	}
+	free(sim->rx);
+	free(sim);
+	free(conn);
+	return (ERR_OK);
+}
+
+err_t sim_netconn_getaddr(struct netconn *conn, ip_addr_t *addr, u16_t *port, u8_t local) {
+	(void) conn;
+	if (local) {
+		IP4_ADDR(addr, 192, 168, 1, 10);
+		*port = 21;
+	} else {
+		IP4_ADDR(addr, 192, 168, 1, 20);
+		*port = 50000;
+	}
+	return (ERR_OK);
+}
+
+// client needs wait_ms before it sends next data, receive times out when it is longer than recv timeout
+//
+// return: true, when data are ready
+static bool sim_recv_wait(struct sim_conn *sim, uint32_t wait_ms) {
+	if (sim->wait_left_ms == 0) {
+		sim->wait_left_ms = wait_ms;
+	}
+	if (sim->recv_timeout_ms && sim->wait_left_ms > sim->recv_timeout_ms) {
+		sim_advance(sim->recv_timeout_ms);
+		sim->wait_left_ms -= sim->recv_timeout_ms;
+		return (false);
+	}
+	sim_advance(sim->wait_left_ms);
+	sim->wait_left_ms = 0;
+	return (true);
+}
+
+err_t sim_netconn_recv(struct netconn *conn, struct netbuf **new_buf) {
+	struct sim_conn *sim = conn->sim;
+	if (sim->kind != SIM_CONN_CTRL || sim_client.script == NULL) {
+		return (ERR_CONN);
+	}
+	uint32_t pos = sim->script_pos;
+	uint32_t wait_ms = 0;
+	while (sim_client.script[pos] != NULL && sim_client.script[pos][0] == '~') {
+		wait_ms += (uint32_t) atoi(sim_client.script[pos++] + 1);
+	}
+	if (!sim_recv_wait(sim, wait_ms)) {
+		// client is still silent, rest of wait is kept for next receive
+		return (ERR_TIMEOUT);
+	}
+	const char *line = sim_client.script[pos];
+	if (line == NULL) {
+		sim->script_pos = pos;
+		return (ERR_CLSD);
+	}
+	sim->script_pos = pos + 1;
+	size_t len = strlen(line);
+	struct netbuf *buf = calloc(1, sizeof(struct netbuf));
+	struct pbuf *p = calloc(1, sizeof(struct pbuf) + len + 2);
+	if (buf == NULL || p == NULL) {
+		abort();
+	}
+	p->payload = p + 1;
+	memcpy(p->payload, line, len);
+	memcpy((char*) p->payload + len, "\r\n", 2);
+	p->len = p->tot_len = (u16_t) (len + 2);
+	buf->p = p;
+	*new_buf = buf;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_recv_tcp_pbuf(struct netconn *conn, struct pbuf **new_buf) {
+	struct sim_conn *sim = conn->sim;
+	if (sim->kind != SIM_CONN_DATA) {
+		return (ERR_CONN);
+	}
+	uint32_t left = sim_client.upload_len - sim->upload_pos;
+	uint32_t len = sim_op_len(SIM_DATA_RECV, left < TCP_MSS ? left : TCP_MSS);
+	if (!sim_recv_wait(sim, sim_ops[SIM_DATA_RECV].latency_ms + sim_op_time(SIM_DATA_RECV, len))) {
+		return (ERR_TIMEOUT);
+	}
+	int err = sim_op_fail(SIM_DATA_RECV);
+	if (err) {
+		return ((err_t) err);
+	}
+	if (len == 0) {
+		return (ERR_CLSD);
+	}
+	struct pbuf *p = calloc(1, sizeof(struct pbuf) + len);
+	if (p == NULL) {
+		abort();
+	}
+	p->payload = p + 1;
+	memcpy(p->payload, sim_client.upload + sim->upload_pos, len);
+	p->len = p->tot_len = (u16_t) len;
+	sim->upload_pos += len;
+	*new_buf = p;
+	return (ERR_OK);
+}
+
+err_t sim_netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *bytes_written) {
+	(void) flags;
+	struct sim_conn *sim = conn->sim;
+	size_t written = 0;
+	if (bytes_written == NULL) {
+		bytes_written = &written;
+	}
+	*bytes_written = 0;
+	if (sim->kind == SIM_CONN_CTRL) {
+		int err = sim_op(SIM_CTRL_WRITE);
+		if (err) {
+			return ((err_t) err);
+		}
+		uint32_t cap = sim_reply_len ? sim_reply_len + 1 : 0;
+		sim_append((uint8_t**) &sim_reply_text, &sim_reply_len, &cap, data, size);
+		*bytes_written = size;
+		return (ERR_OK);
+	}
+	if (sim->kind != SIM_CONN_DATA) {
+		return (ERR_CONN);
+	}
+	int err = sim_op(SIM_DATA_WRITE);
+	if (err) {
+		return ((err_t) err);
+	}
+	// write blocks while data leave at bandwidth of client, like lwIP with send timeout
+	// it returns what was sent until timeout, short write stalls until timeout too
+	uint32_t len = sim_op_len(SIM_DATA_WRITE, size);
+	uint32_t time_ms = sim_op_time(SIM_DATA_WRITE, len);
+	if (sim->send_timeout_ms && time_ms > sim->send_timeout_ms) {
+		len = sim->send_timeout_ms * sim_ops[SIM_DATA_WRITE].bytes_per_ms;
+		time_ms = sim->send_timeout_ms;
+	} else if (len < size) {
+		time_ms = sim->send_timeout_ms;
+	}
+	sim_append(&sim->rx, &sim->rx_len, &sim->rx_cap, data, len);
+	sim_advance(time_ms);
+	*bytes_written = len;
+	return (len ? ERR_OK : ERR_WOULDBLOCK);
+}
+
+void sim_netconn_set_recvtimeout(struct netconn *conn, uint32_t timeout_ms) {
+	conn->sim->recv_timeout_ms = timeout_ms;
+}
+
+void sim_netconn_set_sendtimeout(struct netconn *conn, uint32_t timeout_ms) {
+	conn->sim->send_timeout_ms = timeout_ms;
+}
+
+err_t sim_netbuf_data(struct netbuf *buf, void **data, u16_t *len) {
+	*data = buf->p->payload;
+	*len = buf->p->len;
+	return (ERR_OK);
+}
+
+void sim_netbuf_delete(struct netbuf *buf) {
+	if (buf != NULL) {
+		free(buf->p);
+		free(buf);
+	}
+}
+
+u8_t sim_pbuf_free(struct pbuf *p) {
+	u8_t count = 0;
+	while (p != NULL) {
+		struct pbuf *next = p->next;
+		free(p);
+		p = next;
+		count++;
+	}
+	return (count);
+}
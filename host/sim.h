@@ -0,0 +1,127 @@
+/*
+ * sim.h
+ *
+ * Deterministic simulation of lwIP netconn and FatFs for host tests
+ *
+ * time is virtual, it moves only by latency and bandwidth of simulated operations
+ * and by FTP_DELAY_MS, so every run of a scenario takes the same virtual time,
+ * every operation can be slowed down and can fail at given call
+ */
+
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "api.h"
+#include "fatfs.h"
+
+/* *********** VIRTUAL TIME ************** */
+uint32_t sim_time_ms(void);
+void sim_delay_ms(uint32_t ms);
+
+/* *********** TIMING AND FAULTS ************** */
+typedef enum {
+	SIM_FS_OPEN, // f_open
+	SIM_FS_READ, // f_read
+	SIM_FS_WRITE, // f_write
+	SIM_FS_READDIR, // f_readdir
+	SIM_FS_META, // f_stat, f_opendir, f_unlink, f_mkdir, f_rename, f_utime, f_getfree
+	SIM_DATA_ACCEPT, // client connects to passive port or accepts active connection
+	SIM_DATA_RECV, // client sends data for STOR
+	SIM_DATA_WRITE, // client receives data of RETR/LIST
+	SIM_CTRL_WRITE, // client receives reply
+	SIM_OP_CNT
+} sim_op_t;
+
+typedef struct {
+	uint32_t latency_ms; // virtual time taken by every call
+	uint32_t bytes_per_ms; // bandwidth of read/write, 0 is unlimited
+	uint32_t short_len; // one call moves at most this many bytes, 0 is unlimited
+	uint32_t fail_at; // number of call which fails, counted from 1, 0 is never
+	uint32_t fail_count; // calls which fail from fail_at, 0 is all following
+	int fail_err; // FRESULT or err_t returned by failing call
+	uint32_t calls; // calls done so far
+	void (*after)(void); // called when f_stat or f_open is done, f.e. to change volume like other session
+} sim_op_cfg_t;
+
+extern sim_op_cfg_t sim_ops[SIM_OP_CNT];
+
+// empty volume, time 0, operations without latency and faults
+void sim_reset(void);
+
+/* *********** VOLUME ************** */
+// data NULL makes sparse file which reads as sim_pattern(), it can be bigger than 4 GB,
+// only first 64 MB of file can be written or read by sim_file_data
+bool sim_file_create(const char *path, const void *data, uint64_t size);
+bool sim_dir_create(const char *path);
+// NULL for file bigger than 64 MB
+const uint8_t* sim_file_data(const char *path, uint64_t *size);
+bool sim_exists(const char *path);
+// directories scanned by lookups of f_stat, f_open and f_chdir, one per component of path,
+// relative path (_FS_RPATH) starts from current directory
+uint32_t sim_dir_scans(void);
+uint8_t sim_pattern(uint64_t offset);
+
+FRESULT sim_f_open(FIL *fp, const char *path, BYTE mode);
+FRESULT sim_f_close(FIL *fp);
+FRESULT sim_f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT sim_f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT sim_f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT sim_f_stat(const char *path, FILINFO *fno);
+FRESULT sim_f_opendir(DIR *dp, const char *path);
+FRESULT sim_f_closedir(DIR *dp);
+FRESULT sim_f_readdir(DIR *dp, FILINFO *fno);
+FRESULT sim_f_unlink(const char *path);
+FRESULT sim_f_mkdir(const char *path);
+FRESULT sim_f_rename(const char *path_old, const char *path_new);
+FRESULT sim_f_utime(const char *path, const FILINFO *fno);
+FRESULT sim_f_getfree(const char *path, DWORD *nclst, FATFS **fatfs);
+FRESULT sim_f_chdir(const char *path);
+FRESULT sim_f_expand(FIL *fp, FSIZE_t fsz, BYTE opt);
+
+/* *********** CLIENT ************** */
+typedef struct {
+	// command lines without CRLF, "~<ms>" makes client wait before next line,
+	// NULL ends script and client closes control connection
+	const char *const *script;
+	// data sent on every data connection which server reads (STOR)
+	const uint8_t *upload;
+	uint32_t upload_len;
+} sim_client_t;
+
+// control connection of new client, as returned by accept of server
+struct netconn* sim_client_connect(const sim_client_t *client);
+
+// replies received by client, all lines in one string
+const char* sim_replies(void);
+// count of replies with code
+uint32_t sim_reply_count(uint16_t code);
+// data received on last closed data connection
+const uint8_t* sim_download(uint32_t *len);
+// data connections opened in session
+uint32_t sim_data_conns(void);
+
+struct netconn* sim_netconn_new(enum netconn_type type);
+err_t sim_netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t sim_netconn_listen(struct netconn *conn);
+err_t sim_netconn_accept(struct netconn *conn, struct netconn **new_conn);
+err_t sim_netconn_connect(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t sim_netconn_close(struct netconn *conn);
+err_t sim_netconn_shutdown(struct netconn *conn, u8_t rx, u8_t tx);
+err_t sim_netconn_delete(struct netconn *conn);
+err_t sim_netconn_getaddr(struct netconn *conn, ip_addr_t *addr, u16_t *port, u8_t local);
+err_t sim_netconn_recv(struct netconn *conn, struct netbuf **new_buf);
+err_t sim_netconn_recv_tcp_pbuf(struct netconn *conn, struct pbuf **new_buf);
+err_t sim_netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *bytes_written);
+void sim_netconn_set_recvtimeout(struct netconn *conn, uint32_t timeout_ms);
+void sim_netconn_set_sendtimeout(struct netconn *conn, uint32_t timeout_ms);
+err_t sim_netbuf_data(struct netbuf *buf, void **data, u16_t *len);
+void sim_netbuf_delete(struct netbuf *buf);
+u8_t sim_pbuf_free(struct pbuf *p);
+
+/* *********** LOG ************** */
+// printed when environment variable SIM_LOG is set
+void sim_log(const char *fmt, ...);
+
+#endif /* HOST_SIM_H_ */
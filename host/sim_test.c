@@ -0,0 +1,788 @@
+/*
+ * sim_test.c
+ *
+ * Scenarios of RETR, STOR and LIST against simulated netconn and FatFs,
+ * server is built into this file, so its sessions can be driven directly
+ *
+ * run: make test, one scenario: ./sim_test <name>, trace: SIM_LOG=1 ./sim_test <name>
+ */
+
+#if FTP_TRACE_ENABLE == 1
+#include <stdint.h>
+
+// records of session trace are kept by test
+static void test_trace_write(const void *hdr, uint32_t hdr_len, const void *data, uint32_t data_len);
+#define FTP_TRACE_WRITE(hdr, hdr_len, data, data_len)	test_trace_write(hdr, hdr_len, data, data_len)
+#endif
+
+#include "../ftp_server.c"
+#include <stdio.h>
+
+#define LOGIN "USER " FTP_USER_NAME_DEFAULT, "PASS " FTP_USER_PASS_DEFAULT, "TYPE I"
+
+#define FILE_SIZE			100000
+#define BIG_FILE_SIZE		(5ull << 30) // sparse file over 4 GB
+
+static int test_failed;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		printf("  replies:\n%s", sim_replies()); \
+		test_failed = 1; \
+		return; \
+	} \
+} while(0)
+
+// empty volume, clean statistics and caches, time 0
+static void test_reset(void) {
+	sim_reset();
+	ftp_invalidate_path(NULL);
+	memset(&FTP.stats, 0, sizeof(FTP.stats));
+#if FTP_JOURNAL == 1
+	memset(&ftp_journal, 0, sizeof(ftp_journal));
+#endif
+	FTP.status = FTP_IDLE;
+	FTP.errors = 0;
+}
+
+// run one session of client till it quits, its script ends or server closes it
+static void test_session(const char *const *script, const uint8_t *upload, uint32_t upload_len) {
+	sim_client_t client = { .script = script, .upload = upload, .upload_len = upload_len };
+	bool stop = false;
+	struct netconn *conn = sim_client_connect(&client);
+	ftp_service(conn, &ftp_links[0].ftp_data, &stop);
+	sim_netconn_delete(conn);
+}
+
+static bool test_pattern_equal(const uint8_t *data, uint32_t len, uint64_t offset) {
+	for (uint32_t i = 0; i < len; i++) {
+		if (data[i] != sim_pattern(offset + i)) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static uint8_t* test_upload(uint32_t len) {
+	static uint8_t upload[FILE_SIZE];
+	for (uint32_t i = 0; i < len && i < sizeof(upload); i++) {
+		upload[i] = sim_pattern(i);
+	}
+	return (upload);
+}
+
+// =========================================================
+//
+//                    RETR
+//
+// =========================================================
+
+static void test_retr_ok(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(len == FILE_SIZE && test_pattern_equal(data, len, 0));
+	CHECK(FTP.stats.files_send_successfully == 1);
+	CHECK(FTP.stats.bytes_sent == FILE_SIZE);
+	CHECK(FTP.stats.ops[FTP_OP_RETR].count == 1 && FTP.stats.ops[FTP_OP_RETR].failed == 0);
+}
+
+static void test_retr_rest(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	const char *script[] = { LOGIN, "REST 1000", "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(sim_reply_count(350) == 1);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(len == FILE_SIZE - 1000 && test_pattern_equal(data, len, 1000));
+}
+
+static void test_retr_disk_error(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	sim_ops[SIM_FS_READ] = (sim_op_cfg_t ) { .fail_at = 3, .fail_err = FR_DISK_ERR };
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "NOOP", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(451) == 1);
+	CHECK(sim_reply_count(226) == 0);
+	// session continues after failed transfer
+	CHECK(sim_reply_count(200) == 2);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(FTP.stats.files_send_failed == 1);
+	CHECK(FTP.stats.ops[FTP_OP_RETR].failed == 1);
+}
+
+static void test_retr_reset(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	sim_ops[SIM_DATA_WRITE] = (sim_op_cfg_t ) { .fail_at = 2, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "NOOP", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(426) == 1);
+	CHECK(sim_reply_count(200) == 2);
+	CHECK(sim_reply_count(221) == 1);
+	// reset of one client is not error of server
+	CHECK(FTP.status == FTP_IDLE && FTP.errors == 0);
+	CHECK(FTP.stats.files_send_failed == 1);
+}
+
+static void test_retr_accept_timeout(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	sim_ops[SIM_DATA_ACCEPT] = (sim_op_cfg_t ) { .fail_at = 1, .fail_count = 1, .fail_err = ERR_TIMEOUT };
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	// client can retry after failed data connection
+	CHECK(sim_reply_count(425) == 1);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(len == FILE_SIZE && test_pattern_equal(data, len, 0));
+	CHECK(FTP.stats.files_send_failed == 1 && FTP.stats.files_send_successfully == 1);
+}
+
+static void test_retr_short_write(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	// client window stays full, write sends part of data till send timeout
+	sim_ops[SIM_DATA_WRITE] = (sim_op_cfg_t ) { .short_len = 100 };
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(426) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(FTP.stats.write_timeouts == 1);
+	CHECK(FTP.stats.files_send_failed == 1);
+	CHECK(sim_time_ms() >= FTP_SERVER_WRITE_TIMEOUT_MS);
+}
+
+static void test_retr_slow_client(void) {
+	CHECK(sim_file_create("/a.bin", NULL, FILE_SIZE));
+	// 50 kB/s
+	sim_ops[SIM_DATA_WRITE] = (sim_op_cfg_t ) { .bytes_per_ms = 50 };
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(len == FILE_SIZE && test_pattern_equal(data, len, 0));
+	CHECK(FTP.stats.write_timeouts == 0);
+	CHECK(sim_time_ms() >= FILE_SIZE / 50);
+	CHECK(FTP.stats.ops[FTP_OP_RETR].max_ms >= FILE_SIZE / 50);
+}
+
+static void test_retr_big_rest(void) {
+	CHECK(sim_file_create("/big.img", NULL, BIG_FILE_SIZE));
+	// 5368709120 - 1000
+	const char *script[] = { LOGIN, "SIZE big.img", "REST 5368708120", "PASV", "RETR big.img", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(strstr(sim_replies(), "213 5368709120\r\n") != NULL);
+	CHECK(strstr(sim_replies(), "350 Restarting at 5368708120\r\n") != NULL);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(len == 1000 && test_pattern_equal(data, len, BIG_FILE_SIZE - 1000));
+	CHECK(FTP.stats.bytes_sent == 1000);
+}
+
+static void test_big_listing(void) {
+	CHECK(sim_file_create("/big.img", NULL, BIG_FILE_SIZE));
+	const char *mlsd[] = { LOGIN, "PASV", "MLSD", "QUIT", NULL };
+	test_session(mlsd, NULL, 0);
+	uint32_t len;
+	const char *data = (const char*) sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && strstr(data, "Type=file;Size=5368709120;") != NULL);
+
+	const char *list[] = { LOGIN, "PASV", "LIST", "SITE MSTAT big.img", "QUIT", NULL };
+	test_session(list, NULL, 0);
+	data = (const char*) sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && !strcmp(data, "+r,s5368709120,\tbig.img\r\n"));
+	CHECK(strstr(sim_replies(), " Type=file;Size=5368709120;") != NULL);
+	CHECK(strstr(sim_replies(), "250 End, 1 found, 0 missing\r\n") != NULL);
+}
+
+// =========================================================
+//
+//                    STOR
+//
+// =========================================================
+
+static void test_stor_ok(void) {
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	uint64_t size;
+	const uint8_t *data = sim_file_data("/b.bin", &size);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && size == FILE_SIZE && test_pattern_equal(data, size, 0));
+	CHECK(FTP.stats.files_received_successfully == 1);
+	CHECK(FTP.stats.bytes_received == FILE_SIZE);
+}
+
+static void test_stor_disk_error(void) {
+	sim_ops[SIM_FS_WRITE] = (sim_op_cfg_t ) { .fail_at = 2, .fail_err = FR_DISK_ERR };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "NOOP", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	CHECK(sim_reply_count(451) == 1);
+	CHECK(sim_reply_count(226) == 0);
+	CHECK(sim_reply_count(200) == 2);
+	CHECK(FTP.stats.files_received_failed == 1);
+	CHECK(FTP.stats.ops[FTP_OP_STOR].failed == 1);
+}
+
+static void test_stor_short_write(void) {
+	// volume is full, FatFs writes less than asked
+	sim_ops[SIM_FS_WRITE] = (sim_op_cfg_t ) { .short_len = 100 };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	CHECK(sim_reply_count(451) == 1);
+	CHECK(sim_reply_count(226) == 0);
+	CHECK(sim_reply_count(221) == 1);
+}
+
+static void test_stor_reset(void) {
+	sim_ops[SIM_DATA_RECV] = (sim_op_cfg_t ) { .fail_at = 10, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	uint64_t size;
+	const uint8_t *data = sim_file_data("/b.bin", &size);
+	CHECK(sim_reply_count(426) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	// data received before reset are kept
+	CHECK(data != NULL && size == 9 * TCP_MSS && test_pattern_equal(data, size, 0));
+	CHECK(FTP.stats.files_received_failed == 1);
+}
+
+static void test_stor_stall(void) {
+	// client goes silent after first segments, session must not wait forever
+	sim_ops[SIM_DATA_RECV] = (sim_op_cfg_t ) { .latency_ms = 100000 };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	CHECK(sim_reply_count(426) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(sim_time_ms() >= FTP_XFER_STALL_WINDOW_MS && sim_time_ms() < FTP_XFER_STALL_WINDOW_MS + 2 * FTP_SERVER_READ_TIMEOUT_MS);
+}
+
+static void test_stor_reply_lost(void) {
+	// control connection fails at 150, replies before it are 220, 331, 230, 200 and 227
+	sim_ops[SIM_CTRL_WRITE] = (sim_op_cfg_t ) { .fail_at = 6, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	// file and data connection are closed, session ends
+	CHECK(ftp->file.node == -1);
+	CHECK(ftp->dataconn == NULL);
+	CHECK(!strcmp(ftp->path, "/"));
+	CHECK(sim_exists("/b.bin"));
+	CHECK(FTP.stats.files_received_failed == 1);
+}
+
+static void test_stor_keeps_cwd(void) {
+	CHECK(sim_dir_create("/d"));
+	CHECK(sim_dir_create("/d/sub"));
+	const char *script[] = { LOGIN, "CWD d", "STOR", "PWD", "PASV", "STOR sub/x.bin", "PWD", "QUIT", NULL };
+	test_session(script, test_upload(1000), 1000);
+	CHECK(sim_reply_count(501) == 1);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(sim_reply_count(257) == 2);
+	CHECK(strstr(sim_replies(), "257 \"/d/sub\"") == NULL);
+	CHECK(sim_exists("/d/sub/x.bin"));
+}
+
+static void test_stor_accept_timeout(void) {
+	sim_ops[SIM_DATA_ACCEPT] = (sim_op_cfg_t ) { .fail_at = 1, .fail_err = ERR_TIMEOUT };
+	const char *script[] = { LOGIN, "PASV", "STOR b.bin", "QUIT", NULL };
+	test_session(script, test_upload(FILE_SIZE), FILE_SIZE);
+	CHECK(sim_reply_count(425) == 1);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(sim_data_conns() == 0);
+}
+
+#if FTP_SHARED_READ == 1
+static void test_shared_read(void) {
+	const uint32_t size = 5 * FTP_SHARED_READ_BLOCK_SIZE;
+	CHECK(sim_file_create("/a.bin", NULL, size));
+	const char *script[] = { LOGIN, "PASV", "RETR a.bin", "PASV", "REST 1000", "RETR a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(sim_reply_count(226) == 2);
+	CHECK(len == size - 1000 && test_pattern_equal(data, len, 1000));
+	// second download is taken from window filled by first one
+	CHECK(FTP.stats.retr_storage_bytes == size);
+	CHECK(FTP.stats.retr_shared_bytes == size - 1000);
+
+	// file replaced behind DELE must be read from storage again
+	static uint8_t other[5 * FTP_SHARED_READ_BLOCK_SIZE];
+	memset(other, 'x', sizeof(other));
+	const char *dele[] = { LOGIN, "DELE a.bin", "QUIT", NULL };
+	test_session(dele, NULL, 0);
+	CHECK(sim_file_create("/a.bin", other, size));
+	const char *again[] = { LOGIN, "PASV", "RETR a.bin", "QUIT", NULL };
+	test_session(again, NULL, 0);
+	data = sim_download(&len);
+	CHECK(len == size && !memcmp(data, other, size));
+	CHECK(FTP.stats.retr_storage_bytes == 2 * size);
+}
+#endif
+
+#if FTP_OPEN_CACHE == 1
+static void test_open_cache_changes(void) {
+	CHECK(sim_file_create("/a.bin", NULL, 100));
+	CHECK(sim_file_create("/b.bin", NULL, 200));
+	const char *script[] = { LOGIN, "SIZE a.bin", "SIZE b.bin", "PASV", "RETR b.bin", "DELE a.bin", "SIZE a.bin",
+			"RNFR b.bin", "RNTO c.bin", "SIZE b.bin", "SIZE c.bin", "PASV", "RETR b.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(strstr(sim_replies(), "213 100\r\n") != NULL);
+	// cached entries of deleted and renamed files are dropped
+	CHECK(sim_reply_count(213) == 3);
+	CHECK(sim_reply_count(550) == 3);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(FTP.stats.path_walks_avoided >= 1);
+}
+
+// other session deletes file after it was found by f_stat of SIZE, before result is cached
+static void test_open_cache_race_delete(void) {
+	ftp_path_changed("/a.bin");
+	sim_f_unlink("/a.bin");
+	sim_ops[SIM_FS_META].after = NULL;
+}
+
+static void test_open_cache_race(void) {
+	CHECK(sim_file_create("/a.bin", NULL, 100));
+	sim_ops[SIM_FS_META].after = test_open_cache_race_delete;
+	const char *script[] = { LOGIN, "SIZE a.bin", "SIZE a.bin", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	// first SIZE has result of lookup done before delete, second one must not take it from cache
+	CHECK(sim_reply_count(213) == 1);
+	CHECK(sim_reply_count(550) == 1);
+}
+#endif
+
+#if FTP_FILE_LOCK == 1 && FTP_NBR_CLIENTS > 1
+// other session found file by name in other case, FAT gives same file
+static void test_lock_case(void) {
+	ftp_data_t *other = &ftp_links[1].ftp_data;
+	other->ftp_con_num = 1;
+	CHECK(sim_dir_create("/data"));
+	CHECK(sim_file_create("/data/a.txt", NULL, 100));
+	CHECK(ftp_lock(other, "/DATA/A.TXT", FTP_LOCK_WRITE));
+	const char *script[] = { LOGIN, "PASV", "RETR data/a.txt", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(450) == 1);
+	CHECK(sim_reply_count(150) == 0);
+
+	// tree lock of DELE against read lock
+	CHECK(ftp_lock(other, "/Data/a.TXT", FTP_LOCK_READ));
+	const char *dele[] = { LOGIN, "DELE data/a.txt", "QUIT", NULL };
+	test_session(dele, NULL, 0);
+	CHECK(sim_reply_count(450) == 1);
+	CHECK(sim_exists("/data/a.txt"));
+	CHECK(FTP.stats.lock_conflicts == 2);
+
+	ftp_unlock(other);
+	test_session(dele, NULL, 0);
+	CHECK(sim_reply_count(250) == 1);
+}
+#endif
+
+// =========================================================
+//
+//                    TYPE A
+//
+// =========================================================
+
+static void test_ascii_retr(void) {
+	const char text[] = "a\nb\r\nc\n\nd";
+	CHECK(sim_file_create("/a.txt", text, sizeof(text) - 1));
+	// chunks "a\n" "b\r" "\nc" "\n\n" "d", CR of CRLF ends chunk
+	sim_ops[SIM_FS_READ] = (sim_op_cfg_t ) { .short_len = 2 };
+	const char *script[] = { LOGIN, "TYPE A", "PASV", "RETR a.txt", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const char *data = (const char*) sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && !strcmp(data, "a\r\nb\r\nc\r\n\r\nd"));
+	// progress is counted in bytes of file
+	CHECK(FTP.stats.bytes_sent == sizeof(text) - 1);
+}
+
+static void test_ascii_stor(void) {
+	const char text[] = "ab\r\ncd\r\nx\ry\r\n\r\r";
+	// chunks "ab\r" "\ncd" "\r\nx" "\ry\r" "\n\r\r", CR at end of chunk with LF at start of next one,
+	// lone CR at end of chunk and at end of file are kept
+	sim_ops[SIM_DATA_RECV] = (sim_op_cfg_t ) { .short_len = 3 };
+	const char *script[] = { LOGIN, "TYPE A", "PASV", "STOR b.txt", "QUIT", NULL };
+	test_session(script, (const uint8_t*) text, sizeof(text) - 1);
+	uint64_t size;
+	const char *data = (const char*) sim_file_data("/b.txt", &size);
+	const char expected[] = "ab\ncd\nx\ry\n\r\r";
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && size == sizeof(expected) - 1 && !memcmp(data, expected, size));
+}
+
+static void test_ascii_convert(void) {
+	ftp_data_t *ftp = &ftp_links[0].ftp_data;
+	char out[16];
+	// CR of CRLF in previous chunk
+	ftp->ascii_last = 0;
+	uint32_t len = ascii_lf_to_crlf(ftp, out, "x\r", 2);
+	len += ascii_lf_to_crlf(ftp, out + len, "\n\n", 2);
+	CHECK(len == 5 && !memcmp(out, "x\r\n\r\n", 5));
+	// CR pending at end of chunk, next chunk decides
+	ftp->ascii_cr_pending = false;
+	char in[] = "a\r\nb\r";
+	len = ascii_crlf_to_lf(ftp, in, 5);
+	CHECK(len == 3 && !memcmp(in, "a\nb", 3) && ftp->ascii_cr_pending);
+	char lone[] = "\r\rc";
+	ftp->ascii_cr_pending = false;
+	len = ascii_crlf_to_lf(ftp, lone, 3);
+	CHECK(len == 3 && !memcmp(lone, "\r\rc", 3) && !ftp->ascii_cr_pending);
+}
+
+// =========================================================
+//
+//                    LIST and control connection
+//
+// =========================================================
+
+static void test_list_ok(void) {
+	CHECK(sim_file_create("/a.bin", NULL, 123));
+	CHECK(sim_dir_create("/dir"));
+	CHECK(sim_file_create("/dir/c.bin", NULL, 1));
+	const char *script[] = { LOGIN, "PASV", "LIST", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t len;
+	const char *data = (const char*) sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && !strcmp(data, "+r,s123,\ta.bin\r\n+/,\tdir\r\n"));
+}
+
+static void test_list_readdir_error(void) {
+	CHECK(sim_file_create("/a.bin", NULL, 1));
+	CHECK(sim_file_create("/b.bin", NULL, 1));
+	sim_ops[SIM_FS_READDIR] = (sim_op_cfg_t ) { .fail_at = 2, .fail_err = FR_DISK_ERR };
+	const char *script[] = { LOGIN, "PASV", "LIST", "PASV", "MLSD", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	// truncated listing must not be reported as complete
+	CHECK(sim_reply_count(451) == 2);
+	CHECK(sim_reply_count(226) == 0);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(FTP.stats.ops[FTP_OP_LIST].failed == 2);
+}
+
+static void test_list_reset(void) {
+	CHECK(sim_file_create("/a.bin", NULL, 1));
+	CHECK(sim_file_create("/b.bin", NULL, 1));
+	sim_ops[SIM_DATA_WRITE] = (sim_op_cfg_t ) { .fail_at = 2, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "NLST", "NOOP", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(426) == 1);
+	CHECK(sim_reply_count(200) == 2);
+	CHECK(sim_reply_count(221) == 1);
+	CHECK(FTP.status == FTP_IDLE && FTP.errors == 0);
+}
+
+static void test_list_accept_timeout(void) {
+	sim_ops[SIM_DATA_ACCEPT] = (sim_op_cfg_t ) { .fail_at = 1, .fail_err = ERR_TIMEOUT };
+	const char *script[] = { LOGIN, "PASV", "LIST", "NOOP", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(425) == 1);
+	CHECK(sim_reply_count(200) == 2);
+	CHECK(sim_reply_count(221) == 1);
+}
+
+// SIZE of files in 6 levels deep directory, lookups relative to FATFS current directory
+// scan only directory of files, absolute ones scan every level
+static void test_deep_lookups(void) {
+	CHECK(sim_dir_create("/l1") && sim_dir_create("/l1/l2") && sim_dir_create("/l1/l2/l3"));
+	CHECK(sim_dir_create("/l1/l2/l3/l4") && sim_dir_create("/l1/l2/l3/l4/l5") && sim_dir_create("/l1/l2/l3/l4/l5/l6"));
+	const char *names[] = { "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7" };
+	for (uint32_t i = 0; i < 8; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/l1/l2/l3/l4/l5/l6/%s", names[i]);
+		CHECK(sim_file_create(path, NULL, 10));
+	}
+	const char *script[] = { LOGIN, "CWD /l1/l2/l3/l4/l5/l6", "SIZE f0", "SIZE f1", "SIZE f2", "SIZE f3", "SIZE f4", "SIZE f5",
+			"SIZE f6", "SIZE f7", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(sim_reply_count(250) == 1);
+	CHECK(sim_reply_count(213) == 8);
+	uint32_t scans = sim_dir_scans();
+	printf("  6 levels, CWD and 8 SIZE: %u directory scans\n", (unsigned) scans);
+#if FTP_CWD_RELATIVE == 1
+	// CWD and first SIZE move current directory, 7 SIZE scan only l6
+	CHECK(scans == 5 + 1 + 6 + 1 + 7);
+	CHECK(FTP.stats.relative_lookups == 7 && FTP.stats.dir_scans_avoided == 7 * 6);
+#else
+	CHECK(scans == 6 + 8 * 7);
+#endif
+}
+
+static void test_mkd_keeps_cwd(void) {
+	const char *script[] = { LOGIN, "MKD new", "PWD", "RMD new", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(strstr(sim_replies(), "257 \"/\" is your current directory") != NULL);
+	CHECK(sim_reply_count(250) == 1);
+	CHECK(!sim_exists("/new"));
+}
+
+static void test_idle_timeout(void) {
+	const char *script[] = { LOGIN, "~100000", "NOOP", NULL };
+	test_session(script, NULL, 0);
+	// only reply to TYPE, session is closed before NOOP
+	CHECK(sim_reply_count(200) == 1);
+	CHECK(sim_time_ms() >= FTP_SERVER_INACTIVE_TIMEOUT_MS && sim_time_ms() < FTP_SERVER_INACTIVE_TIMEOUT_MS + FTP_IDLE_WAIT_SLICE_MS);
+}
+
+// =========================================================
+//
+//                    SITE
+//
+// =========================================================
+
+static void test_mstat_reset(void) {
+	static const char names[] = "a.bin\r\nb.bin\r\n";
+	CHECK(sim_file_create("/a.bin", NULL, 1));
+	sim_ops[SIM_DATA_RECV] = (sim_op_cfg_t ) { .fail_at = 1, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "SITE MSTAT", "QUIT", NULL };
+	test_session(script, (const uint8_t*) names, sizeof(names) - 1);
+	// open 250- reply must be closed by 250 line
+	CHECK(strstr(sim_replies(), "250-Status\r\n250 Status aborted, 0 found, 0 missing\r\n") != NULL);
+	CHECK(sim_reply_count(451) == 0);
+}
+
+#if FTP_SITE_SYNC == 1
+static void test_sync_reset(void) {
+	static const char manifest[] = "Size=1; a.bin\r\n";
+	CHECK(sim_file_create("/a.bin", NULL, 1));
+	sim_ops[SIM_DATA_RECV] = (sim_op_cfg_t ) { .fail_at = 1, .fail_err = ERR_RST };
+	const char *script[] = { LOGIN, "PASV", "SITE SYNC", "QUIT", NULL };
+	test_session(script, (const uint8_t*) manifest, sizeof(manifest) - 1);
+	CHECK(strstr(sim_replies(), "250-Differences\r\n250 Sync aborted, 0 changed, 0 new, 0 missing, 0 skipped\r\n") != NULL);
+	CHECK(sim_reply_count(451) == 0);
+}
+#endif
+
+#if FTP_SITE_COPY == 1
+static void test_copy_same_file(void) {
+	CHECK(sim_file_create("/a.txt", NULL, 1000));
+	const char *script[] = { LOGIN, "SITE CPFR a.txt", "SITE CPTO /A.TXT", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	// FAT opens source for CPTO of same name in other case, it must not be truncated
+	CHECK(sim_reply_count(553) == 1);
+	CHECK(!sim_exists("/A.TXT"));
+	uint64_t size;
+	const uint8_t *data = sim_file_data("/a.txt", &size);
+	CHECK(data != NULL && size == 1000 && test_pattern_equal(data, size, 0));
+}
+#endif
+
+#if FTP_JOURNAL == 1
+// changes reported by application, records of about 30 bytes, 17 in one sector
+static void test_journal_changes(uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		char path[32];
+		snprintf(path, sizeof(path), "/data/file_%04lu.bin", (unsigned long) i);
+		ftp_notify_change(FTP_CHANGE_MODIFIED, path, NULL, 1000 + i);
+	}
+}
+
+static uint32_t test_line_count(const uint8_t *data, uint32_t len) {
+	uint32_t lines = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		lines += (data[i] == '\n');
+	}
+	return (lines);
+}
+
+static void test_journal_rotation(void) {
+	// file is rotated at FTP_JOURNAL_MAX_SIZE / 2, so 100 changes rotate it more times
+	test_journal_changes(100);
+	CHECK(sim_exists(FTP_JOURNAL_OLD_PATH));
+	CHECK(FTP.stats.journal_records == 100);
+	CHECK(FTP.stats.journal_errors == 0);
+	const char *script[] = { LOGIN, "SITE CHANGES SINCE 0", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	const char *start = strstr(sim_replies(), "550 Journal starts at ");
+	CHECK(start != NULL);
+	uint32_t first = strtoul(start + 22, NULL, 10);
+	CHECK(first > 1 && first < 100);
+
+	// everything since first record which is kept
+	char since[32];
+	snprintf(since, sizeof(since), "SITE CHANGES SINCE %lu", (unsigned long) first - 1);
+	const char *again[] = { LOGIN, "PASV", since, "QUIT", NULL };
+	test_session(again, NULL, 0);
+	uint32_t len;
+	const uint8_t *data = sim_download(&len);
+	CHECK(sim_reply_count(226) == 1);
+	CHECK(data != NULL && test_line_count(data, len) == 100 - first + 1);
+	char line[32];
+	snprintf(line, sizeof(line), "%lu M 1", (unsigned long) first);
+	CHECK(!strncmp((const char*) data, line, strlen(line)));
+	CHECK(strstr((const char*) data, "100 M 1099 /data/file_0099.bin\r\n") != NULL);
+}
+
+// journal is rotated by other session while SITE CHANGES opens it
+static void test_journal_rotate_now(void) {
+	sim_ops[SIM_FS_OPEN].after = NULL;
+	test_journal_changes(40);
+}
+
+static void test_journal_rotated(void) {
+	test_journal_changes(50);
+	ftp_journal_flush();
+	CHECK(sim_exists(FTP_JOURNAL_OLD_PATH));
+	sim_ops[SIM_FS_OPEN].after = test_journal_rotate_now;
+	const char *script[] = { LOGIN, "PASV", "SITE CHANGES SINCE 0", "NOOP", "QUIT", NULL };
+	test_session(script, NULL, 0);
+	CHECK(strstr(sim_replies(), "451 Journal was rotated, try again\r\n") != NULL);
+	CHECK(sim_reply_count(226) == 0);
+	// session goes on, client asks again
+	CHECK(sim_reply_count(221) == 1);
+}
+
+// journal files are written by server only
+static void test_journal_reserved(void) {
+	test_journal_changes(50);
+	ftp_journal_flush();
+	uint64_t size, old_size;
+	CHECK(sim_file_data(FTP_JOURNAL_PATH, &size) != NULL);
+	CHECK(sim_file_data(FTP_JOURNAL_OLD_PATH, &old_size) != NULL);
+	// FAT finds names regardless of case, sim does not, so only STOR which creates file is tried in other case
+	const char *script[] = { LOGIN, "DELE " FTP_JOURNAL_PATH, "DELE " FTP_JOURNAL_OLD_PATH, "RNFR " FTP_JOURNAL_PATH, "RNTO /x",
+			"PASV", "STOR /.FTP_Journal.OLD", "PASV", "RETR " FTP_JOURNAL_PATH, "QUIT", NULL };
+	test_session(script, test_upload(10), 10);
+	CHECK(sim_reply_count(450) == 5);
+	CHECK(sim_reply_count(250) == 0);
+	CHECK(sim_reply_count(226) == 0);
+	uint64_t now;
+	CHECK(sim_file_data(FTP_JOURNAL_PATH, &now) != NULL && now == size);
+	CHECK(sim_file_data(FTP_JOURNAL_OLD_PATH, &now) != NULL && now == old_size);
+	CHECK(!sim_exists("/x"));
+}
+#endif
+
+#if FTP_TRACE_ENABLE == 1
+static uint8_t test_trace[4096];
+static uint32_t test_trace_len;
+
+static void test_trace_write(const void *hdr, uint32_t hdr_len, const void *data, uint32_t data_len) {
+	if (test_trace_len + hdr_len + data_len <= sizeof(test_trace)) {
+		memcpy(test_trace + test_trace_len, hdr, hdr_len);
+		if (data_len) {
+			memcpy(test_trace + test_trace_len + hdr_len, data, data_len);
+		}
+		test_trace_len += hdr_len + data_len;
+	}
+}
+
+static void test_trace_session(void) {
+	test_trace_len = 0;
+	const char *script[] = { LOGIN, "QUIT", NULL };
+	test_session(script, NULL, 0);
+	uint32_t counts[FTP_TRACE_DISCONNECT + 1] = { 0 };
+	ftp_trace_hdr_t hdr;
+	ftp_trace_type_t last = FTP_TRACE_DISCONNECT;
+	for (uint32_t ofs = 0; ofs + sizeof(hdr) <= test_trace_len; ofs += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, test_trace + ofs, sizeof(hdr));
+		CHECK(hdr.type <= FTP_TRACE_DISCONNECT && hdr.session == 0);
+		CHECK(ofs != 0 || hdr.type == FTP_TRACE_CONNECT);
+		if (hdr.type == FTP_TRACE_COMMAND && hdr.len >= 4 && !memcmp(test_trace + ofs + sizeof(hdr), "PASS", 4)) {
+			// password is not recorded
+			CHECK(hdr.len == 5);
+		}
+		counts[hdr.type]++;
+		last = hdr.type;
+	}
+	CHECK(last == FTP_TRACE_DISCONNECT);
+	CHECK(counts[FTP_TRACE_CONNECT] == 1 && counts[FTP_TRACE_DISCONNECT] == 1);
+	// USER, PASS, TYPE and QUIT, replies to them and 220 greeting
+	CHECK(counts[FTP_TRACE_COMMAND] == 4);
+	CHECK(counts[FTP_TRACE_REPLY] == 5);
+}
+#endif
+
+typedef struct {
+	const char *name;
+	void (*func)(void);
+} test_t;
+
+static const test_t tests[] = {
+	{ "retr_ok", test_retr_ok },
+	{ "retr_rest", test_retr_rest },
+	{ "retr_disk_error", test_retr_disk_error },
+	{ "retr_reset", test_retr_reset },
+	{ "retr_accept_timeout", test_retr_accept_timeout },
+	{ "retr_short_write", test_retr_short_write },
+	{ "retr_slow_client", test_retr_slow_client },
+	{ "retr_big_rest", test_retr_big_rest },
+	{ "big_listing", test_big_listing },
+	{ "stor_ok", test_stor_ok },
+	{ "stor_disk_error", test_stor_disk_error },
+	{ "stor_short_write", test_stor_short_write },
+	{ "stor_reset", test_stor_reset },
+	{ "stor_stall", test_stor_stall },
+	{ "stor_reply_lost", test_stor_reply_lost },
+	{ "stor_keeps_cwd", test_stor_keeps_cwd },
+	{ "stor_accept_timeout", test_stor_accept_timeout },
+#if FTP_SHARED_READ == 1
+	{ "shared_read", test_shared_read },
+#endif
+#if FTP_OPEN_CACHE == 1
+	{ "open_cache_changes", test_open_cache_changes },
+	{ "open_cache_race", test_open_cache_race },
+#endif
+#if FTP_FILE_LOCK == 1 && FTP_NBR_CLIENTS > 1
+	{ "lock_case", test_lock_case },
+#endif
+	{ "ascii_retr", test_ascii_retr },
+	{ "ascii_stor", test_ascii_stor },
+	{ "ascii_convert", test_ascii_convert },
+	{ "list_ok", test_list_ok },
+	{ "list_readdir_error", test_list_readdir_error },
+	{ "list_reset", test_list_reset },
+	{ "list_accept_timeout", test_list_accept_timeout },
+	{ "deep_lookups", test_deep_lookups },
+	{ "mkd_keeps_cwd", test_mkd_keeps_cwd },
+	{ "idle_timeout", test_idle_timeout },
+	{ "mstat_reset", test_mstat_reset },
+#if FTP_SITE_SYNC == 1
+	{ "sync_reset", test_sync_reset },
+#endif
+#if FTP_SITE_COPY == 1
+	{ "copy_same_file", test_copy_same_file },
+#endif
+#if FTP_TRACE_ENABLE == 1
+	{ "trace_session", test_trace_session },
+#endif
+#if FTP_JOURNAL == 1
+	{ "journal_rotation", test_journal_rotation },
+	{ "journal_rotated", test_journal_rotated },
+	{ "journal_reserved", test_journal_reserved },
+#endif
+};
+
+int main(int argc, char **argv) {
+	int failed = 0;
+	int run = 0;
+	ftp_init();
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], tests[i].name)) {
+			continue;
+		}
+		test_reset();
+		test_failed = 0;
+		tests[i].func();
+		printf("%s %s\n", test_failed ? "FAIL" : "ok  ", tests[i].name);
+		failed += test_failed;
+		run++;
+	}
+	sim_reset();
+	printf("%d/%d passed\n", run - failed, run);
+	return (failed || run == 0 ? 1 : 0);
+}
@@ -0,0 +1,40 @@
+/*
+ * FreeRTOS.h
+ *
+ * Host stub of FreeRTOS for tests and fuzzing, sessions are run by test in one thread,
+ * so tasks are never started and mutexes are never contended
+ */
+
+#ifndef HOST_STUBS_FREERTOS_H_
+#define HOST_STUBS_FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t StackType_t;
+typedef void *TaskHandle_t;
+typedef struct {
+	void *dummy[8];
+} StaticTask_t;
+
+#define pdTRUE						((BaseType_t) 1)
+#define pdFALSE						((BaseType_t) 0)
+#define pdPASS						pdTRUE
+#define portMAX_DELAY				((TickType_t) 0xFFFFFFFFu)
+#define portTICK_PERIOD_MS			((TickType_t) 1)
+#define configTICK_RATE_HZ			((TickType_t) 1000)
+#define configMAX_TASK_NAME_LEN		16
+#define configSUPPORT_STATIC_ALLOCATION	1
+#define pdMS_TO_TICKS(ms)			((TickType_t) (ms))
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskCreate(void (*task)(void*), const char *name, uint32_t stack, void *param, UBaseType_t priority, TaskHandle_t *handle);
+TaskHandle_t xTaskCreateStatic(void (*task)(void*), const char *name, uint32_t stack, void *param, UBaseType_t priority, StackType_t *stack_buffer,
+		StaticTask_t *task_buffer);
+
+#endif /* HOST_STUBS_FREERTOS_H_ */
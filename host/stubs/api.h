@@ -0,0 +1,82 @@
+/*
+ * api.h
+ *
+ * Host stub of lwIP netconn types, calls are replaced by simulation in sim.h
+ * through FTP_NETCONN_* macros of ftp_custom.h
+ */
+
+#ifndef HOST_STUBS_API_H_
+#define HOST_STUBS_API_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t err_t;
+
+#define ERR_OK						0
+#define ERR_MEM						-1
+#define ERR_BUF						-2
+#define ERR_TIMEOUT					-3
+#define ERR_RTE						-4
+#define ERR_INPROGRESS				-5
+#define ERR_VAL						-6
+#define ERR_WOULDBLOCK				-7
+#define ERR_USE						-8
+#define ERR_ALREADY					-9
+#define ERR_ISCONN					-10
+#define ERR_CONN					-11
+#define ERR_IF						-12
+#define ERR_ABRT					-13
+#define ERR_RST						-14
+#define ERR_CLSD					-15
+#define ERR_ARG						-16
+
+typedef struct {
+	uint32_t addr;
+} ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY					(&ip_addr_any)
+#define IP4_ADDR(ipaddr, a, b, c, d)	((ipaddr)->addr = ((uint32_t) (a)) | ((uint32_t) (b) << 8) | ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+
+enum netconn_type {
+	NETCONN_TCP = 0x10
+};
+
+enum netconn_state {
+	NETCONN_NONE,
+	NETCONN_WRITE,
+	NETCONN_LISTEN,
+	NETCONN_CONNECT,
+	NETCONN_CLOSE
+};
+
+#define NETCONN_NOFLAG				0x00
+#define NETCONN_NOCOPY				0x00
+#define NETCONN_COPY				0x01
+#define NETCONN_MORE				0x02
+#define NETCONN_DONTBLOCK			0x04
+
+struct sim_conn;
+
+struct netconn {
+	enum netconn_state state;
+	struct sim_conn *sim;
+};
+
+struct pbuf {
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len;
+	u16_t len;
+};
+
+struct netbuf {
+	struct pbuf *p;
+};
+
+#endif /* HOST_STUBS_API_H_ */
@@ -0,0 +1,12 @@
+/*
+ * event_groups.h
+ *
+ * Host stub, event groups are not used by server
+ */
+
+#ifndef HOST_STUBS_EVENT_GROUPS_H_
+#define HOST_STUBS_EVENT_GROUPS_H_
+
+#include "FreeRTOS.h"
+
+#endif /* HOST_STUBS_EVENT_GROUPS_H_ */
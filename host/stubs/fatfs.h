@@ -0,0 +1,93 @@
+/*
+ * fatfs.h
+ *
+ * Host stub of FatFs types, calls are replaced by simulated volume in sim.h
+ * through FTP_F_* macros of ftp_custom.h
+ */
+
+#ifndef HOST_STUBS_FATFS_H_
+#define HOST_STUBS_FATFS_H_
+
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef QWORD FSIZE_t;
+
+#define _MAX_LFN					255
+#ifndef _FS_RPATH
+#define _FS_RPATH					0
+#endif
+#define _FS_LOCK					0
+
+typedef struct {
+	BYTE csize; // sectors per cluster
+	DWORD n_fatent; // clusters + 2
+} FATFS;
+
+// file is node of simulated volume, position and size are kept here like in FatFs,
+// so copied FIL (open cache) works the same way
+typedef struct {
+	int node;
+	BYTE mode;
+	FSIZE_t fptr;
+	FSIZE_t objsize;
+} FIL;
+
+typedef struct {
+	int node;
+	int index;
+} DIR;
+
+typedef struct {
+	FSIZE_t fsize;
+	WORD fdate;
+	WORD ftime;
+	BYTE fattrib;
+	char fname[_MAX_LFN + 1];
+} FILINFO;
+
+typedef enum {
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_NO_PATH,
+	FR_INVALID_NAME,
+	FR_DENIED,
+	FR_EXIST,
+	FR_INVALID_OBJECT,
+	FR_WRITE_PROTECTED,
+	FR_INVALID_DRIVE,
+	FR_NOT_ENABLED,
+	FR_NO_FILESYSTEM,
+	FR_MKFS_ABORTED,
+	FR_TIMEOUT,
+	FR_LOCKED,
+	FR_NOT_ENOUGH_CORE,
+	FR_TOO_MANY_OPEN_FILES,
+	FR_INVALID_PARAMETER
+} FRESULT;
+
+#define FA_READ						0x01
+#define FA_WRITE					0x02
+#define FA_OPEN_EXISTING			0x00
+#define FA_CREATE_NEW				0x04
+#define FA_CREATE_ALWAYS			0x08
+#define FA_OPEN_ALWAYS				0x10
+#define FA_OPEN_APPEND				0x30
+
+#define AM_RDO						0x01
+#define AM_HID						0x02
+#define AM_SYS						0x04
+#define AM_DIR						0x10
+#define AM_ARC						0x20
+
+#define f_size(fp)					((fp)->objsize)
+#define f_tell(fp)					((fp)->fptr)
+
+#endif /* HOST_STUBS_FATFS_H_ */
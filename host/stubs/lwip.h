@@ -0,0 +1,20 @@
+/*
+ * lwip.h
+ *
+ * Host stub of lwIP options used by server
+ */
+
+#ifndef HOST_STUBS_LWIP_H_
+#define HOST_STUBS_LWIP_H_
+
+#include <stdint.h>
+
+#define TCP_MSS						1460
+#define TCP_SND_BUF					(4 * TCP_MSS)
+#define LWIP_SO_SNDTIMEO			1
+#define LWIP_SO_RCVTIMEO			1
+#define LWIP_TCP_KEEPALIVE			1
+#define LWIP_TCPIP_CORE_LOCKING		1
+#define MEMP_MEM_MALLOC				0
+
+#endif /* HOST_STUBS_LWIP_H_ */
@@ -0,0 +1,24 @@
+/*
+ * semphr.h
+ *
+ * Host stub of FreeRTOS semaphores, recursive mutex only counts its depth
+ */
+
+#ifndef HOST_STUBS_SEMPHR_H_
+#define HOST_STUBS_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+typedef struct {
+	int depth;
+} host_mutex_t;
+
+typedef host_mutex_t *SemaphoreHandle_t;
+typedef host_mutex_t StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t *buffer);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t timeout);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
+
+#endif /* HOST_STUBS_SEMPHR_H_ */
@@ -0,0 +1,12 @@
+/*
+ * task.h
+ *
+ * Host stub, tasks are declared in FreeRTOS.h
+ */
+
+#ifndef HOST_STUBS_TASK_H_
+#define HOST_STUBS_TASK_H_
+
+#include "FreeRTOS.h"
+
+#endif /* HOST_STUBS_TASK_H_ */